@@ -0,0 +1,375 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "backendbalancer.h"
+#include "memutil.h"
+#include <assert.h>
+#include <stdlib.h>
+
+/* Connect latency averages are fixed point with this scale. */
+#define EWMA_SCALE (16)
+/* Weight of a new sample is 1/(2^EWMA_WEIGHT_SHIFT). */
+#define EWMA_WEIGHT_SHIFT (3)
+/* An average with no new samples halves every half life, so a
+   backend that looked slow or failed is tried again. */
+#define EWMA_HALF_LIFE_MILLIS (1000)
+/* Latency sample recorded for a failed connect. */
+#define FAILED_CONNECT_PENALTY_MILLIS (1000)
+/* A target that failed is skipped for this long, doubling with each
+   further failure in a row up to the maximum. */
+#define MIN_TARGET_RETRY_MILLIS (1000)
+#define MAX_TARGET_RETRY_MILLIS (30 * 1000)
+
+void initializeBackendBalancer(
+  struct BackendBalancer* backendBalancer,
+  enum BackendBalanceMode balanceMode,
+  size_t numBackends,
+  size_t threadNumber)
+{
+  assert(numBackends > 0);
+
+  backendBalancer->balanceMode = balanceMode;
+  backendBalancer->numBackends = numBackends;
+  backendBalancer->backendLoadArray =
+    checkedCalloc(numBackends, sizeof(struct BackendLoad));
+  /* Threads start round robin at different backends. */
+  backendBalancer->nextRoundRobinIndex = threadNumber % numBackends;
+  /* xorshift state must not be 0. */
+  backendBalancer->randomState =
+    (uint32_t)(2654435761U * (threadNumber + 1));
+}
+
+void setBackendNumTargets(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t numTargets)
+{
+  struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+
+  assert(numTargets > 0);
+
+  free(backendLoad->targetArray);
+  backendLoad->numTargets = numTargets;
+  backendLoad->targetArray =
+    checkedCalloc(numTargets, sizeof(struct BackendTarget));
+}
+
+const char* backendBalanceModeString(
+  enum BackendBalanceMode balanceMode)
+{
+  switch (balanceMode)
+  {
+  case BACKEND_BALANCE_ROUND_ROBIN:
+    return "rr";
+  case BACKEND_BALANCE_LEAST_OUTSTANDING:
+    return "least";
+  case BACKEND_BALANCE_P2C_EWMA:
+    return "p2c";
+  }
+  return "unknown";
+}
+
+static uint32_t nextRandom(
+  struct BackendBalancer* backendBalancer)
+{
+  uint32_t x = backendBalancer->randomState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  backendBalancer->randomState = x;
+  return x;
+}
+
+static uint64_t getDecayedConnectLatencyEWMA(
+  const struct BackendLoad* backendLoad,
+  int64_t nowMillis)
+{
+  const int64_t halfLives =
+    (nowMillis - backendLoad->lastSampleMillis) / EWMA_HALF_LIFE_MILLIS;
+  if (halfLives >= 32)
+  {
+    return 0;
+  }
+  return (backendLoad->connectLatencyEWMA >> ((halfLives > 0) ? halfLives : 0));
+}
+
+/* Cost of sending one more session to a backend.  The added scale
+   keeps backends with no measurable latency ordered by load. */
+static uint64_t getBackendCost(
+  const struct BackendLoad* backendLoad,
+  int64_t nowMillis)
+{
+  return ((getDecayedConnectLatencyEWMA(backendLoad, nowMillis) + EWMA_SCALE) *
+          (((uint64_t)(backendLoad->numOutstanding)) + 1));
+}
+
+static bool targetIsUsable(
+  const struct BackendTarget* backendTarget,
+  int64_t nowMillis)
+{
+  return (backendTarget->retryAfterMillis <= nowMillis);
+}
+
+bool backendIsUsable(
+  const struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  int64_t nowMillis)
+{
+  const struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+  size_t i;
+
+  for (i = 0; i < backendLoad->numTargets; ++i)
+  {
+    if (targetIsUsable(&(backendLoad->targetArray[i]), nowMillis))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t chooseBackendTarget(
+  const struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  int64_t nowMillis)
+{
+  const struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+  size_t soonestIndex = 0;
+  size_t i;
+
+  for (i = 0; i < backendLoad->numTargets; ++i)
+  {
+    const struct BackendTarget* backendTarget =
+      &(backendLoad->targetArray[i]);
+    if (targetIsUsable(backendTarget, nowMillis))
+    {
+      return i;
+    }
+    if (backendTarget->retryAfterMillis <
+        backendLoad->targetArray[soonestIndex].retryAfterMillis)
+    {
+      soonestIndex = i;
+    }
+  }
+  return soonestIndex;
+}
+
+bool chooseNextBackendTarget(
+  const struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t* targetIndex,
+  int64_t nowMillis)
+{
+  const struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+  size_t i;
+
+  for (i = (*targetIndex) + 1; i < backendLoad->numTargets; ++i)
+  {
+    if (targetIsUsable(&(backendLoad->targetArray[i]), nowMillis))
+    {
+      *targetIndex = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t chooseLeastOutstandingBackend(
+  struct BackendBalancer* backendBalancer)
+{
+  /* Scan from the round robin index so ties rotate. */
+  const size_t numBackends = backendBalancer->numBackends;
+  const size_t firstIndex = backendBalancer->nextRoundRobinIndex;
+  size_t bestIndex = firstIndex;
+  size_t i;
+
+  for (i = 1; i < numBackends; ++i)
+  {
+    const size_t index = (firstIndex + i) % numBackends;
+    if (backendBalancer->backendLoadArray[index].numOutstanding <
+        backendBalancer->backendLoadArray[bestIndex].numOutstanding)
+    {
+      bestIndex = index;
+    }
+  }
+  backendBalancer->nextRoundRobinIndex = (firstIndex + 1) % numBackends;
+  return bestIndex;
+}
+
+static size_t chooseP2CBackend(
+  struct BackendBalancer* backendBalancer,
+  int64_t nowMillis)
+{
+  const size_t numBackends = backendBalancer->numBackends;
+  size_t index1;
+  size_t index2;
+
+  index1 = nextRandom(backendBalancer) % numBackends;
+  index2 = nextRandom(backendBalancer) % (numBackends - 1);
+  if (index2 >= index1)
+  {
+    ++index2;
+  }
+  return ((getBackendCost(&(backendBalancer->backendLoadArray[index2]),
+                          nowMillis) <
+           getBackendCost(&(backendBalancer->backendLoadArray[index1]),
+                          nowMillis)) ?
+          index2 : index1);
+}
+
+size_t chooseBackend(
+  struct BackendBalancer* backendBalancer,
+  int64_t nowMillis)
+{
+  size_t backendIndex = 0;
+
+  if (backendBalancer->numBackends == 1)
+  {
+    return 0;
+  }
+
+  switch (backendBalancer->balanceMode)
+  {
+  case BACKEND_BALANCE_ROUND_ROBIN:
+    backendIndex = backendBalancer->nextRoundRobinIndex;
+    backendBalancer->nextRoundRobinIndex =
+      (backendIndex + 1) % backendBalancer->numBackends;
+    break;
+
+  case BACKEND_BALANCE_LEAST_OUTSTANDING:
+    backendIndex = chooseLeastOutstandingBackend(backendBalancer);
+    break;
+
+  case BACKEND_BALANCE_P2C_EWMA:
+    backendIndex = chooseP2CBackend(backendBalancer, nowMillis);
+    break;
+  }
+
+  /* Move on to the next usable backend, if there is one. */
+  if (!backendIsUsable(backendBalancer, backendIndex, nowMillis))
+  {
+    size_t i;
+    for (i = 1; i < backendBalancer->numBackends; ++i)
+    {
+      const size_t nextIndex =
+        (backendIndex + i) % backendBalancer->numBackends;
+      if (backendIsUsable(backendBalancer, nextIndex, nowMillis))
+      {
+        /* Keep round robin even over the usable backends. */
+        if (backendBalancer->balanceMode == BACKEND_BALANCE_ROUND_ROBIN)
+        {
+          backendBalancer->nextRoundRobinIndex =
+            (nextIndex + 1) % backendBalancer->numBackends;
+        }
+        return nextIndex;
+      }
+    }
+  }
+  return backendIndex;
+}
+
+void addBackendOutstanding(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex)
+{
+  ++(backendBalancer->backendLoadArray[backendIndex].numOutstanding);
+}
+
+void removeBackendOutstanding(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex)
+{
+  struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+  assert(backendLoad->numOutstanding > 0);
+  --(backendLoad->numOutstanding);
+}
+
+static void addConnectLatencySample(
+  struct BackendLoad* backendLoad,
+  int64_t connectMillis,
+  int64_t nowMillis)
+{
+  int64_t ewma =
+    getDecayedConnectLatencyEWMA(backendLoad, nowMillis);
+  int64_t sample;
+
+  if (connectMillis < 0)
+  {
+    connectMillis = 0;
+  }
+  else if (connectMillis > FAILED_CONNECT_PENALTY_MILLIS)
+  {
+    connectMillis = FAILED_CONNECT_PENALTY_MILLIS;
+  }
+  sample = connectMillis * EWMA_SCALE;
+  ewma += (sample - ewma) / (1 << EWMA_WEIGHT_SHIFT);
+  backendLoad->connectLatencyEWMA = (uint32_t)ewma;
+  backendLoad->lastSampleMillis = nowMillis;
+}
+
+void recordBackendConnectSuccess(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t targetIndex,
+  int64_t connectMillis,
+  int64_t nowMillis)
+{
+  struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+  struct BackendTarget* backendTarget =
+    &(backendLoad->targetArray[targetIndex]);
+
+  addConnectLatencySample(backendLoad, connectMillis, nowMillis);
+  backendTarget->numConsecutiveFailures = 0;
+  backendTarget->retryAfterMillis = 0;
+}
+
+void recordBackendConnectFailure(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t targetIndex,
+  int64_t nowMillis)
+{
+  struct BackendLoad* backendLoad =
+    &(backendBalancer->backendLoadArray[backendIndex]);
+  struct BackendTarget* backendTarget =
+    &(backendLoad->targetArray[targetIndex]);
+  int64_t retryMillis = MIN_TARGET_RETRY_MILLIS;
+  uint32_t i;
+
+  addConnectLatencySample(
+    backendLoad,
+    FAILED_CONNECT_PENALTY_MILLIS,
+    nowMillis);
+  for (i = 0;
+       (i < backendTarget->numConsecutiveFailures) &&
+       (retryMillis < MAX_TARGET_RETRY_MILLIS);
+       ++i)
+  {
+    retryMillis *= 2;
+  }
+  if (retryMillis > MAX_TARGET_RETRY_MILLIS)
+  {
+    retryMillis = MAX_TARGET_RETRY_MILLIS;
+  }
+  ++(backendTarget->numConsecutiveFailures);
+  backendTarget->retryAfterMillis = nowMillis + retryMillis;
+}
@@ -0,0 +1,135 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BACKENDBALANCER_H
+#define BACKENDBALANCER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum BackendBalanceMode
+{
+  BACKEND_BALANCE_ROUND_ROBIN,
+  BACKEND_BALANCE_LEAST_OUTSTANDING,
+  BACKEND_BALANCE_P2C_EWMA
+};
+
+/* One thread's view of one address of a backend. */
+struct BackendTarget
+{
+  /* Failed connects since the last one that succeeded. */
+  uint32_t numConsecutiveFailures;
+  /* After a failure the target is skipped until this time, for
+     longer the more failures in a row it had. */
+  int64_t retryAfterMillis;
+};
+
+/* One thread's view of the load it puts on a backend. */
+struct BackendLoad
+{
+  /* Sessions of this thread connecting or connected to the backend. */
+  uint32_t numOutstanding;
+  /* Moving average of connect latency in 1/16 milliseconds, and the
+     time of its last sample.  Failed connects count as slow ones. */
+  uint32_t connectLatencyEWMA;
+  int64_t lastSampleMillis;
+  size_t numTargets;
+  struct BackendTarget* targetArray;
+};
+
+/* Picks the backend for each new session.  Each I/O thread has its
+   own balancer and counts only its own sessions, so choosing a
+   backend takes no locks or shared writes.  The acceptor spreads
+   sessions evenly over I/O threads, so balancing each thread's share
+   balances the whole.  Backends with no usable target are only
+   chosen when no backend has one. */
+struct BackendBalancer
+{
+  enum BackendBalanceMode balanceMode;
+  size_t numBackends;
+  struct BackendLoad* backendLoadArray;
+  size_t nextRoundRobinIndex;
+  uint32_t randomState;
+};
+
+extern void initializeBackendBalancer(
+  struct BackendBalancer* backendBalancer,
+  enum BackendBalanceMode balanceMode,
+  size_t numBackends,
+  size_t threadNumber);
+
+/* Sets the number of addresses of backendIndex and forgets their
+   failures. */
+extern void setBackendNumTargets(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t numTargets);
+
+extern const char* backendBalanceModeString(
+  enum BackendBalanceMode balanceMode);
+
+/* Returns the index of the backend for a new session. */
+extern size_t chooseBackend(
+  struct BackendBalancer* backendBalancer,
+  int64_t nowMillis);
+
+/* Returns true if backendIndex has a target not skipped after
+   failures. */
+extern bool backendIsUsable(
+  const struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  int64_t nowMillis);
+
+/* Returns the first usable target of backendIndex, or the one that
+   becomes usable soonest if none is usable. */
+extern size_t chooseBackendTarget(
+  const struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  int64_t nowMillis);
+
+/* Sets *targetIndex to the next usable target of backendIndex after
+   it.  Returns false if there is none. */
+extern bool chooseNextBackendTarget(
+  const struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t* targetIndex,
+  int64_t nowMillis);
+
+/* A session started connecting to backendIndex. */
+extern void addBackendOutstanding(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex);
+
+/* A session's connection to backendIndex closed. */
+extern void removeBackendOutstanding(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex);
+
+extern void recordBackendConnectSuccess(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t targetIndex,
+  int64_t connectMillis,
+  int64_t nowMillis);
+
+extern void recordBackendConnectFailure(
+  struct BackendBalancer* backendBalancer,
+  size_t backendIndex,
+  size_t targetIndex,
+  int64_t nowMillis);
+
+#endif
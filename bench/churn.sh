@@ -0,0 +1,45 @@
+#!/bin/sh
+
+# Connection churn: runs SESSIONS short sessions through cproxy,
+# CONCURRENCY at a time, each echoing MESSAGE_SIZE bytes.  Reports
+# the proxy's poll calls and events, and how many poll calls and
+# blocking wakeups it took per MB relayed.  Extra arguments go to
+# cproxy (default -t 1).
+#
+#   make && make -C bench && bench/churn.sh [cproxy args]
+
+. "$(dirname "$0")/common.sh"
+
+SESSIONS=${SESSIONS:-20000}
+CONCURRENCY=${CONCURRENCY:-100}
+MESSAGE_SIZE=${MESSAGE_SIZE:-2000}
+
+if [ $# -eq 0 ]; then
+  set -- -t 1
+fi
+start_proxy "$@"
+CALLS_BEFORE=$(proxy_poll_calls)
+EVENTS_BEFORE=$(proxy_poll_events)
+WAKEUPS_BEFORE=$(proxy_wakeups)
+CPU_BEFORE=$(proxy_cpu_ticks)
+RESULT=$("${LOADGEN}" churn "${PROXY_PORT}" "${ECHO_PORT}" \
+         "${CONCURRENCY}" "${MESSAGE_SIZE}" "${SESSIONS}")
+STATUS=$?
+CALLS=$(($(proxy_poll_calls) - ${CALLS_BEFORE}))
+EVENTS=$(($(proxy_poll_events) - ${EVENTS_BEFORE}))
+WAKEUPS=$(($(proxy_wakeups) - ${WAKEUPS_BEFORE}))
+CPU=$(($(proxy_cpu_ticks) - ${CPU_BEFORE}))
+stop_proxy
+if [ ${STATUS} -ne 0 ]; then
+  exit ${STATUS}
+fi
+
+echo "${RESULT}"
+awk -v calls="${CALLS}" -v events="${EVENTS}" -v wakeups="${WAKEUPS}" \
+    -v cpu="${CPU}" -v ticks="${CLOCK_TICKS}" \
+    -v bytes="$(result_value "${RESULT}" relayed_bytes)" 'BEGIN {
+  mb = bytes / 1048576
+  printf("poll_calls=%d poll_events=%d poll_calls_per_mb=%.1f " \
+         "wakeups_per_mb=%.1f proxy_cpu_s=%.2f\n",
+         calls, events, calls / mb, wakeups / mb, cpu / ticks)
+}'
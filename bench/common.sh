@@ -0,0 +1,72 @@
+# Shared by the benchmark scripts.  Starts ../cproxy from the
+# directory of the script, relaying 127.0.0.1:${PROXY_PORT} to the
+# loadgen echo server on 127.0.0.1:${ECHO_PORT}, and reads counters of
+# the running proxy from /proc and from pollcount.so (Linux only).
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+PROXY="${BENCH_DIR}/../cproxy"
+LOADGEN="${BENCH_DIR}/loadgen"
+POLLCOUNT="${BENCH_DIR}/pollcount.so"
+PROXY_PORT=${PROXY_PORT:-15000}
+ECHO_PORT=${ECHO_PORT:-15001}
+PROXY_LOG=${PROXY_LOG:-/dev/null}
+CLOCK_TICKS=$(getconf CLK_TCK)
+
+if [ ! -x "${PROXY}" ] || [ ! -x "${LOADGEN}" ] || [ ! -f "${POLLCOUNT}" ]; then
+  echo "build cproxy with make and the tools with make -C bench first" >&2
+  exit 1
+fi
+
+POLLCOUNT_FILE=$(mktemp)
+trap 'rm -f "${POLLCOUNT_FILE}"' EXIT
+head -c 16 /dev/zero > "${POLLCOUNT_FILE}"
+
+start_proxy() {
+  echo "${PROXY} -l 127.0.0.1:${PROXY_PORT} -r 127.0.0.1:${ECHO_PORT} $*"
+  LD_PRELOAD="${POLLCOUNT}" POLLCOUNT_FILE="${POLLCOUNT_FILE}" \
+    "${PROXY}" -l "127.0.0.1:${PROXY_PORT}" -r "127.0.0.1:${ECHO_PORT}" "$@" \
+    > "${PROXY_LOG}" 2>&1 &
+  PROXY_PID=$!
+  sleep 0.5
+  if ! kill -0 "${PROXY_PID}" 2> /dev/null; then
+    echo "cproxy failed to start" >&2
+    exit 1
+  fi
+}
+
+stop_proxy() {
+  kill "${PROXY_PID}" 2> /dev/null
+  wait "${PROXY_PID}" 2> /dev/null
+}
+
+# epoll_wait or poll calls of all proxy threads, and the ready events
+# they returned.
+proxy_poll_calls() {
+  od -A n -t u8 -j 0 -N 8 "${POLLCOUNT_FILE}" | tr -d ' '
+}
+
+proxy_poll_events() {
+  od -A n -t u8 -j 8 -N 8 "${POLLCOUNT_FILE}" | tr -d ' '
+}
+
+# Voluntary context switches of all proxy threads, which is how many
+# times they blocked and were woken up.
+proxy_wakeups() {
+  cat /proc/"${PROXY_PID}"/task/*/status |
+    awk '/^voluntary_ctxt_switches/ { n += $2 } END { print n }'
+}
+
+# User plus system CPU time of the proxy in clock ticks.
+proxy_cpu_ticks() {
+  awk '{ print $14 + $15 }' /proc/"${PROXY_PID}"/stat
+}
+
+# Minor page faults of the proxy.
+proxy_minor_faults() {
+  awk '{ print $10 }' /proc/"${PROXY_PID}"/stat
+}
+
+# Value of key=value in a loadgen result line.
+result_value() {
+  echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
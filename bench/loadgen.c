@@ -0,0 +1,723 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Load generator for benchmarking cproxy (Linux only).  Runs an echo
+   server on 127.0.0.1:<echo port> in a second thread, and clients
+   that send messages through a cproxy listening on
+   127.0.0.1:<proxy port> and wait for each message to be echoed back
+   before sending the next. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define IO_BUFFER_SIZE (64 * 1024)
+/* Give up if no client makes progress for this long. */
+#define MAX_STALLED_MILLIS 10000
+/* A ramp keeps running this long after its last connection opens. */
+#define RAMP_SETTLE_MICROS 500000
+
+enum LoadMode
+{
+  CHURN_MODE,
+  PING_PONG_MODE,
+  RAMP_MODE
+};
+
+struct LoadSettings
+{
+  enum LoadMode mode;
+  uint16_t proxyPort;
+  uint16_t echoPort;
+  size_t numClients;
+  size_t messageSize;
+  size_t numSessions;
+  int64_t durationMicros;
+  size_t rampStep;
+  int64_t rampIntervalMicros;
+};
+
+struct Client
+{
+  int socket;
+  size_t sendRemaining;
+  size_t receiveRemaining;
+  int64_t roundStartMicros;
+};
+
+struct LoadState
+{
+  const struct LoadSettings* loadSettings;
+  int64_t startMicros;
+  int64_t nextRampMicros;
+  /* When the last ramp connection opened, 0 before that. */
+  int64_t rampDoneMicros;
+  int epollFD;
+  struct Client* clientArray;
+  char* message;
+  size_t numSessionsStarted;
+  size_t numSessionsDone;
+  size_t numErrors;
+  uint64_t numRelayedBytes;
+  int64_t* roundMicrosArray;
+  size_t numRounds;
+  size_t roundMicrosCapacity;
+};
+
+static void errnoExit(const char* what)
+{
+  fprintf(stderr, "%s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static void* checkedMalloc(size_t size)
+{
+  void* retVal = malloc(size);
+  if ((!retVal) && (size > 0))
+  {
+    errnoExit("malloc");
+  }
+  return retVal;
+}
+
+static int64_t getMonotonicMicros()
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+  {
+    errnoExit("clock_gettime");
+  }
+  return (((int64_t)ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static size_t parseSize(const char* arg, const char* name)
+{
+  char* endPtr;
+  unsigned long long value;
+
+  errno = 0;
+  value = strtoull(arg, &endPtr, 10);
+  if ((errno != 0) || (endPtr == arg) || (*endPtr != '\0') ||
+      (value == 0))
+  {
+    fprintf(stderr, "invalid %s '%s'\n", name, arg);
+    exit(1);
+  }
+  return value;
+}
+
+static uint16_t parsePort(const char* arg, const char* name)
+{
+  const size_t value = parseSize(arg, name);
+  if (value > UINT16_MAX)
+  {
+    fprintf(stderr, "invalid %s '%s'\n", name, arg);
+    exit(1);
+  }
+  return value;
+}
+
+static void setLoopbackAddress(
+  struct sockaddr_in* address,
+  uint16_t port)
+{
+  memset(address, 0, sizeof(*address));
+  address->sin_family = AF_INET;
+  address->sin_port = htons(port);
+  address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+static void setNonBlocking(int fd)
+{
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+  {
+    errnoExit("fcntl");
+  }
+}
+
+static int createEchoServerSocket(uint16_t echoPort)
+{
+  struct sockaddr_in address;
+  const int optval = 1;
+  const int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (serverSocket < 0)
+  {
+    errnoExit("socket");
+  }
+  if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR,
+                 &optval, sizeof(optval)) < 0)
+  {
+    errnoExit("setsockopt");
+  }
+  setLoopbackAddress(&address, echoPort);
+  if (bind(serverSocket, (const struct sockaddr*)&address,
+           sizeof(address)) < 0)
+  {
+    errnoExit("bind echo server socket");
+  }
+  if (listen(serverSocket, SOMAXCONN) < 0)
+  {
+    errnoExit("listen");
+  }
+  setNonBlocking(serverSocket);
+  return serverSocket;
+}
+
+/* Echo server.  Accepted sockets stay blocking: a read only happens
+   when epoll says the socket is readable, and writing back all of
+   what was read never waits for long because every client reads
+   its echo. */
+static void* runEchoServer(void* param)
+{
+  const int serverSocket = *((const int*)param);
+  struct epoll_event event;
+  struct epoll_event eventArray[MAX_EVENTS];
+  char* buffer = checkedMalloc(IO_BUFFER_SIZE);
+  const int epollFD = epoll_create1(0);
+
+  if (epollFD < 0)
+  {
+    errnoExit("epoll_create1");
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = serverSocket;
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, serverSocket, &event) < 0)
+  {
+    errnoExit("epoll_ctl");
+  }
+
+  for (;;)
+  {
+    int i;
+    const int numEvents = epoll_wait(epollFD, eventArray, MAX_EVENTS, -1);
+    if ((numEvents < 0) && (errno != EINTR))
+    {
+      errnoExit("epoll_wait");
+    }
+    for (i = 0; i < numEvents; ++i)
+    {
+      const int fd = eventArray[i].data.fd;
+      if (fd == serverSocket)
+      {
+        int acceptedSocket;
+        while ((acceptedSocket = accept(serverSocket, NULL, NULL)) >= 0)
+        {
+          event.events = EPOLLIN;
+          event.data.fd = acceptedSocket;
+          if (epoll_ctl(epollFD, EPOLL_CTL_ADD, acceptedSocket,
+                        &event) < 0)
+          {
+            errnoExit("epoll_ctl");
+          }
+        }
+      }
+      else
+      {
+        const ssize_t readRetVal = read(fd, buffer, IO_BUFFER_SIZE);
+        ssize_t bytesWritten = 0;
+        while ((readRetVal > 0) && (bytesWritten < readRetVal))
+        {
+          const ssize_t writeRetVal =
+            send(fd, buffer + bytesWritten, readRetVal - bytesWritten,
+                 MSG_NOSIGNAL);
+          if (writeRetVal < 0)
+          {
+            break;
+          }
+          bytesWritten += writeRetVal;
+        }
+        if ((readRetVal <= 0) || (bytesWritten < readRetVal))
+        {
+          close(fd);
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static void startRound(
+  struct LoadState* loadState,
+  struct Client* client)
+{
+  client->sendRemaining = loadState->loadSettings->messageSize;
+  client->receiveRemaining = loadState->loadSettings->messageSize;
+  client->roundStartMicros = getMonotonicMicros();
+}
+
+static void setClientEvents(
+  struct LoadState* loadState,
+  struct Client* client,
+  int op)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  if (client->sendRemaining > 0)
+  {
+    event.events |= EPOLLOUT;
+  }
+  event.data.ptr = client;
+  if (epoll_ctl(loadState->epollFD, op, client->socket, &event) < 0)
+  {
+    errnoExit("epoll_ctl");
+  }
+}
+
+static void openClient(
+  struct LoadState* loadState,
+  struct Client* client)
+{
+  struct sockaddr_in address;
+
+  client->socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (client->socket < 0)
+  {
+    errnoExit("socket");
+  }
+  setNonBlocking(client->socket);
+  setLoopbackAddress(&address, loadState->loadSettings->proxyPort);
+  if ((connect(client->socket, (const struct sockaddr*)&address,
+               sizeof(address)) < 0) &&
+      (errno != EINPROGRESS))
+  {
+    errnoExit("connect");
+  }
+  ++(loadState->numSessionsStarted);
+  startRound(loadState, client);
+  setClientEvents(loadState, client, EPOLL_CTL_ADD);
+}
+
+/* Ends the session of client, and starts another one in its place
+   while there are sessions left to run. */
+static void finishSession(
+  struct LoadState* loadState,
+  struct Client* client)
+{
+  close(client->socket);
+  client->socket = -1;
+  ++(loadState->numSessionsDone);
+  if (loadState->numSessionsStarted <
+      loadState->loadSettings->numSessions)
+  {
+    openClient(loadState, client);
+  }
+}
+
+static void addRoundMicros(
+  struct LoadState* loadState,
+  int64_t roundMicros)
+{
+  if (loadState->numRounds == loadState->roundMicrosCapacity)
+  {
+    loadState->roundMicrosCapacity =
+      (loadState->roundMicrosCapacity == 0) ?
+      1024 : (loadState->roundMicrosCapacity * 2);
+    loadState->roundMicrosArray =
+      realloc(loadState->roundMicrosArray,
+              loadState->roundMicrosCapacity * sizeof(int64_t));
+    if (!(loadState->roundMicrosArray))
+    {
+      errnoExit("realloc");
+    }
+  }
+  loadState->roundMicrosArray[loadState->numRounds] = roundMicros;
+  ++(loadState->numRounds);
+}
+
+/* Sends as much of the message as the socket takes.  Returns false
+   on error. */
+static bool sendToClient(
+  struct LoadState* loadState,
+  struct Client* client)
+{
+  const size_t messageSize = loadState->loadSettings->messageSize;
+
+  while (client->sendRemaining > 0)
+  {
+    const ssize_t writeRetVal =
+      send(client->socket,
+           loadState->message + (messageSize - client->sendRemaining),
+           client->sendRemaining, MSG_NOSIGNAL);
+    if (writeRetVal < 0)
+    {
+      return (errno == EAGAIN);
+    }
+    client->sendRemaining -= writeRetVal;
+  }
+  return true;
+}
+
+/* Churn sessions that fail are counted and replaced, other modes keep
+   their connections for the whole run and stop on the first error. */
+static void handleClientError(
+  struct LoadState* loadState,
+  struct Client* client)
+{
+  if (loadState->loadSettings->mode != CHURN_MODE)
+  {
+    fprintf(stderr, "connection error or unexpected data\n");
+    exit(1);
+  }
+  ++(loadState->numErrors);
+  finishSession(loadState, client);
+}
+
+static void handleRoundDone(
+  struct LoadState* loadState,
+  struct Client* client)
+{
+  addRoundMicros(
+    loadState,
+    getMonotonicMicros() - client->roundStartMicros);
+  loadState->numRelayedBytes += 2 * loadState->loadSettings->messageSize;
+  if (loadState->loadSettings->mode == CHURN_MODE)
+  {
+    finishSession(loadState, client);
+    return;
+  }
+
+  startRound(loadState, client);
+  if (!sendToClient(loadState, client))
+  {
+    handleClientError(loadState, client);
+  }
+  else if (client->sendRemaining > 0)
+  {
+    setClientEvents(loadState, client, EPOLL_CTL_MOD);
+  }
+}
+
+static void handleClientEvents(
+  struct LoadState* loadState,
+  struct Client* client,
+  uint32_t events)
+{
+  static char buffer[IO_BUFFER_SIZE];
+
+  if ((events & (EPOLLOUT | EPOLLERR)) && (client->sendRemaining > 0))
+  {
+    if (!sendToClient(loadState, client))
+    {
+      handleClientError(loadState, client);
+      return;
+    }
+    if (client->sendRemaining == 0)
+    {
+      setClientEvents(loadState, client, EPOLL_CTL_MOD);
+    }
+  }
+
+  for (;;)
+  {
+    const ssize_t readRetVal =
+      read(client->socket, buffer, IO_BUFFER_SIZE);
+    if (readRetVal < 0)
+    {
+      if (errno == EAGAIN)
+      {
+        break;
+      }
+      handleClientError(loadState, client);
+      return;
+    }
+    else if ((readRetVal == 0) ||
+             (((size_t)readRetVal) > client->receiveRemaining))
+    {
+      handleClientError(loadState, client);
+      return;
+    }
+    client->receiveRemaining -= readRetVal;
+  }
+
+  if ((client->sendRemaining == 0) && (client->receiveRemaining == 0))
+  {
+    handleRoundDone(loadState, client);
+  }
+}
+
+/* Opens the next rampStep connections each time they are due. */
+static void openDueRampClients(
+  struct LoadState* loadState,
+  int64_t nowMicros)
+{
+  const struct LoadSettings* loadSettings = loadState->loadSettings;
+
+  while ((loadState->numSessionsStarted < loadSettings->numClients) &&
+         (nowMicros >= loadState->nextRampMicros))
+  {
+    size_t i;
+    for (i = 0;
+         (i < loadSettings->rampStep) &&
+         (loadState->numSessionsStarted < loadSettings->numClients);
+         ++i)
+    {
+      openClient(
+        loadState,
+        &(loadState->clientArray[loadState->numSessionsStarted]));
+    }
+    loadState->nextRampMicros += loadSettings->rampIntervalMicros;
+    if (loadState->numSessionsStarted == loadSettings->numClients)
+    {
+      loadState->rampDoneMicros = nowMicros;
+    }
+  }
+}
+
+static bool loadDone(
+  const struct LoadState* loadState,
+  int64_t nowMicros)
+{
+  if (loadState->loadSettings->mode == CHURN_MODE)
+  {
+    return (loadState->numSessionsDone ==
+            loadState->loadSettings->numSessions);
+  }
+  else if (loadState->loadSettings->mode == RAMP_MODE)
+  {
+    return ((loadState->rampDoneMicros != 0) &&
+            ((nowMicros - loadState->rampDoneMicros) >=
+             RAMP_SETTLE_MICROS));
+  }
+  return ((nowMicros - loadState->startMicros) >=
+          loadState->loadSettings->durationMicros);
+}
+
+static int compareInt64(const void* a, const void* b)
+{
+  const int64_t x = *((const int64_t*)a);
+  const int64_t y = *((const int64_t*)b);
+  return (x > y) - (x < y);
+}
+
+static int64_t getPercentileMicros(
+  const struct LoadState* loadState,
+  double percentile)
+{
+  if (loadState->numRounds == 0)
+  {
+    return 0;
+  }
+  return loadState->roundMicrosArray[
+    (size_t)((loadState->numRounds - 1) * percentile)];
+}
+
+static void printResults(
+  struct LoadState* loadState,
+  int64_t elapsedMicros)
+{
+  const double elapsedSeconds = elapsedMicros / 1000000.0;
+
+  qsort(loadState->roundMicrosArray, loadState->numRounds,
+        sizeof(int64_t), compareInt64);
+  if (loadState->loadSettings->mode == CHURN_MODE)
+  {
+    printf("sessions=%zu errors=%zu sessions/s=%.0f ",
+           loadState->numSessionsDone, loadState->numErrors,
+           loadState->numSessionsDone / elapsedSeconds);
+  }
+  else
+  {
+    printf("connections=%zu rtts=%zu rtt/s=%.0f ",
+           loadState->loadSettings->numClients, loadState->numRounds,
+           loadState->numRounds / elapsedSeconds);
+  }
+  printf("seconds=%.2f relayed_bytes=%llu p50_us=%lld p99_us=%lld "
+         "p999_us=%lld\n",
+         elapsedSeconds, (unsigned long long)loadState->numRelayedBytes,
+         (long long)getPercentileMicros(loadState, 0.5),
+         (long long)getPercentileMicros(loadState, 0.99),
+         (long long)getPercentileMicros(loadState, 0.999));
+}
+
+static void printUsageAndExit()
+{
+  printf(
+    "Usage:\n"
+    "  loadgen churn <proxy port> <echo port> <concurrency> <msg size> "
+    "<num sessions>\n"
+    "    Run num sessions sessions, concurrency at a time.  Each session\n"
+    "    connects, sends msg size bytes, reads them back and closes.\n"
+    "  loadgen pingpong <proxy port> <echo port> <num conns> <msg size> "
+    "<seconds>\n"
+    "    Open num conns connections, each sending msg size bytes and\n"
+    "    reading them back over and over, for seconds seconds.\n"
+    "  loadgen ramp <proxy port> <echo port> <num conns> <msg size> "
+    "<step> <interval ms>\n"
+    "    Like pingpong, but open step connections every interval ms\n"
+    "    until num conns are open, and stop 500 ms after that.\n");
+  exit(1);
+}
+
+static void processArgs(
+  int argc,
+  char** argv,
+  struct LoadSettings* loadSettings)
+{
+  if (argc < 6)
+  {
+    printUsageAndExit();
+  }
+
+  memset(loadSettings, 0, sizeof(*loadSettings));
+  loadSettings->proxyPort = parsePort(argv[2], "proxy port");
+  loadSettings->echoPort = parsePort(argv[3], "echo port");
+  loadSettings->numClients = parseSize(argv[4], "number of clients");
+  loadSettings->messageSize = parseSize(argv[5], "msg size");
+  if ((strcmp(argv[1], "churn") == 0) && (argc == 7))
+  {
+    loadSettings->mode = CHURN_MODE;
+    loadSettings->numSessions = parseSize(argv[6], "num sessions");
+  }
+  else if ((strcmp(argv[1], "pingpong") == 0) && (argc == 7))
+  {
+    loadSettings->mode = PING_PONG_MODE;
+    loadSettings->numSessions = loadSettings->numClients;
+    loadSettings->durationMicros =
+      ((int64_t)parseSize(argv[6], "seconds")) * 1000000;
+  }
+  else if ((strcmp(argv[1], "ramp") == 0) && (argc == 8))
+  {
+    loadSettings->mode = RAMP_MODE;
+    loadSettings->numSessions = loadSettings->numClients;
+    loadSettings->rampStep = parseSize(argv[6], "step");
+    loadSettings->rampIntervalMicros =
+      ((int64_t)parseSize(argv[7], "interval ms")) * 1000;
+  }
+  else
+  {
+    printUsageAndExit();
+  }
+}
+
+int main(int argc, char** argv)
+{
+  struct LoadSettings loadSettings;
+  struct LoadState loadState;
+  struct epoll_event eventArray[MAX_EVENTS];
+  pthread_t echoThread;
+  int echoServerSocket;
+  int64_t nowMicros;
+  int64_t lastProgressMicros;
+  size_t lastProgress = 0;
+  size_t i;
+
+  processArgs(argc, argv, &loadSettings);
+
+  echoServerSocket = createEchoServerSocket(loadSettings.echoPort);
+  if (pthread_create(&echoThread, NULL, runEchoServer,
+                     &echoServerSocket) != 0)
+  {
+    fprintf(stderr, "pthread_create error\n");
+    exit(1);
+  }
+
+  memset(&loadState, 0, sizeof(loadState));
+  loadState.loadSettings = &loadSettings;
+  loadState.epollFD = epoll_create1(0);
+  if (loadState.epollFD < 0)
+  {
+    errnoExit("epoll_create1");
+  }
+  loadState.message = checkedMalloc(loadSettings.messageSize);
+  memset(loadState.message, 'x', loadSettings.messageSize);
+  loadState.clientArray =
+    checkedMalloc(loadSettings.numClients * sizeof(struct Client));
+  for (i = 0; i < loadSettings.numClients; ++i)
+  {
+    loadState.clientArray[i].socket = -1;
+  }
+
+  loadState.startMicros = getMonotonicMicros();
+  nowMicros = loadState.startMicros;
+  lastProgressMicros = nowMicros;
+  if (loadSettings.mode == RAMP_MODE)
+  {
+    loadState.nextRampMicros = nowMicros;
+    openDueRampClients(&loadState, nowMicros);
+  }
+  else
+  {
+    for (i = 0;
+         (i < loadSettings.numClients) &&
+         (loadState.numSessionsStarted < loadSettings.numSessions);
+         ++i)
+    {
+      openClient(&loadState, &(loadState.clientArray[i]));
+    }
+  }
+
+  while (!loadDone(&loadState, nowMicros))
+  {
+    int j;
+    /* A ramp wakes up every millisecond to open connections on time. */
+    const int numEvents =
+      epoll_wait(loadState.epollFD, eventArray, MAX_EVENTS,
+                 (loadSettings.mode == RAMP_MODE) ? 1 : 100);
+    if ((numEvents < 0) && (errno != EINTR))
+    {
+      errnoExit("epoll_wait");
+    }
+    for (j = 0; j < numEvents; ++j)
+    {
+      struct Client* client = eventArray[j].data.ptr;
+      /* An earlier event in this batch may have finished the session
+         of client.  If it started a new one, a stale event only
+         costs reads and writes that return EAGAIN. */
+      if (client->socket >= 0)
+      {
+        handleClientEvents(&loadState, client, eventArray[j].events);
+      }
+    }
+
+    nowMicros = getMonotonicMicros();
+    if (loadSettings.mode == RAMP_MODE)
+    {
+      openDueRampClients(&loadState, nowMicros);
+    }
+    if ((loadState.numRounds + loadState.numErrors) != lastProgress)
+    {
+      lastProgress = loadState.numRounds + loadState.numErrors;
+      lastProgressMicros = nowMicros;
+    }
+    else if ((nowMicros - lastProgressMicros) >
+             (MAX_STALLED_MILLIS * 1000))
+    {
+      fprintf(stderr, "no progress for %d ms\n", MAX_STALLED_MILLIS);
+      exit(1);
+    }
+  }
+
+  printResults(&loadState, nowMicros - loadState.startMicros);
+  return 0;
+}
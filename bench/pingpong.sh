@@ -0,0 +1,64 @@
+#!/bin/sh
+
+# Ping-pong: CONNECTIONS connections each send MESSAGE_SIZE bytes
+# through cproxy and wait for the echo, over and over for DURATION
+# seconds.  Reports round trips per second and the proxy's CPU time
+# per round trip.  If perf is installed, the proxy is also counted
+# with perf stat for the same time, for PERF_EVENTS (default cache-misses, cache-references,
+# instructions and cycles), reported per round trip.  Extra arguments
+# go to cproxy (default -b 16384).
+#
+#   make && make -C bench && bench/pingpong.sh [cproxy args]
+
+. "$(dirname "$0")/common.sh"
+
+CONNECTIONS=${CONNECTIONS:-5000}
+MESSAGE_SIZE=${MESSAGE_SIZE:-64}
+DURATION=${DURATION:-10}
+PERF_EVENTS=${PERF_EVENTS:-cache-misses,cache-references,instructions,cycles}
+PERF_OUTPUT="${POLLCOUNT_FILE}.perf"
+trap 'rm -f "${POLLCOUNT_FILE}" "${PERF_OUTPUT}"' EXIT
+
+if [ $# -eq 0 ]; then
+  set -- -b 16384
+fi
+start_proxy "$@"
+if command -v perf > /dev/null 2>&1; then
+  perf stat -x , -e "${PERF_EVENTS}" -o "${PERF_OUTPUT}" \
+    -p "${PROXY_PID}" -- sleep "${DURATION}" &
+  PERF_PID=$!
+else
+  echo "perf not found, skipping hardware counters" >&2
+  PERF_PID=
+fi
+CALLS_BEFORE=$(proxy_poll_calls)
+CPU_BEFORE=$(proxy_cpu_ticks)
+RESULT=$("${LOADGEN}" pingpong "${PROXY_PORT}" "${ECHO_PORT}" \
+         "${CONNECTIONS}" "${MESSAGE_SIZE}" "${DURATION}")
+STATUS=$?
+CALLS=$(($(proxy_poll_calls) - ${CALLS_BEFORE}))
+CPU=$(($(proxy_cpu_ticks) - ${CPU_BEFORE}))
+if [ -n "${PERF_PID}" ]; then
+  wait "${PERF_PID}"
+fi
+stop_proxy
+if [ ${STATUS} -ne 0 ]; then
+  exit ${STATUS}
+fi
+
+echo "${RESULT}"
+RTTS=$(result_value "${RESULT}" rtts)
+awk -v calls="${CALLS}" -v cpu="${CPU}" -v ticks="${CLOCK_TICKS}" \
+    -v rtts="${RTTS}" 'BEGIN {
+  printf("proxy_cpu_us_per_rtt=%.2f poll_calls_per_rtt=%.3f\n",
+         cpu * 1000000 / ticks / rtts, calls / rtts)
+}'
+if [ -n "${PERF_PID}" ]; then
+  # perf stat -x , lines are value,unit,event,...
+  awk -F , -v rtts="${RTTS}" '$3 != "" && $1 ~ /^[0-9]+$/ {
+    printf("%s=%d %s_per_rtt=%.1f\n", $3, $1, $3, $1 / rtts)
+  }
+  $3 != "" && $1 !~ /^[0-9]+$/ {
+    printf("%s=%s\n", $3, $1)
+  }' "${PERF_OUTPUT}"
+fi
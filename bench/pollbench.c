@@ -0,0 +1,196 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Microbenchmark of the pollutil API with many registered fds.  It
+   links ../pollutil.o, so it measures whichever poll backend cproxy
+   was built with.  The fds are the ends of socketpairs, all
+   registered for read, and the times are per operation:
+     add     add every fd
+     update  flip write interest of every fd, 10 passes
+     poll    blockingPoll with a 0 timeout while 100 fds are readable
+     churn   remove and add back a scattered fd, with a poll every 64
+     remove  remove every fd */
+
+#include "pollutil.h"
+#include "pollresult.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_NUM_FDS 10000
+#define MAX_EVENTS_PER_POLL 256
+#define NUM_UPDATE_PASSES 10
+#define NUM_READABLE_FDS 100
+#define NUM_POLLS 200
+#define NUM_CHURN_OPS 20000
+#define CHURN_OPS_PER_POLL 64
+
+static int64_t getMonotonicNanos()
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+  {
+    printf("clock_gettime error\n");
+    abort();
+  }
+  return (((int64_t)ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static void printResult(
+  const char* name,
+  int64_t startNanos,
+  size_t numOps)
+{
+  const double elapsedNanos = getMonotonicNanos() - startNanos;
+  printf("%-8s %10.3f us/op\n", name, elapsedNanos / 1000.0 / numOps);
+}
+
+static size_t pollAndCountEvents(struct PollState* pollState)
+{
+  const struct PollResult* pollResult = blockingPoll(pollState, 0);
+  size_t numReadyFDs = 0;
+  size_t i;
+
+  if (!pollResult)
+  {
+    return 0;
+  }
+  for (i = 0; i < pollResult->numEvents; ++i)
+  {
+    struct ReadyFDInfo readyFDInfo;
+    if (getReadyFDInfo(pollResult, i, &readyFDInfo))
+    {
+      /* Touch the data like the event loop does. */
+      if (*((const int*)readyFDInfo.data) < 0)
+      {
+        abort();
+      }
+      ++numReadyFDs;
+    }
+  }
+  return numReadyFDs;
+}
+
+int main(int argc, char** argv)
+{
+  struct PollState pollState;
+  size_t numFDs = DEFAULT_NUM_FDS;
+  size_t numReadyFDs = 0;
+  int* fdArray;
+  int64_t startNanos;
+  size_t i;
+  int pass;
+
+  if (argc > 1)
+  {
+    numFDs = strtoul(argv[1], NULL, 10) & ~((size_t)1);
+    if (numFDs < (2 * NUM_READABLE_FDS))
+    {
+      printf("Usage: pollbench [num fds (at least %d)]\n",
+             2 * NUM_READABLE_FDS);
+      return 1;
+    }
+  }
+
+  fdArray = malloc(numFDs * sizeof(int));
+  if (!fdArray)
+  {
+    printf("malloc error\n");
+    return 1;
+  }
+  for (i = 0; i < numFDs; i += 2)
+  {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, &(fdArray[i])) < 0)
+    {
+      printf("socketpair error: %s (raise ulimit -n?)\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  initializePollState(&pollState, MAX_EVENTS_PER_POLL);
+  printf("%zu fds\n", numFDs);
+
+  startNanos = getMonotonicNanos();
+  for (i = 0; i < numFDs; ++i)
+  {
+    addPollFDToPollState(
+      &pollState, fdArray[i], &(fdArray[i]),
+      INTERESTED_IN_READ_EVENTS, NOT_INTERESTED_IN_WRITE_EVENTS);
+  }
+  printResult("add", startNanos, numFDs);
+
+  startNanos = getMonotonicNanos();
+  for (pass = 0; pass < NUM_UPDATE_PASSES; ++pass)
+  {
+    for (i = 0; i < numFDs; ++i)
+    {
+      updatePollFDInPollState(
+        &pollState, fdArray[i], &(fdArray[i]),
+        INTERESTED_IN_READ_EVENTS,
+        (pass & 1) ?
+        NOT_INTERESTED_IN_WRITE_EVENTS : INTERESTED_IN_WRITE_EVENTS);
+    }
+  }
+  printResult("update", startNanos, NUM_UPDATE_PASSES * numFDs);
+
+  /* Spread the readable fds over the whole registered set. */
+  for (i = 0; i < NUM_READABLE_FDS; ++i)
+  {
+    const size_t pair = (i * 37) % (numFDs / 2);
+    if (write(fdArray[(2 * pair) + 1], "x", 1) != 1)
+    {
+      printf("write error\n");
+      return 1;
+    }
+  }
+  startNanos = getMonotonicNanos();
+  for (i = 0; i < NUM_POLLS; ++i)
+  {
+    numReadyFDs += pollAndCountEvents(&pollState);
+  }
+  printResult("poll", startNanos, NUM_POLLS);
+  printf("%-8s %10zu ready fds/poll\n", "", numReadyFDs / NUM_POLLS);
+
+  startNanos = getMonotonicNanos();
+  for (i = 0; i < NUM_CHURN_OPS; ++i)
+  {
+    const size_t fdIndex = (i * 7919) % numFDs;
+    removePollFDFromPollState(&pollState, fdArray[fdIndex]);
+    addPollFDToPollState(
+      &pollState, fdArray[fdIndex], &(fdArray[fdIndex]),
+      INTERESTED_IN_READ_EVENTS, NOT_INTERESTED_IN_WRITE_EVENTS);
+    if ((i % CHURN_OPS_PER_POLL) == 0)
+    {
+      pollAndCountEvents(&pollState);
+    }
+  }
+  printResult("churn", startNanos, NUM_CHURN_OPS);
+
+  startNanos = getMonotonicNanos();
+  for (i = 0; i < numFDs; ++i)
+  {
+    removePollFDFromPollState(&pollState, fdArray[i]);
+  }
+  printResult("remove", startNanos, numFDs);
+
+  return 0;
+}
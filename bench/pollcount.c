@@ -0,0 +1,107 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* LD_PRELOAD library counting the epoll_wait and poll calls of a
+   process (Linux only), and the ready events they return.  The counts
+   are kept in the first 16 bytes of the file named by the
+   POLLCOUNT_FILE environment variable as two native 64 bit integers,
+   calls then events, so they can be read while the process runs.
+   io_uring_enter is called through syscall() and is not counted. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct PollCounts
+{
+  uint64_t numCalls;
+  uint64_t numEvents;
+};
+
+typedef int (*EpollWaitFunction)(int, struct epoll_event*, int, int);
+typedef int (*PollFunction)(struct pollfd*, nfds_t, int);
+
+static struct PollCounts* pollCounts = NULL;
+static EpollWaitFunction realEpollWait = NULL;
+static PollFunction realPoll = NULL;
+
+__attribute__((constructor))
+static void initializePollCount()
+{
+  const char* path = getenv("POLLCOUNT_FILE");
+  int fd;
+  void* mapping;
+
+  realEpollWait = (EpollWaitFunction)dlsym(RTLD_NEXT, "epoll_wait");
+  realPoll = (PollFunction)dlsym(RTLD_NEXT, "poll");
+  if (!path)
+  {
+    return;
+  }
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    perror("pollcount open");
+    abort();
+  }
+  mapping = mmap(NULL, sizeof(struct PollCounts),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    perror("pollcount mmap");
+    abort();
+  }
+  close(fd);
+  pollCounts = mapping;
+}
+
+static int countPollCall(int retVal)
+{
+  if (pollCounts)
+  {
+    __atomic_fetch_add(&(pollCounts->numCalls), 1, __ATOMIC_RELAXED);
+    if (retVal > 0)
+    {
+      __atomic_fetch_add(&(pollCounts->numEvents), retVal,
+                         __ATOMIC_RELAXED);
+    }
+  }
+  return retVal;
+}
+
+int epoll_wait(
+  int epfd,
+  struct epoll_event* events,
+  int maxevents,
+  int timeout)
+{
+  return countPollCall(realEpollWait(epfd, events, maxevents, timeout));
+}
+
+int poll(
+  struct pollfd* fds,
+  nfds_t nfds,
+  int timeout)
+{
+  return countPollCall(realPoll(fds, nfds, timeout));
+}
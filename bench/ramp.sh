@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# Connection ramp: opens RAMP_STEP connections through cproxy every
+# RAMP_INTERVAL_MS milliseconds until CONNECTIONS are open, each
+# echoing MESSAGE_SIZE bytes back and forth, and stops half a second
+# after the last one opens.  Reports round trips per second, latency
+# percentiles, and the proxy's minor page faults (ramp_minflt), CPU
+# time and RSS over the ramp.  Extra arguments go to cproxy (default
+# -b 16384), e.g. -m transparent or -w 2000 to compare fault counts.
+#
+#   make && make -C bench && bench/ramp.sh [cproxy args]
+
+. "$(dirname "$0")/common.sh"
+
+CONNECTIONS=${CONNECTIONS:-2000}
+MESSAGE_SIZE=${MESSAGE_SIZE:-32768}
+RAMP_STEP=${RAMP_STEP:-20}
+RAMP_INTERVAL_MS=${RAMP_INTERVAL_MS:-10}
+
+if [ $# -eq 0 ]; then
+  set -- -b 16384
+fi
+start_proxy "$@"
+FAULTS_BEFORE=$(proxy_minor_faults)
+CPU_BEFORE=$(proxy_cpu_ticks)
+RESULT=$("${LOADGEN}" ramp "${PROXY_PORT}" "${ECHO_PORT}" \
+         "${CONNECTIONS}" "${MESSAGE_SIZE}" "${RAMP_STEP}" \
+         "${RAMP_INTERVAL_MS}")
+STATUS=$?
+FAULTS=$(($(proxy_minor_faults) - ${FAULTS_BEFORE}))
+CPU=$(($(proxy_cpu_ticks) - ${CPU_BEFORE}))
+RSS=$(awk '/^VmRSS/ { print $2 }' /proc/"${PROXY_PID}"/status)
+stop_proxy
+if [ ${STATUS} -ne 0 ]; then
+  exit ${STATUS}
+fi
+
+echo "${RESULT}"
+awk -v faults="${FAULTS}" -v cpu="${CPU}" -v ticks="${CLOCK_TICKS}" \
+    -v rss="${RSS}" 'BEGIN {
+  printf("ramp_minflt=%d proxy_cpu_s=%.2f proxy_rss_kb=%d\n",
+         faults, cpu / ticks, rss)
+}'
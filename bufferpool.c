@@ -14,74 +14,517 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #include "bufferpool.h"
+#include "errutil.h"
+#include "log.h"
 #include "memutil.h"
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Arenas are sized and aligned to the common 2MB huge page size. */
+#define ARENA_ALIGNMENT (2 * 1024 * 1024)
+#define MIN_BUFFERS_PER_ARENA (8)
+#define INITIAL_POOL_SIZE (16)
+#define NO_MAGAZINE_INDEX (UINT32_MAX)
+
+static size_t roundUp(
+  size_t value,
+  size_t multiple)
+{
+  return (((value + multiple - 1) / multiple) * multiple);
+}
+
+static size_t maxSize(
+  size_t a,
+  size_t b)
+{
+  return ((a > b) ? a : b);
+}
+
+static uint32_t popMagazine(
+  struct BufferDepot* bufferDepot,
+  uint64_t* head)
+{
+  uint64_t oldHead = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+  uint64_t newHead;
+  uint32_t magazineIndex;
+
+  do
+  {
+    magazineIndex = (uint32_t)oldHead;
+    if (magazineIndex == NO_MAGAZINE_INDEX)
+    {
+      return NO_MAGAZINE_INDEX;
+    }
+    /* May be stale if another thread popped this magazine meanwhile,
+       but then the tag has changed and the exchange fails. */
+    newHead =
+      (((oldHead >> 32) + 1) << 32) |
+      __atomic_load_n(
+        &(bufferDepot->magazineArray[magazineIndex].nextMagazineIndex),
+        __ATOMIC_RELAXED);
+  }
+  while (!__atomic_compare_exchange_n(
+           head, &oldHead, newHead, true,
+           __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+  return magazineIndex;
+}
+
+static void pushMagazine(
+  struct BufferDepot* bufferDepot,
+  uint64_t* head,
+  uint32_t magazineIndex)
+{
+  uint64_t oldHead = __atomic_load_n(head, __ATOMIC_RELAXED);
+  uint64_t newHead;
+
+  do
+  {
+    __atomic_store_n(
+      &(bufferDepot->magazineArray[magazineIndex].nextMagazineIndex),
+      (uint32_t)oldHead, __ATOMIC_RELAXED);
+    newHead = (((oldHead >> 32) + 1) << 32) | magazineIndex;
+  }
+  while (!__atomic_compare_exchange_n(
+           head, &oldHead, newHead, true,
+           __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static uint32_t popFullMagazine(
+  struct BufferDepot* bufferDepot)
+{
+  const uint32_t magazineIndex =
+    popMagazine(bufferDepot, &(bufferDepot->fullMagazineHead));
+  size_t numFullMagazines;
+  size_t minFullMagazines;
+
+  if (magazineIndex == NO_MAGAZINE_INDEX)
+  {
+    return NO_MAGAZINE_INDEX;
+  }
 
-static void resizeBufferPool(
+  numFullMagazines =
+    __atomic_sub_fetch(&(bufferDepot->numFullMagazines), 1,
+                       __ATOMIC_RELAXED);
+  minFullMagazines =
+    __atomic_load_n(&(bufferDepot->minFullMagazinesInWindow),
+                    __ATOMIC_RELAXED);
+  while ((numFullMagazines < minFullMagazines) &&
+         (!__atomic_compare_exchange_n(
+            &(bufferDepot->minFullMagazinesInWindow),
+            &minFullMagazines, numFullMagazines, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+  {
+  }
+
+  return magazineIndex;
+}
+
+static void pushFullMagazine(
+  struct BufferDepot* bufferDepot,
+  uint32_t magazineIndex)
+{
+  pushMagazine(bufferDepot, &(bufferDepot->fullMagazineHead),
+               magazineIndex);
+  __atomic_add_fetch(&(bufferDepot->numFullMagazines), 1,
+                     __ATOMIC_RELAXED);
+}
+
+void initializeBufferDepot(
+  struct BufferDepot* bufferDepot,
+  size_t bufferSize,
+  size_t bufferAlignment,
+  size_t maxMagazines)
+{
+  uint32_t i;
+
+  assert(bufferDepot != NULL);
+  assert(bufferSize > 0);
+  assert(maxMagazines > 0);
+  assert(maxMagazines < NO_MAGAZINE_INDEX);
+
+  memset(bufferDepot, 0, sizeof(struct BufferDepot));
+
+  bufferDepot->bufferSize = roundUp(bufferSize, bufferAlignment);
+  bufferDepot->maxMagazines = maxMagazines;
+  bufferDepot->magazineArray =
+    checkedCalloc(maxMagazines, sizeof(struct BufferMagazine));
+  bufferDepot->fullMagazineHead = NO_MAGAZINE_INDEX;
+  bufferDepot->decommittedMagazineHead = NO_MAGAZINE_INDEX;
+  bufferDepot->emptyMagazineHead = NO_MAGAZINE_INDEX;
+  for (i = 0; i < maxMagazines; ++i)
+  {
+    pushMagazine(bufferDepot, &(bufferDepot->emptyMagazineHead), i);
+  }
+}
+
+static void resizeBufferArray(
   struct BufferPool* bufferPool,
   size_t newSize)
 {
-  size_t originalSize;
-  size_t i;
-
   assert(bufferPool != NULL);
   assert(newSize > bufferPool->poolSize);
 
-  originalSize = bufferPool->poolSize;
   bufferPool->poolSize = newSize;
   bufferPool->bufferArray = 
     checkedRealloc(bufferPool->bufferArray,
                    newSize * sizeof(void*));
-  memset(
-    &(bufferPool->bufferArray[originalSize]),
-    0,
-    (newSize - originalSize) * sizeof(void*));
+}
+
+static void* mapAnonymous(
+  size_t size,
+  int extraFlags)
+{
+  return mmap(NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | extraFlags, -1, 0);
+}
+
+static char* mapArena(
+  struct BufferPool* bufferPool)
+{
+  char* mapping;
+  char* arena;
+  size_t headSize;
+
+  assert(bufferPool != NULL);
 
-  for (i = 0; i < (newSize - originalSize); ++i)
+#ifdef MAP_HUGETLB
+  if (bufferPool->hugePages == BUFFER_POOL_EXPLICIT_HUGE_PAGES)
   {
-    void* buffer = checkedMalloc(bufferPool->bufferSize);
-    returnBufferToBufferPool(
-      bufferPool,
-      buffer);
+    arena = mapAnonymous(bufferPool->arenaSize, MAP_HUGETLB);
+    if (arena != MAP_FAILED)
+    {
+      return arena;
+    }
+    else
+    {
+      const int mmapErrno = errno;
+      char* errorString = errnoToString(mmapErrno);
+      proxyLog("huge page arena mmap failed errno = %d: %s, "
+               "using normal pages",
+               mmapErrno, errorString);
+      free(errorString);
+      bufferPool->hugePages = BUFFER_POOL_NO_HUGE_PAGES;
+    }
+  }
+#endif
+
+  /* Map an extra ARENA_ALIGNMENT bytes and unmap what lies outside
+     the aligned arena, so transparent huge pages can back all of it. */
+  mapping = mapAnonymous(bufferPool->arenaSize + ARENA_ALIGNMENT, 0);
+  if (mapping == MAP_FAILED)
+  {
+    const int mmapErrno = errno;
+    char* errorString = errnoToString(mmapErrno);
+    proxyLog("arena mmap failed size %ld errno = %d: %s",
+             (long)(bufferPool->arenaSize), mmapErrno, errorString);
+    free(errorString);
+    abort();
+  }
+  arena = (char*)roundUp((size_t)mapping, ARENA_ALIGNMENT);
+  headSize = arena - mapping;
+  if (headSize > 0)
+  {
+    munmap(mapping, headSize);
+  }
+  munmap(arena + bufferPool->arenaSize, ARENA_ALIGNMENT - headSize);
+
+#ifdef MADV_HUGEPAGE
+  if ((bufferPool->hugePages == BUFFER_POOL_TRANSPARENT_HUGE_PAGES) &&
+      (madvise(arena, bufferPool->arenaSize, MADV_HUGEPAGE) < 0))
+  {
+    const int madviseErrno = errno;
+    char* errorString = errnoToString(madviseErrno);
+    proxyLog("madvise MADV_HUGEPAGE failed errno = %d: %s, "
+             "using normal pages",
+             madviseErrno, errorString);
+    free(errorString);
+    bufferPool->hugePages = BUFFER_POOL_NO_HUGE_PAGES;
   }
+#endif
+
+  return arena;
+}
+
+static void* allocateBuffer(
+  struct BufferPool* bufferPool)
+{
+  void* buffer;
+
+  assert(bufferPool != NULL);
+
+  if ((size_t)(bufferPool->arenaEnd - bufferPool->arenaNext) <
+      bufferPool->bufferSize)
+  {
+    bufferPool->arenaNext = mapArena(bufferPool);
+    bufferPool->arenaEnd = bufferPool->arenaNext + bufferPool->arenaSize;
+  }
+
+  buffer = bufferPool->arenaNext;
+  bufferPool->arenaNext += bufferPool->bufferSize;
+  return buffer;
+}
+
+static void decommitBuffer(
+  const struct BufferPool* bufferPool,
+  void* buffer)
+{
+  /* Only whole pages inside the buffer can be given back. */
+  const size_t start = roundUp((size_t)buffer, bufferPool->pageSize);
+  const size_t end =
+    (((size_t)buffer + bufferPool->bufferSize) / bufferPool->pageSize) *
+    bufferPool->pageSize;
+
+  /* Explicit huge pages stay reserved for the process anyway. */
+  if ((bufferPool->hugePages != BUFFER_POOL_EXPLICIT_HUGE_PAGES) &&
+      (end > start))
+  {
+    madvise((void*)start, end - start, MADV_DONTNEED);
+  }
+}
+
+bool bufferPoolHugePagesSupported(
+  enum BufferPoolHugePages hugePages)
+{
+  switch (hugePages)
+  {
+  case BUFFER_POOL_NO_HUGE_PAGES:
+    return true;
+
+  case BUFFER_POOL_TRANSPARENT_HUGE_PAGES:
+#ifdef MADV_HUGEPAGE
+    return true;
+#else
+    return false;
+#endif
+
+  case BUFFER_POOL_EXPLICIT_HUGE_PAGES:
+#ifdef MAP_HUGETLB
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+const char* bufferPoolHugePagesString(
+  enum BufferPoolHugePages hugePages)
+{
+  switch (hugePages)
+  {
+  case BUFFER_POOL_NO_HUGE_PAGES:
+    return "none";
+
+  case BUFFER_POOL_TRANSPARENT_HUGE_PAGES:
+    return "transparent";
+
+  case BUFFER_POOL_EXPLICIT_HUGE_PAGES:
+    return "explicit";
+  }
+  return "unknown";
+}
+
+/* Moves the magazine of the least recently used free buffers at the
+   bottom of the stack to the depot.  Returns false if the depot has
+   no empty magazine left. */
+static bool exportMagazine(
+  struct BufferPool* bufferPool)
+{
+  struct BufferDepot* bufferDepot = bufferPool->depot;
+  struct BufferMagazine* magazine;
+  const uint32_t magazineIndex =
+    popMagazine(bufferDepot, &(bufferDepot->emptyMagazineHead));
+
+  assert(bufferPool->buffersInPool >= BUFFER_MAGAZINE_SIZE);
+
+  if (magazineIndex == NO_MAGAZINE_INDEX)
+  {
+    return false;
+  }
+
+  magazine = &(bufferDepot->magazineArray[magazineIndex]);
+  memcpy(magazine->bufferArray, bufferPool->bufferArray,
+         BUFFER_MAGAZINE_SIZE * sizeof(void*));
+  memmove(&(bufferPool->bufferArray[0]),
+          &(bufferPool->bufferArray[BUFFER_MAGAZINE_SIZE]),
+          (bufferPool->buffersInPool - BUFFER_MAGAZINE_SIZE) *
+          sizeof(void*));
+  bufferPool->buffersInPool -= BUFFER_MAGAZINE_SIZE;
+
+  if (bufferPool->decommittedBuffers >= BUFFER_MAGAZINE_SIZE)
+  {
+    bufferPool->decommittedBuffers -= BUFFER_MAGAZINE_SIZE;
+    pushMagazine(bufferDepot, &(bufferDepot->decommittedMagazineHead),
+                 magazineIndex);
+  }
+  else
+  {
+    bufferPool->decommittedBuffers = 0;
+    pushFullMagazine(bufferDepot, magazineIndex);
+  }
+
+  /* The exported buffers no longer count as free in this pool for the
+     rest of the window. */
+  if (bufferPool->minCommittedBuffersInWindow >
+      (bufferPool->buffersInPool - bufferPool->decommittedBuffers))
+  {
+    bufferPool->minCommittedBuffersInWindow =
+      bufferPool->buffersInPool - bufferPool->decommittedBuffers;
+  }
+
+  return true;
+}
+
+/* Fills an empty pool with a magazine from the depot, preferring
+   one with committed pages.  Returns false if the depot has none. */
+static bool importMagazine(
+  struct BufferPool* bufferPool)
+{
+  struct BufferDepot* bufferDepot = bufferPool->depot;
+  bool decommitted = false;
+  uint32_t magazineIndex = popFullMagazine(bufferDepot);
+
+  assert(bufferPool->buffersInPool == 0);
+
+  if (magazineIndex == NO_MAGAZINE_INDEX)
+  {
+    magazineIndex =
+      popMagazine(bufferDepot, &(bufferDepot->decommittedMagazineHead));
+    if (magazineIndex == NO_MAGAZINE_INDEX)
+    {
+      return false;
+    }
+    decommitted = true;
+  }
+
+  if (bufferPool->poolSize < BUFFER_MAGAZINE_SIZE)
+  {
+    resizeBufferArray(bufferPool, BUFFER_MAGAZINE_SIZE);
+  }
+  memcpy(bufferPool->bufferArray,
+         bufferDepot->magazineArray[magazineIndex].bufferArray,
+         BUFFER_MAGAZINE_SIZE * sizeof(void*));
+  bufferPool->buffersInPool = BUFFER_MAGAZINE_SIZE;
+  bufferPool->decommittedBuffers =
+    (decommitted ? BUFFER_MAGAZINE_SIZE : 0);
+
+  pushMagazine(bufferDepot, &(bufferDepot->emptyMagazineHead),
+               magazineIndex);
+
+  return true;
+}
+
+/* The pool keeps 2 magazines worth of buffers, like the loaded and
+   previous magazines of a magazine allocator, so a thread alternating
+   between getting and returning a buffer never touches the depot. */
+static size_t maxBuffersInPoolWithDepot(
+  const struct BufferPool* bufferPool)
+{
+  return maxSize(2 * BUFFER_MAGAZINE_SIZE, bufferPool->retainedBuffers);
 }
 
 void initializeBufferPool(
   struct BufferPool* bufferPool,
   size_t bufferSize,
-  size_t initialPoolSize)
+  size_t bufferAlignment,
+  enum BufferPoolHugePages hugePages,
+  struct BufferDepot* depot)
 {
   assert(bufferPool != NULL);
   assert(bufferSize > 0);
-  assert(initialPoolSize > 0);
+  assert(bufferAlignment > 0);
+  assert((bufferAlignment & (bufferAlignment - 1)) == 0);
+  assert(bufferAlignment <= ARENA_ALIGNMENT);
 
   memset(bufferPool, 0, sizeof(struct BufferPool));
 
-  bufferPool->bufferSize = bufferSize;
-  resizeBufferPool(bufferPool, initialPoolSize);
+  bufferPool->bufferSize = roundUp(bufferSize, bufferAlignment);
+  bufferPool->pageSize = sysconf(_SC_PAGESIZE);
+  bufferPool->hugePages = hugePages;
+  bufferPool->depot = depot;
+  bufferPool->arenaSize =
+    roundUp(MIN_BUFFERS_PER_ARENA * bufferPool->bufferSize,
+            ARENA_ALIGNMENT);
+  resizeBufferArray(bufferPool, INITIAL_POOL_SIZE);
+
+  assert((depot == NULL) || (depot->bufferSize == bufferPool->bufferSize));
+}
+
+void prewarmBufferPool(
+  struct BufferPool* bufferPool,
+  size_t numBuffers)
+{
+  size_t i;
+
+  assert(bufferPool != NULL);
+
+  for (i = 0; i < numBuffers; ++i)
+  {
+    char* buffer = allocateBuffer(bufferPool);
+    size_t offset;
+    for (offset = 0;
+         offset < bufferPool->bufferSize;
+         offset += bufferPool->pageSize)
+    {
+      buffer[offset] = 0;
+    }
+    returnBufferToBufferPool(bufferPool, buffer);
+  }
+}
+
+void enableBufferPoolTrimming(
+  struct BufferPool* bufferPool,
+  size_t retainedBuffers,
+  int64_t decayWindowMillis,
+  int64_t nowMillis)
+{
+  assert(bufferPool != NULL);
+  assert(decayWindowMillis > 0);
+
+  bufferPool->retainedBuffers = retainedBuffers;
+  bufferPool->decayWindowMillis = decayWindowMillis;
+  bufferPool->windowStartMillis = nowMillis;
+  bufferPool->minCommittedBuffersInWindow =
+    bufferPool->buffersInPool - bufferPool->decommittedBuffers;
 }
 
 void* getBufferFromBufferPool(
   struct BufferPool* bufferPool)
 {
   void* retVal;
+  size_t committedBuffers;
 
   assert(bufferPool != NULL);
 
-  if (bufferPool->buffersInPool == 0)
+  /* Grow by one buffer at a time, so a burst of connections only
+     touches the buffers it actually uses. */
+  if ((bufferPool->buffersInPool == 0) &&
+      ((!(bufferPool->depot)) || (!importMagazine(bufferPool))))
   {
-    resizeBufferPool(
-      bufferPool,
-      bufferPool->poolSize * 2);
+    return allocateBuffer(bufferPool);
   }
 
   retVal = bufferPool->bufferArray[bufferPool->buffersInPool - 1];
   bufferPool->bufferArray[bufferPool->buffersInPool - 1] = NULL;
   --(bufferPool->buffersInPool);
+  if (bufferPool->decommittedBuffers > bufferPool->buffersInPool)
+  {
+    bufferPool->decommittedBuffers = bufferPool->buffersInPool;
+  }
+  committedBuffers =
+    bufferPool->buffersInPool - bufferPool->decommittedBuffers;
+  if (committedBuffers < bufferPool->minCommittedBuffersInWindow)
+  {
+    bufferPool->minCommittedBuffersInWindow = committedBuffers;
+  }
 
   return retVal;
 }
@@ -91,8 +534,147 @@ void returnBufferToBufferPool(
   void* buffer)
 {
   assert(bufferPool != NULL);
-  assert(bufferPool->buffersInPool < bufferPool->poolSize);
+
+  /* If the depot is out of empty magazines the pool just grows. */
+  if (bufferPool->depot &&
+      (bufferPool->buffersInPool >= maxBuffersInPoolWithDepot(bufferPool)))
+  {
+    exportMagazine(bufferPool);
+  }
+
+  if (bufferPool->buffersInPool >= bufferPool->poolSize)
+  {
+    resizeBufferArray(bufferPool, bufferPool->poolSize * 2);
+  }
 
   bufferPool->bufferArray[bufferPool->buffersInPool] = buffer;
   ++(bufferPool->buffersInPool);
 }
+
+/* Only one thread trims the depot per window. */
+static size_t trimBufferDepot(
+  const struct BufferPool* bufferPool,
+  int64_t nowMillis)
+{
+  struct BufferDepot* bufferDepot = bufferPool->depot;
+  int64_t windowStartMillis =
+    __atomic_load_n(&(bufferDepot->windowStartMillis), __ATOMIC_RELAXED);
+  size_t numToTrim;
+  size_t numTrimmed = 0;
+
+  if (((nowMillis - windowStartMillis) < bufferPool->decayWindowMillis) ||
+      (!__atomic_compare_exchange_n(
+         &(bufferDepot->windowStartMillis),
+         &windowStartMillis, nowMillis, false,
+         __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+  {
+    return 0;
+  }
+
+  /* The stack only gives access to the most recently pushed
+     magazines, which may not be the ones that stayed unused, but
+     the count of magazines to trim is right. */
+  numToTrim =
+    __atomic_load_n(&(bufferDepot->minFullMagazinesInWindow),
+                    __ATOMIC_RELAXED);
+  while (numTrimmed < numToTrim)
+  {
+    const uint32_t magazineIndex = popFullMagazine(bufferDepot);
+    size_t i;
+
+    if (magazineIndex == NO_MAGAZINE_INDEX)
+    {
+      break;
+    }
+    for (i = 0; i < BUFFER_MAGAZINE_SIZE; ++i)
+    {
+      decommitBuffer(
+        bufferPool,
+        bufferDepot->magazineArray[magazineIndex].bufferArray[i]);
+    }
+    pushMagazine(bufferDepot, &(bufferDepot->decommittedMagazineHead),
+                 magazineIndex);
+    ++numTrimmed;
+  }
+
+  __atomic_store_n(
+    &(bufferDepot->minFullMagazinesInWindow),
+    __atomic_load_n(&(bufferDepot->numFullMagazines), __ATOMIC_RELAXED),
+    __ATOMIC_RELAXED);
+
+  return (numTrimmed * BUFFER_MAGAZINE_SIZE);
+}
+
+static size_t trimPoolBuffers(
+  struct BufferPool* bufferPool,
+  int64_t nowMillis)
+{
+  size_t numToTrim;
+  size_t i;
+
+  if ((nowMillis - bufferPool->windowStartMillis) <
+      bufferPool->decayWindowMillis)
+  {
+    return 0;
+  }
+
+  /* At least minCommittedBuffersInWindow committed buffers were free
+     for the whole window.  Trim those above retainedBuffers.  The
+     committed buffers just above the decommitted ones at the bottom
+     of the stack were used least recently. */
+  numToTrim = 0;
+  if (bufferPool->minCommittedBuffersInWindow > bufferPool->retainedBuffers)
+  {
+    numToTrim =
+      bufferPool->minCommittedBuffersInWindow - bufferPool->retainedBuffers;
+  }
+  assert((bufferPool->decommittedBuffers + numToTrim) <=
+         bufferPool->buffersInPool);
+  for (i = 0; i < numToTrim; ++i)
+  {
+    decommitBuffer(
+      bufferPool,
+      bufferPool->bufferArray[bufferPool->decommittedBuffers + i]);
+  }
+  bufferPool->decommittedBuffers += numToTrim;
+
+  bufferPool->windowStartMillis = nowMillis;
+  bufferPool->minCommittedBuffersInWindow =
+    bufferPool->buffersInPool - bufferPool->decommittedBuffers;
+
+  return numToTrim;
+}
+
+size_t trimBufferPool(
+  struct BufferPool* bufferPool,
+  int64_t nowMillis)
+{
+  size_t numTrimmed;
+
+  assert(bufferPool != NULL);
+
+  if (bufferPool->decayWindowMillis == 0)
+  {
+    return 0;
+  }
+
+  numTrimmed = trimPoolBuffers(bufferPool, nowMillis);
+  if (bufferPool->depot)
+  {
+    numTrimmed += trimBufferDepot(bufferPool, nowMillis);
+  }
+  return numTrimmed;
+}
+
+bool bufferPoolHasSurplus(
+  const struct BufferPool* bufferPool)
+{
+  assert(bufferPool != NULL);
+
+  return ((bufferPool->decayWindowMillis != 0) &&
+          (((bufferPool->buffersInPool - bufferPool->decommittedBuffers) >
+            bufferPool->retainedBuffers) ||
+           (bufferPool->depot &&
+            (__atomic_load_n(&(bufferPool->depot->numFullMagazines),
+                             __ATOMIC_RELAXED) > 0))));
+}
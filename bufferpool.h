@@ -14,23 +14,123 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #ifndef BUFFERPOOL_H
 #define BUFFERPOOL_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+enum BufferPoolHugePages
+{
+  BUFFER_POOL_NO_HUGE_PAGES,
+  /* madvise(MADV_HUGEPAGE) on arenas (Linux only). */
+  BUFFER_POOL_TRANSPARENT_HUGE_PAGES,
+  /* mmap(MAP_HUGETLB) arenas from the reserved huge page pool
+     (Linux only).  Falls back to normal pages if none are left. */
+  BUFFER_POOL_EXPLICIT_HUGE_PAGES
+};
+
+extern bool bufferPoolHugePagesSupported(
+  enum BufferPoolHugePages hugePages);
+
+extern const char* bufferPoolHugePagesString(
+  enum BufferPoolHugePages hugePages);
 
+/* Number of buffers moved between a pool and its depot at once. */
+#define BUFFER_MAGAZINE_SIZE (16)
+
+struct BufferMagazine
+{
+  uint32_t nextMagazineIndex;
+  void* bufferArray[BUFFER_MAGAZINE_SIZE];
+};
+
+/* Magazines of free buffers shared by the pools of all threads, in
+   the style of Bonwick's magazine allocator.  Full magazines are kept
+   on lock-free stacks, so threads exchange buffers in batches of
+   BUFFER_MAGAZINE_SIZE without locking.  Each stack head packs a
+   magazine index with a tag that changes on every update, so an
+   index that is popped and pushed again between a load and a compare
+   and swap is detected.  Magazines in the depot that stay unused for
+   a whole decay window have their pages given back to the kernel and
+   move to the decommitted stack. */
+struct BufferDepot
+{
+  size_t bufferSize;
+  size_t maxMagazines;
+  struct BufferMagazine* magazineArray;
+  uint64_t fullMagazineHead;
+  uint64_t decommittedMagazineHead;
+  uint64_t emptyMagazineHead;
+  size_t numFullMagazines;
+  /* Lowest numFullMagazines since windowStartMillis. */
+  size_t minFullMagazinesInWindow;
+  int64_t windowStartMillis;
+};
+
+/* bufferSize and bufferAlignment must match those of every pool
+   that uses the depot. */
+extern void initializeBufferDepot(
+  struct BufferDepot* bufferDepot,
+  size_t bufferSize,
+  size_t bufferAlignment,
+  size_t maxMagazines);
+
+/* Stack of free buffers of one size.  Buffers are carved one at a
+   time out of large mmap'd arenas when the pool is empty, so buffers
+   are contiguous and arenas can be backed by huge pages.  Arenas are
+   never unmapped.  With trimming enabled, the pages of free buffers
+   that stayed unused for a whole decay window are given back to the
+   kernel, except for retainedBuffers of them.  A pool with a depot
+   keeps at most the larger of 2 magazines and retainedBuffers free
+   buffers; a magazine of the least recently used ones moves to the
+   depot when it is full, and an empty pool takes a magazine from
+   the depot before carving new buffers. */
 struct BufferPool
 {
   size_t bufferSize;
+  size_t pageSize;
+  enum BufferPoolHugePages hugePages;
+  struct BufferDepot* depot;
+  size_t arenaSize;
+  char* arenaNext;
+  char* arenaEnd;
   size_t poolSize;
   size_t buffersInPool;
   void** bufferArray;
+  /* bufferArray[0] to bufferArray[decommittedBuffers - 1] have had
+     their pages given back to the kernel. */
+  size_t decommittedBuffers;
+  /* Trimming is disabled if decayWindowMillis is 0. */
+  size_t retainedBuffers;
+  int64_t decayWindowMillis;
+  int64_t windowStartMillis;
+  /* Lowest number of committed buffers in the pool since
+     windowStartMillis. */
+  size_t minCommittedBuffersInWindow;
 };
 
+/* bufferAlignment must be a power of 2.  depot may be NULL. */
 extern void initializeBufferPool(
   struct BufferPool* bufferPool,
   size_t bufferSize,
-  size_t initialPoolSize);
+  size_t bufferAlignment,
+  enum BufferPoolHugePages hugePages,
+  struct BufferDepot* depot);
+
+/* Adds numBuffers buffers to the pool with all of their pages
+   already faulted in. */
+extern void prewarmBufferPool(
+  struct BufferPool* bufferPool,
+  size_t numBuffers);
+
+extern void enableBufferPoolTrimming(
+  struct BufferPool* bufferPool,
+  size_t retainedBuffers,
+  int64_t decayWindowMillis,
+  int64_t nowMillis);
 
 extern void* getBufferFromBufferPool(
   struct BufferPool* bufferPool);
@@ -39,4 +139,17 @@ extern void returnBufferToBufferPool(
   struct BufferPool* bufferPool,
   void* buffer);
 
+/* Gives the pages of surplus buffers in the pool and its depot back
+   to the kernel if the decay window has passed and returns the number
+   of buffers trimmed.
+   Cheap to call on every event loop iteration. */
+extern size_t trimBufferPool(
+  struct BufferPool* bufferPool,
+  int64_t nowMillis);
+
+/* Returns true if bufferPool holds free buffers that
+   trimBufferPool may trim later. */
+extern bool bufferPoolHasSurplus(
+  const struct BufferPool* bufferPool);
+
 #endif
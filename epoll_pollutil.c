@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/epoll.h>
@@ -29,16 +30,23 @@ struct InternalPollState
 {
   int    epollFD;
   size_t numFDs;
+  /* Filled by epoll_wait, maxEventsPerPoll entries. */
   struct epoll_event* epollEventArray;
-  size_t epollEventArrayCapacity;
+  size_t maxEventsPerPoll;
+  /* Events currently registered with epoll for each fd,
+     indexed by fd, so unchanged interest costs no epoll_ctl. */
+  uint32_t* registeredEventsArray;
+  size_t registeredEventsArrayCapacity;
 };
 
 void initializePollState(
-  struct PollState* pollState)
+  struct PollState* pollState,
+  size_t maxEventsPerPoll)
 {
   struct InternalPollState* internalPollState;
 
   assert(pollState != NULL);
+  assert(maxEventsPerPoll > 0);
 
   memset(pollState, 0, sizeof(struct PollState));
   internalPollState =
@@ -52,16 +60,45 @@ void initializePollState(
              errnoToString(errno));
     abort();
   }
+  internalPollState->maxEventsPerPoll = maxEventsPerPoll;
+  internalPollState->epollEventArray =
+    checkedCalloc(maxEventsPerPoll, sizeof(struct epoll_event));
   proxyLog("created epoll (fd=%d)",
            internalPollState->epollFD);
 }
 
-void addPollFDToPollState(
+static void setRegisteredEvents(
+  struct InternalPollState* internalPollState,
+  int fd,
+  uint32_t events)
+{
+  assert(fd >= 0);
+
+  if (((size_t)fd) >= internalPollState->registeredEventsArrayCapacity)
+  {
+    const size_t oldCapacity =
+      internalPollState->registeredEventsArrayCapacity;
+    size_t newCapacity = ((oldCapacity == 0) ? 16 : oldCapacity);
+    while (((size_t)fd) >= newCapacity)
+    {
+      newCapacity *= 2;
+    }
+    internalPollState->registeredEventsArray =
+      checkedRealloc(internalPollState->registeredEventsArray,
+                     newCapacity * sizeof(uint32_t));
+    memset(&(internalPollState->registeredEventsArray[oldCapacity]),
+           0,
+           (newCapacity - oldCapacity) * sizeof(uint32_t));
+    internalPollState->registeredEventsArrayCapacity = newCapacity;
+  }
+  internalPollState->registeredEventsArray[fd] = events;
+}
+
+static void addEventsToPollState(
   struct PollState* pollState,
   int fd,
   void* data,
-  enum ReadEventInterest readEventInterest,
-  enum WriteEventInterest writeEventInterest)
+  uint32_t events)
 {
   struct InternalPollState* internalPollState;
   struct epoll_event newEvent;
@@ -70,9 +107,7 @@ void addPollFDToPollState(
 
   internalPollState = pollState->internalPollState;
   newEvent.data.ptr = data;
-  newEvent.events = 
-    ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? EPOLLIN : 0) |
-    ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? EPOLLOUT : 0);
+  newEvent.events = events;
   if (epoll_ctl(internalPollState->epollFD,
                 EPOLL_CTL_ADD,
                 fd,
@@ -86,31 +121,42 @@ void addPollFDToPollState(
   }
   else
   {
-    bool changedCapacity = false;
+    setRegisteredEvents(internalPollState, fd, events);
     ++(internalPollState->numFDs);
-    while (internalPollState->numFDs >
-           internalPollState->epollEventArrayCapacity)
-    {
-      changedCapacity = true;
-      if (internalPollState->epollEventArrayCapacity == 0)
-      {
-        internalPollState->epollEventArrayCapacity = 16;
-      }
-      else
-      {
-        internalPollState->epollEventArrayCapacity *= 2;
-      }
-    }
-    if (changedCapacity)
-    {
-      internalPollState->epollEventArray =
-        checkedRealloc(internalPollState->epollEventArray,
-                       internalPollState->epollEventArrayCapacity *
-                       sizeof(struct epoll_event));
-    }
   }
 }
 
+void addPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  enum ReadEventInterest readEventInterest,
+  enum WriteEventInterest writeEventInterest)
+{
+  addEventsToPollState(
+    pollState,
+    fd,
+    data,
+    ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? EPOLLIN : 0) |
+    ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? EPOLLOUT : 0));
+}
+
+bool edgeTriggeredPollSupported()
+{
+  return true;
+}
+
+void addEdgeTriggeredPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  addEventsToPollState(
+    pollState,
+    fd,
+    data,
+    EPOLLIN | EPOLLOUT | EPOLLET);
+}
 
 void updatePollFDInPollState(
   struct PollState* pollState,
@@ -121,14 +167,29 @@ void updatePollFDInPollState(
 {
   struct InternalPollState* internalPollState;
   struct epoll_event newEvent;
+  uint32_t registeredEvents;
 
   assert(pollState != NULL);
 
   internalPollState = pollState->internalPollState;
+
+  assert(fd >= 0);
+  assert(((size_t)fd) < internalPollState->registeredEventsArrayCapacity);
+
   newEvent.data.ptr = data;
   newEvent.events =
     ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? EPOLLIN : 0) |
     ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? EPOLLOUT : 0);
+
+  /* Edge triggered fds stay registered for both read and write,
+     and level triggered fds only need a syscall on a real change. */
+  registeredEvents = internalPollState->registeredEventsArray[fd];
+  if ((registeredEvents & EPOLLET) ||
+      (registeredEvents == newEvent.events))
+  {
+    return;
+  }
+
   if (epoll_ctl(internalPollState->epollFD,
                 EPOLL_CTL_MOD,
                 fd,
@@ -140,6 +201,7 @@ void updatePollFDInPollState(
              errnoToString(errno));
     abort();
   }
+  internalPollState->registeredEventsArray[fd] = newEvent.events;
 }
 
 void removePollFDFromPollState(
@@ -164,6 +226,7 @@ void removePollFDFromPollState(
   }
   else
   {
+    internalPollState->registeredEventsArray[fd] = 0;
     --(internalPollState->numFDs);
   }
 }
@@ -190,7 +253,8 @@ static int signalSafeEpollWait(
 }
 
 const struct PollResult* blockingPoll(
-  struct PollState* pollState)
+  struct PollState* pollState,
+  int timeoutMillis)
 {
   struct InternalPollState* internalPollState;
 
@@ -199,13 +263,12 @@ const struct PollResult* blockingPoll(
   internalPollState = pollState->internalPollState;
   if (internalPollState->numFDs > 0)
   {
-    size_t i;
     const int retVal = 
       signalSafeEpollWait(
         internalPollState->epollFD,
         internalPollState->epollEventArray,
-        internalPollState->numFDs,
-        -1);
+        internalPollState->maxEventsPerPoll,
+        timeoutMillis);
     if (retVal < 0)
     {
       proxyLog("epoll_wait error errno %d: %s",
@@ -213,24 +276,64 @@ const struct PollResult* blockingPoll(
                errnoToString(errno));
       abort();
     }
-    setPollResultNumReadyFDs(
-      &(pollState->pollResult),
-      retVal);
-    for (i = 0; i < retVal; ++i)
-    {
-      struct ReadyFDInfo* readyFDInfo = 
-        &(pollState->pollResult.readyFDInfoArray[i]);
-      const struct epoll_event* readyEpollEvent =
-        &(internalPollState->epollEventArray[i]);
-      readyFDInfo->data = readyEpollEvent->data.ptr;
-      readyFDInfo->readyForRead =
-        ((readyEpollEvent->events & EPOLLIN) != 0);
-      readyFDInfo->readyForWrite =
-        ((readyEpollEvent->events & EPOLLOUT) != 0);
-      readyFDInfo->readyForError =
-        ((readyEpollEvent->events & (EPOLLERR | EPOLLHUP)) != 0);
-    }
+    pollState->pollResult.numEvents = retVal;
+    pollState->pollResult.epollEventArray =
+      internalPollState->epollEventArray;
     return (&(pollState->pollResult));
   }
   return NULL;
 }
+
+bool completionIOSupported()
+{
+  return false;
+}
+
+void addRecvBufferGroup(
+  struct PollState* pollState,
+  struct BufferPool* bufferPool,
+  size_t bufferSize)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startAccept(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startRecv(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  size_t bufferGroup,
+  size_t maxBytes)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startSend(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  const void* buffer,
+  size_t size)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void cancelCompletionIO(
+  struct PollState* pollState,
+  void* data,
+  enum CompletedIOType completedIOType)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
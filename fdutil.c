@@ -14,6 +14,10 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include "fdutil.h"
 #include <assert.h>
 #include <errno.h>
@@ -50,17 +54,9 @@ static ssize_t signalSafeRead(
   return retVal;
 }
 
-struct ReadFromFDResult readFromFD(
-  int fd,
-  void* buf,
-  size_t bytesToRead)
+static struct ReadFromFDResult readRetValToResult(
+  ssize_t readRetVal)
 {
-  ssize_t readRetVal;
-
-  assert(fd >= 0);
-  assert(buf != NULL);
-
-  readRetVal = signalSafeRead(fd, buf, bytesToRead);
   if ((readRetVal == -1) &&
       ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
   {
@@ -104,6 +100,47 @@ struct ReadFromFDResult readFromFD(
   }
 }
 
+struct ReadFromFDResult readFromFD(
+  int fd,
+  void* buf,
+  size_t bytesToRead)
+{
+  assert(fd >= 0);
+  assert(buf != NULL);
+
+  return readRetValToResult(
+    signalSafeRead(fd, buf, bytesToRead));
+}
+
+static ssize_t signalSafeReadv(
+  int fd,
+  const struct iovec* iov,
+  int iovcnt)
+{
+  bool interrupted;
+  ssize_t retVal;
+  do
+  {
+    retVal = readv(fd, iov, iovcnt);
+    interrupted =
+      ((retVal == -1) &&
+       (errno == EINTR));
+  } while (interrupted);
+  return retVal;
+}
+
+struct ReadFromFDResult readvFromFD(
+  int fd,
+  const struct iovec* iov,
+  int iovcnt)
+{
+  assert(fd >= 0);
+  assert(iov != NULL);
+
+  return readRetValToResult(
+    signalSafeReadv(fd, iov, iovcnt));
+}
+
 static ssize_t signalSafeWrite(
   int fd,
   const void* buf,
@@ -121,17 +158,9 @@ static ssize_t signalSafeWrite(
   return retVal;
 }
 
-struct WriteToFDResult writeToFD(
-  int fd,
-  const void* buf,
-  size_t bytesToWrite)
+static struct WriteToFDResult writeRetValToResult(
+  ssize_t writeRetVal)
 {
-  ssize_t writeRetVal;
-
-  assert(fd >= 0);
-  assert(buf != NULL);
-
-  writeRetVal = signalSafeWrite(fd, buf, bytesToWrite);
   if ((writeRetVal == -1) &&
       ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
   {
@@ -165,6 +194,109 @@ struct WriteToFDResult writeToFD(
   }
 }
 
+struct WriteToFDResult writeToFD(
+  int fd,
+  const void* buf,
+  size_t bytesToWrite)
+{
+  assert(fd >= 0);
+  assert(buf != NULL);
+
+  return writeRetValToResult(
+    signalSafeWrite(fd, buf, bytesToWrite));
+}
+
+static ssize_t signalSafeWritev(
+  int fd,
+  const struct iovec* iov,
+  int iovcnt)
+{
+  bool interrupted;
+  ssize_t retVal;
+  do
+  {
+    retVal = writev(fd, iov, iovcnt);
+    interrupted =
+      ((retVal == -1) &&
+       (errno == EINTR));
+  } while (interrupted);
+  return retVal;
+}
+
+struct WriteToFDResult writevToFD(
+  int fd,
+  const struct iovec* iov,
+  int iovcnt)
+{
+  assert(fd >= 0);
+  assert(iov != NULL);
+
+  return writeRetValToResult(
+    signalSafeWritev(fd, iov, iovcnt));
+}
+
+#ifdef PROXY_SPLICE_SUPPORTED
+
+int createNonBlockingPipe(
+  int pipeFDs[2])
+{
+  return pipe2(pipeFDs, O_NONBLOCK);
+}
+
+int setPipeSize(
+  int pipeFD,
+  size_t pipeSize)
+{
+  /* The kernel may refuse sizes above fs.pipe-max-size,
+     in which case the pipe keeps its current capacity. */
+  fcntl(pipeFD, F_SETPIPE_SZ, (int)pipeSize);
+  return fcntl(pipeFD, F_GETPIPE_SZ);
+}
+
+static ssize_t signalSafeSplice(
+  int fdIn,
+  int fdOut,
+  size_t len)
+{
+  bool interrupted;
+  ssize_t retVal;
+  do
+  {
+    retVal = splice(fdIn, NULL, fdOut, NULL, len,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    interrupted =
+      ((retVal == -1) &&
+       (errno == EINTR));
+  } while (interrupted);
+  return retVal;
+}
+
+struct ReadFromFDResult spliceFromFDToPipe(
+  int fd,
+  int pipeWriteFD,
+  size_t bytesToSplice)
+{
+  assert(fd >= 0);
+  assert(pipeWriteFD >= 0);
+
+  return readRetValToResult(
+    signalSafeSplice(fd, pipeWriteFD, bytesToSplice));
+}
+
+struct WriteToFDResult spliceFromPipeToFD(
+  int pipeReadFD,
+  int fd,
+  size_t bytesToSplice)
+{
+  assert(pipeReadFD >= 0);
+  assert(fd >= 0);
+
+  return writeRetValToResult(
+    signalSafeSplice(pipeReadFD, fd, bytesToSplice));
+}
+
+#endif
+
 int signalSafeClose(
   int fd)
 {
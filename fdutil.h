@@ -18,6 +18,11 @@
 #define FDUTIL_H
 
 #include <stddef.h>
+#include <sys/uio.h>
+
+#if (!defined(PROXY_DISABLE_SPLICE)) && defined(__linux__)
+#define PROXY_SPLICE_SUPPORTED
+#endif
 
 extern int setFDNonBlocking(
   int fd);
@@ -42,6 +47,11 @@ struct ReadFromFDResult readFromFD(
   void* buf,
   size_t bytesToRead);
 
+struct ReadFromFDResult readvFromFD(
+  int fd,
+  const struct iovec* iov,
+  int iovcnt);
+
 enum WriteToFDStatus
 {
   WRITE_TO_FD_WOULD_BLOCK,
@@ -61,6 +71,40 @@ struct WriteToFDResult writeToFD(
   const void* buf,
   size_t bytesToWrite);
 
+struct WriteToFDResult writevToFD(
+  int fd,
+  const struct iovec* iov,
+  int iovcnt);
+
+#ifdef PROXY_SPLICE_SUPPORTED
+
+/* Create a pipe with both ends non-blocking.
+   Returns 0 on success, -1 on error. */
+extern int createNonBlockingPipe(
+  int pipeFDs[2]);
+
+/* Try to set the capacity of a pipe to pipeSize bytes.
+   Returns the resulting capacity of the pipe, or -1 on error. */
+extern int setPipeSize(
+  int pipeFD,
+  size_t pipeSize);
+
+/* Move up to bytesToSplice bytes from fd into a pipe without
+   copying through user space.  Same result semantics as readFromFD. */
+struct ReadFromFDResult spliceFromFDToPipe(
+  int fd,
+  int pipeWriteFD,
+  size_t bytesToSplice);
+
+/* Move up to bytesToSplice bytes from a pipe into fd without
+   copying through user space.  Same result semantics as writeToFD. */
+struct WriteToFDResult spliceFromPipeToFD(
+  int pipeReadFD,
+  int fd,
+  size_t bytesToSplice);
+
+#endif
+
 extern int signalSafeClose(
   int fd);
 
@@ -0,0 +1,1111 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* io_uring poll implementation.
+
+   Each fd has at most one one-shot IORING_OP_POLL_ADD armed in the
+   kernel.  Interest changes only mark the fd dirty; all new polls and
+   poll removals for an iteration are queued in the submission ring and
+   submitted together with the wait for completions, so a busy I/O
+   thread makes one io_uring_enter per blockingPoll.  A poll that fires
+   is re-armed on the next blockingPoll while there is still interest,
+   which gives the same level triggered behavior as the other
+   implementations.
+
+   Sockets can also be accepted on, received from, and sent to with
+   operations that complete in the same ring.  An accept is
+   multishot, so it stays armed for every connection.  A receive does not
+   hold a buffer while it waits: each receive buffer group is a
+   provided buffer ring registered with the kernel, which picks a
+   buffer only when bytes arrive.  The rings are topped up from
+   their BufferPool by blockingPoll.  This needs provided buffer
+   rings (Linux 5.19); without them completionIOSupported returns
+   false.
+
+   If the running kernel does not provide io_uring with the features
+   used here, all calls fall through to the epoll implementation. */
+
+#include "bufferpool.h"
+#include "errutil.h"
+#include "log.h"
+#include "memutil.h"
+#include "pollutil.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define initializePollState initializeEpollPollState
+#define addPollFDToPollState addPollFDToEpollPollState
+#define edgeTriggeredPollSupported epollEdgeTriggeredPollSupported
+#define addEdgeTriggeredPollFDToPollState addEdgeTriggeredPollFDToEpollPollState
+#define updatePollFDInPollState updatePollFDInEpollPollState
+#define removePollFDFromPollState removePollFDFromEpollPollState
+#define blockingPoll epollBlockingPoll
+#define completionIOSupported epollCompletionIOSupported
+#define addRecvBufferGroup addRecvBufferGroupToEpollPollState
+#define startAccept epollStartAccept
+#define startRecv epollStartRecv
+#define startSend epollStartSend
+#define cancelCompletionIO epollCancelCompletionIO
+#include "epoll_pollutil.c"
+#undef initializePollState
+#undef addPollFDToPollState
+#undef edgeTriggeredPollSupported
+#undef addEdgeTriggeredPollFDToPollState
+#undef updatePollFDInPollState
+#undef removePollFDFromPollState
+#undef blockingPoll
+#undef completionIOSupported
+#undef addRecvBufferGroup
+#undef startAccept
+#undef startRecv
+#undef startSend
+#undef cancelCompletionIO
+
+#define IO_URING_SQ_ENTRIES (1024)
+#define IO_URING_CQ_ENTRIES (8 * IO_URING_SQ_ENTRIES)
+#define IO_URING_REQUIRED_FEATURES \
+  (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+/* The top bit of user_data is IO_URING_COMPLETION_IO_FLAG. */
+#define IO_URING_ARM_GENERATION_MASK (0x7fffffff)
+#define IO_URING_MAX_RECV_BUFFER_GROUPS (32)
+#define IO_URING_MAX_RECV_BUFFERS_PER_GROUP \
+  (1 << IO_URING_RECV_BUFFER_ID_GROUP_SHIFT)
+#define IO_URING_MIN_RECV_BUFFERS_PER_GROUP (8)
+/* Receive buffers of each group are added to its ring up to about
+   this many bytes. */
+#define IO_URING_RECV_BUFFER_GROUP_BYTES (512 * 1024)
+
+struct IOUringFDInfo
+{
+  void* data;
+  bool registered;
+  bool dirty;
+  /* Poll events wanted by the caller. */
+  uint32_t wantedEvents;
+  /* Poll events of the poll armed in the kernel, 0 if none. */
+  uint32_t armedEvents;
+  /* Incremented for every poll armed on this fd so completions of
+     earlier polls can be told apart and ignored. */
+  uint32_t armGeneration;
+};
+
+struct IOUringRecvBufferGroup
+{
+  struct BufferPool* bufferPool;
+  size_t bufferSize;
+  struct io_uring_buf_ring* bufRing;
+  unsigned numRingEntries;
+  unsigned short ringTail;
+  /* Indexes in the group of buffer ids not in the ring, since their
+     buffers were received into. */
+  uint16_t* freeBufferIndexArray;
+  unsigned numFreeBufferIndexes;
+};
+
+struct IOUringPollState
+{
+  int ringFD;
+  void* ringPtr;
+  size_t ringSize;
+  struct io_uring_sqe* sqeArray;
+  size_t sqeArraySize;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqRingMask;
+  unsigned sqEntries;
+  unsigned* sqIndexArray;
+
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqRingMask;
+  struct io_uring_cqe* cqeArray;
+  /* Completions returned by the last blockingPoll are handled in
+     place in the completion ring, so they are released to the kernel
+     up to nextCQHead only by the next blockingPoll. */
+  unsigned nextCQHead;
+  size_t maxEventsPerPoll;
+
+  size_t numFDs;
+  struct IOUringFDInfo* fdInfoArray;
+  size_t fdInfoArrayCapacity;
+
+  int* dirtyFDArray;
+  size_t numDirtyFDs;
+  size_t dirtyFDArrayCapacity;
+
+  /* Accepts, receives, and sends that will complete again. */
+  size_t numCompletionIOInFlight;
+  struct IOUringRecvBufferGroup recvBufferGroupArray[
+    IO_URING_MAX_RECV_BUFFER_GROUPS];
+  size_t numRecvBufferGroups;
+  /* Indexed by buffer id. */
+  void** recvBufferArray;
+};
+
+static pthread_once_t ioUringProbeOnce = PTHREAD_ONCE_INIT;
+
+static bool ioUringAvailable = false;
+
+static bool ioUringCompletionIOAvailable = false;
+
+static int ioUringSetup(
+  unsigned entries,
+  struct io_uring_params* params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(
+  int ringFD,
+  unsigned toSubmit,
+  unsigned minComplete,
+  unsigned flags,
+  const struct io_uring_getevents_arg* arg)
+{
+  return syscall(__NR_io_uring_enter, ringFD, toSubmit, minComplete,
+                 flags, arg, sizeof(struct io_uring_getevents_arg));
+}
+
+static int ioUringRegister(
+  int ringFD,
+  unsigned opcode,
+  void* arg,
+  unsigned numArgs)
+{
+  return syscall(__NR_io_uring_register, ringFD, opcode, arg, numArgs);
+}
+
+/* Register a provided buffer ring of numRingEntries entries at
+   bufRing as buffer group groupID. */
+static int registerBufRing(
+  int ringFD,
+  struct io_uring_buf_ring* bufRing,
+  unsigned numRingEntries,
+  unsigned groupID)
+{
+  struct io_uring_buf_reg bufReg;
+
+  memset(&bufReg, 0, sizeof(bufReg));
+  bufReg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+  bufReg.ring_entries = numRingEntries;
+  bufReg.bgid = groupID;
+  return ioUringRegister(ringFD, IORING_REGISTER_PBUF_RING, &bufReg, 1);
+}
+
+static bool probeIOUringBufRing(
+  int ringFD)
+{
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  struct io_uring_buf_ring* bufRing;
+  bool supported;
+
+  bufRing = mmap(NULL, pageSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufRing == MAP_FAILED)
+  {
+    return false;
+  }
+  supported = (registerBufRing(ringFD, bufRing, 1, 0) == 0);
+  if (supported)
+  {
+    struct io_uring_buf_reg bufReg;
+    memset(&bufReg, 0, sizeof(bufReg));
+    ioUringRegister(ringFD, IORING_UNREGISTER_PBUF_RING, &bufReg, 1);
+  }
+  munmap(bufRing, pageSize);
+  return supported;
+}
+
+static void probeIOUring()
+{
+  struct io_uring_params params;
+  int ringFD;
+
+  memset(&params, 0, sizeof(params));
+  ringFD = ioUringSetup(1, &params);
+  if (ringFD < 0)
+  {
+    proxyLog("io_uring_setup error errno %d, using epoll", errno);
+  }
+  else
+  {
+    if ((params.features & IO_URING_REQUIRED_FEATURES) !=
+        IO_URING_REQUIRED_FEATURES)
+    {
+      proxyLog("io_uring features 0x%x not supported, using epoll",
+               (unsigned int)IO_URING_REQUIRED_FEATURES);
+    }
+    else
+    {
+      ioUringAvailable = true;
+      ioUringCompletionIOAvailable = probeIOUringBufRing(ringFD);
+      if (!ioUringCompletionIOAvailable)
+      {
+        proxyLog("io_uring provided buffer rings not supported, "
+                 "completion io disabled");
+      }
+    }
+    close(ringFD);
+  }
+}
+
+static bool checkIOUringAvailable()
+{
+  const int retVal = pthread_once(&ioUringProbeOnce, &probeIOUring);
+  if (retVal != 0)
+  {
+    proxyLog("pthread_once error %d", retVal);
+    abort();
+  }
+  return ioUringAvailable;
+}
+
+void initializePollState(
+  struct PollState* pollState,
+  size_t maxEventsPerPoll)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct io_uring_params params;
+
+  assert(pollState != NULL);
+  assert(maxEventsPerPoll > 0);
+
+  if (!checkIOUringAvailable())
+  {
+    initializeEpollPollState(pollState, maxEventsPerPoll);
+    return;
+  }
+
+  memset(pollState, 0, sizeof(struct PollState));
+  ioUringPollState =
+    checkedCalloc(1, sizeof(struct IOUringPollState));
+  pollState->internalPollState = ioUringPollState;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = IO_URING_CQ_ENTRIES;
+  ioUringPollState->ringFD = ioUringSetup(IO_URING_SQ_ENTRIES, &params);
+  if (ioUringPollState->ringFD < 0)
+  {
+    proxyLog("io_uring_setup error errno %d: %s",
+             errno,
+             errnoToString(errno));
+    abort();
+  }
+
+  /* With IORING_FEAT_SINGLE_MMAP the submission and completion
+     rings share one mapping. */
+  ioUringPollState->ringSize =
+    params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+  if ((params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe))) >
+      ioUringPollState->ringSize)
+  {
+    ioUringPollState->ringSize =
+      params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+  }
+  ioUringPollState->ringPtr =
+    mmap(NULL, ioUringPollState->ringSize,
+         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         ioUringPollState->ringFD, IORING_OFF_SQ_RING);
+  if (ioUringPollState->ringPtr == MAP_FAILED)
+  {
+    proxyLog("io_uring ring mmap error errno %d: %s",
+             errno,
+             errnoToString(errno));
+    abort();
+  }
+
+  ioUringPollState->sqeArraySize =
+    params.sq_entries * sizeof(struct io_uring_sqe);
+  ioUringPollState->sqeArray =
+    mmap(NULL, ioUringPollState->sqeArraySize,
+         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         ioUringPollState->ringFD, IORING_OFF_SQES);
+  if (ioUringPollState->sqeArray == MAP_FAILED)
+  {
+    proxyLog("io_uring sqe mmap error errno %d: %s",
+             errno,
+             errnoToString(errno));
+    abort();
+  }
+
+  ioUringPollState->sqHead =
+    (unsigned*)((char*)ioUringPollState->ringPtr + params.sq_off.head);
+  ioUringPollState->sqTail =
+    (unsigned*)((char*)ioUringPollState->ringPtr + params.sq_off.tail);
+  ioUringPollState->sqRingMask =
+    *((unsigned*)((char*)ioUringPollState->ringPtr + params.sq_off.ring_mask));
+  ioUringPollState->sqEntries = params.sq_entries;
+  ioUringPollState->sqIndexArray =
+    (unsigned*)((char*)ioUringPollState->ringPtr + params.sq_off.array);
+
+  ioUringPollState->cqHead =
+    (unsigned*)((char*)ioUringPollState->ringPtr + params.cq_off.head);
+  ioUringPollState->cqTail =
+    (unsigned*)((char*)ioUringPollState->ringPtr + params.cq_off.tail);
+  ioUringPollState->cqRingMask =
+    *((unsigned*)((char*)ioUringPollState->ringPtr + params.cq_off.ring_mask));
+  ioUringPollState->cqeArray =
+    (struct io_uring_cqe*)((char*)ioUringPollState->ringPtr + params.cq_off.cqes);
+  ioUringPollState->nextCQHead = *(ioUringPollState->cqHead);
+  ioUringPollState->maxEventsPerPoll = maxEventsPerPoll;
+  pollState->pollResult.cqeArray = ioUringPollState->cqeArray;
+  pollState->pollResult.cqRingMask = ioUringPollState->cqRingMask;
+
+  proxyLog("created io_uring (fd=%d)",
+           ioUringPollState->ringFD);
+}
+
+static unsigned numUnsubmittedSQEs(
+  const struct IOUringPollState* ioUringPollState)
+{
+  return (*(ioUringPollState->sqTail)) -
+         __atomic_load_n(ioUringPollState->sqHead, __ATOMIC_ACQUIRE);
+}
+
+static int signalSafeIOUringEnter(
+  struct IOUringPollState* ioUringPollState,
+  unsigned minComplete,
+  int timeoutMillis)
+{
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  bool interrupted;
+  int retVal;
+
+  memset(&arg, 0, sizeof(arg));
+  if (timeoutMillis >= 0)
+  {
+    ts.tv_sec = timeoutMillis / 1000;
+    ts.tv_nsec = (timeoutMillis % 1000) * 1000000L;
+    arg.ts = (uint64_t)(uintptr_t)(&ts);
+  }
+
+  do
+  {
+    retVal = ioUringEnter(
+      ioUringPollState->ringFD,
+      numUnsubmittedSQEs(ioUringPollState),
+      minComplete,
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+      &arg);
+    interrupted = ((retVal < 0) &&
+                   (errno == EINTR));
+    /* Don't block on the next try if the last wait was interrupted.
+       Assumes waiting too long is worse than not waiting long enough. */
+    ts.tv_sec = 0;
+    ts.tv_nsec = 0;
+    arg.ts = (uint64_t)(uintptr_t)(&ts);
+  } while (interrupted);
+
+  /* Timing out or a full completion queue are not errors,
+     completions are harvested either way. */
+  if ((retVal < 0) &&
+      ((errno == ETIME) || (errno == EBUSY) || (errno == EAGAIN)))
+  {
+    retVal = 0;
+  }
+  return retVal;
+}
+
+static struct io_uring_sqe* getSQE(
+  struct IOUringPollState* ioUringPollState)
+{
+  struct io_uring_sqe* sqe;
+  unsigned tail;
+
+  if (numUnsubmittedSQEs(ioUringPollState) >= ioUringPollState->sqEntries)
+  {
+    /* Submission ring full: submit without waiting to make room. */
+    if (signalSafeIOUringEnter(ioUringPollState, 0, 0) < 0)
+    {
+      proxyLog("io_uring_enter error errno %d: %s",
+               errno,
+               errnoToString(errno));
+      abort();
+    }
+  }
+
+  tail = *(ioUringPollState->sqTail);
+  sqe = &(ioUringPollState->sqeArray[tail & ioUringPollState->sqRingMask]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ioUringPollState->sqIndexArray[tail & ioUringPollState->sqRingMask] =
+    tail & ioUringPollState->sqRingMask;
+  __atomic_store_n(ioUringPollState->sqTail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static uint64_t pollUserData(
+  int fd,
+  uint32_t armGeneration)
+{
+  return ((((uint64_t)armGeneration) << 32) | ((uint32_t)fd));
+}
+
+static uint64_t completionIOUserData(
+  void* data,
+  enum CompletedIOType completedIOType)
+{
+  assert((((uintptr_t)data) & ~IO_URING_COMPLETION_IO_DATA_MASK) == 0);
+  return (IO_URING_COMPLETION_IO_FLAG |
+          (((uint64_t)completedIOType) << IO_URING_COMPLETED_IO_TYPE_SHIFT) |
+          ((uint64_t)(uintptr_t)data));
+}
+
+static void queuePollAdd(
+  struct IOUringPollState* ioUringPollState,
+  int fd,
+  struct IOUringFDInfo* fdInfo)
+{
+  struct io_uring_sqe* sqe;
+
+  fdInfo->armGeneration =
+    (fdInfo->armGeneration + 1) & IO_URING_ARM_GENERATION_MASK;
+  fdInfo->armedEvents = fdInfo->wantedEvents;
+
+  sqe = getSQE(ioUringPollState);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = fdInfo->armedEvents;
+  sqe->user_data = pollUserData(fd, fdInfo->armGeneration);
+}
+
+static void queuePollRemove(
+  struct IOUringPollState* ioUringPollState,
+  int fd,
+  struct IOUringFDInfo* fdInfo)
+{
+  struct io_uring_sqe* sqe;
+
+  fdInfo->armedEvents = 0;
+
+  sqe = getSQE(ioUringPollState);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = pollUserData(fd, fdInfo->armGeneration);
+  sqe->user_data = IO_URING_IGNORED_USER_DATA;
+}
+
+static void markFDDirty(
+  struct IOUringPollState* ioUringPollState,
+  int fd,
+  struct IOUringFDInfo* fdInfo)
+{
+  if (fdInfo->dirty)
+  {
+    return;
+  }
+  fdInfo->dirty = true;
+
+  if (ioUringPollState->numDirtyFDs >= ioUringPollState->dirtyFDArrayCapacity)
+  {
+    ioUringPollState->dirtyFDArrayCapacity =
+      ((ioUringPollState->dirtyFDArrayCapacity == 0) ?
+       16 :
+       (ioUringPollState->dirtyFDArrayCapacity * 2));
+    ioUringPollState->dirtyFDArray =
+      checkedRealloc(ioUringPollState->dirtyFDArray,
+                     ioUringPollState->dirtyFDArrayCapacity * sizeof(int));
+  }
+  ioUringPollState->dirtyFDArray[ioUringPollState->numDirtyFDs] = fd;
+  ++(ioUringPollState->numDirtyFDs);
+}
+
+static struct IOUringFDInfo* getFDInfo(
+  struct IOUringPollState* ioUringPollState,
+  int fd)
+{
+  assert(fd >= 0);
+
+  if (((size_t)fd) >= ioUringPollState->fdInfoArrayCapacity)
+  {
+    const size_t oldCapacity = ioUringPollState->fdInfoArrayCapacity;
+    size_t newCapacity = ((oldCapacity == 0) ? 16 : oldCapacity);
+    while (((size_t)fd) >= newCapacity)
+    {
+      newCapacity *= 2;
+    }
+    ioUringPollState->fdInfoArray =
+      checkedRealloc(ioUringPollState->fdInfoArray,
+                     newCapacity * sizeof(struct IOUringFDInfo));
+    memset(&(ioUringPollState->fdInfoArray[oldCapacity]),
+           0,
+           (newCapacity - oldCapacity) * sizeof(struct IOUringFDInfo));
+    ioUringPollState->fdInfoArrayCapacity = newCapacity;
+  }
+  return (&(ioUringPollState->fdInfoArray[fd]));
+}
+
+static uint32_t interestToPollEvents(
+  enum ReadEventInterest readEventInterest,
+  enum WriteEventInterest writeEventInterest)
+{
+  return
+    ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? POLLIN : 0) |
+    ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? POLLOUT : 0);
+}
+
+void addPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  enum ReadEventInterest readEventInterest,
+  enum WriteEventInterest writeEventInterest)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct IOUringFDInfo* fdInfo;
+
+  assert(pollState != NULL);
+
+  if (!ioUringAvailable)
+  {
+    addPollFDToEpollPollState(
+      pollState, fd, data, readEventInterest, writeEventInterest);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  fdInfo = getFDInfo(ioUringPollState, fd);
+  if (fdInfo->registered)
+  {
+    proxyLog("attempt to add duplicate fd %d to PollState",
+             fd);
+    abort();
+  }
+
+  fdInfo->registered = true;
+  fdInfo->data = data;
+  fdInfo->wantedEvents =
+    interestToPollEvents(readEventInterest, writeEventInterest);
+  markFDDirty(ioUringPollState, fd, fdInfo);
+  ++(ioUringPollState->numFDs);
+}
+
+bool edgeTriggeredPollSupported()
+{
+  if (!checkIOUringAvailable())
+  {
+    return epollEdgeTriggeredPollSupported();
+  }
+  return false;
+}
+
+void addEdgeTriggeredPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  if (!ioUringAvailable)
+  {
+    addEdgeTriggeredPollFDToEpollPollState(pollState, fd, data);
+    return;
+  }
+
+  proxyLog("edge triggered poll is not supported with io_uring");
+  abort();
+}
+
+void updatePollFDInPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  enum ReadEventInterest readEventInterest,
+  enum WriteEventInterest writeEventInterest)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct IOUringFDInfo* fdInfo;
+
+  assert(pollState != NULL);
+
+  if (!ioUringAvailable)
+  {
+    updatePollFDInEpollPollState(
+      pollState, fd, data, readEventInterest, writeEventInterest);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  fdInfo = getFDInfo(ioUringPollState, fd);
+  if (!(fdInfo->registered))
+  {
+    proxyLog("attempt to update unknown fd %d in PollState",
+             fd);
+    abort();
+  }
+
+  fdInfo->data = data;
+  fdInfo->wantedEvents =
+    interestToPollEvents(readEventInterest, writeEventInterest);
+  if (fdInfo->wantedEvents != fdInfo->armedEvents)
+  {
+    markFDDirty(ioUringPollState, fd, fdInfo);
+  }
+}
+
+void removePollFDFromPollState(
+  struct PollState* pollState,
+  int fd)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct IOUringFDInfo* fdInfo;
+
+  assert(pollState != NULL);
+
+  if (!ioUringAvailable)
+  {
+    removePollFDFromEpollPollState(pollState, fd);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  fdInfo = getFDInfo(ioUringPollState, fd);
+  if (!(fdInfo->registered))
+  {
+    proxyLog("attempt to remove unknown fd %d from PollState",
+             fd);
+    abort();
+  }
+
+  /* An armed poll holds a reference to the file, so queue its removal
+     now.  It is submitted with the next blockingPoll.  armGeneration is
+     kept so completions of the old poll are ignored if fd is reused. */
+  if (fdInfo->armedEvents != 0)
+  {
+    queuePollRemove(ioUringPollState, fd, fdInfo);
+  }
+  fdInfo->registered = false;
+  fdInfo->data = NULL;
+  fdInfo->wantedEvents = 0;
+  --(ioUringPollState->numFDs);
+}
+
+/* Queue poll adds and removes for every fd whose wanted
+   events differ from what is armed in the kernel. */
+static void queueDirtyFDs(
+  struct IOUringPollState* ioUringPollState)
+{
+  size_t i;
+
+  for (i = 0; i < ioUringPollState->numDirtyFDs; ++i)
+  {
+    const int fd = ioUringPollState->dirtyFDArray[i];
+    struct IOUringFDInfo* fdInfo = &(ioUringPollState->fdInfoArray[fd]);
+
+    fdInfo->dirty = false;
+    if ((!(fdInfo->registered)) ||
+        (fdInfo->wantedEvents == fdInfo->armedEvents))
+    {
+      continue;
+    }
+
+    if (fdInfo->armedEvents != 0)
+    {
+      queuePollRemove(ioUringPollState, fd, fdInfo);
+    }
+    if (fdInfo->wantedEvents != 0)
+    {
+      queuePollAdd(ioUringPollState, fd, fdInfo);
+    }
+  }
+  ioUringPollState->numDirtyFDs = 0;
+}
+
+/* Add a buffer to the ring of each group for every buffer id
+   received into since the last call. */
+static void refillRecvBufferRings(
+  struct IOUringPollState* ioUringPollState)
+{
+  size_t i;
+
+  for (i = 0; i < ioUringPollState->numRecvBufferGroups; ++i)
+  {
+    struct IOUringRecvBufferGroup* group =
+      &(ioUringPollState->recvBufferGroupArray[i]);
+    const unsigned ringMask = group->numRingEntries - 1;
+
+    if (group->numFreeBufferIndexes == 0)
+    {
+      continue;
+    }
+
+    while (group->numFreeBufferIndexes > 0)
+    {
+      const unsigned bufferID =
+        (i << IO_URING_RECV_BUFFER_ID_GROUP_SHIFT) |
+        group->freeBufferIndexArray[group->numFreeBufferIndexes - 1];
+      struct io_uring_buf* buf =
+        &(group->bufRing->bufs[group->ringTail & ringMask]);
+      void* buffer = getBufferFromBufferPool(group->bufferPool);
+
+      ioUringPollState->recvBufferArray[bufferID] = buffer;
+      buf->addr = (uint64_t)(uintptr_t)buffer;
+      buf->len = group->bufferSize;
+      buf->bid = bufferID;
+      ++(group->ringTail);
+      --(group->numFreeBufferIndexes);
+    }
+    __atomic_store_n(&(group->bufRing->tail), group->ringTail,
+                     __ATOMIC_RELEASE);
+  }
+}
+
+const struct PollResult* blockingPoll(
+  struct PollState* pollState,
+  int timeoutMillis)
+{
+  struct IOUringPollState* ioUringPollState;
+  unsigned cqHead;
+  unsigned cqTail;
+  unsigned cqIndex;
+
+  assert(pollState != NULL);
+
+  if (!ioUringAvailable)
+  {
+    return epollBlockingPoll(pollState, timeoutMillis);
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  if ((ioUringPollState->numFDs == 0) &&
+      (ioUringPollState->numCompletionIOInFlight == 0))
+  {
+    return NULL;
+  }
+
+  cqHead = ioUringPollState->nextCQHead;
+  __atomic_store_n(ioUringPollState->cqHead, cqHead, __ATOMIC_RELEASE);
+
+  queueDirtyFDs(ioUringPollState);
+  refillRecvBufferRings(ioUringPollState);
+
+  /* Only wait if no completions are already queued. */
+  cqTail = __atomic_load_n(ioUringPollState->cqTail, __ATOMIC_ACQUIRE);
+  if (signalSafeIOUringEnter(
+        ioUringPollState,
+        ((cqHead == cqTail) && (timeoutMillis != 0)) ? 1 : 0,
+        timeoutMillis) < 0)
+  {
+    proxyLog("io_uring_enter error errno %d: %s",
+             errno,
+             errnoToString(errno));
+    abort();
+  }
+
+  cqTail = __atomic_load_n(ioUringPollState->cqTail, __ATOMIC_ACQUIRE);
+  if ((cqTail - cqHead) > ioUringPollState->maxEventsPerPoll)
+  {
+    cqTail = cqHead + ioUringPollState->maxEventsPerPoll;
+  }
+
+  /* Replace user_data of each completion with the data of its fd so
+     getReadyFDInfo can decode it in place. */
+  for (cqIndex = cqHead; cqIndex != cqTail; ++cqIndex)
+  {
+    struct io_uring_cqe* cqe =
+      &(ioUringPollState->cqeArray[cqIndex & ioUringPollState->cqRingMask]);
+    const int fd = (int)(cqe->user_data & 0xffffffff);
+    const uint32_t armGeneration = (uint32_t)(cqe->user_data >> 32);
+    struct IOUringFDInfo* fdInfo;
+
+    if (cqe->user_data == IO_URING_IGNORED_USER_DATA)
+    {
+      continue;
+    }
+
+    /* Socket operations are decoded by getReadyFDInfo as they are.
+       The buffer id of a receive buffer is free to be given a new
+       buffer, the caller owns the one received into. */
+    if (cqe->user_data & IO_URING_COMPLETION_IO_FLAG)
+    {
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+      {
+        --(ioUringPollState->numCompletionIOInFlight);
+      }
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+      {
+        const unsigned bufferID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        struct IOUringRecvBufferGroup* group =
+          &(ioUringPollState->recvBufferGroupArray[
+              bufferID >> IO_URING_RECV_BUFFER_ID_GROUP_SHIFT]);
+        group->freeBufferIndexArray[group->numFreeBufferIndexes] =
+          bufferID & (IO_URING_MAX_RECV_BUFFERS_PER_GROUP - 1);
+        ++(group->numFreeBufferIndexes);
+      }
+      continue;
+    }
+
+    if (((size_t)fd) >= ioUringPollState->fdInfoArrayCapacity)
+    {
+      cqe->user_data = IO_URING_IGNORED_USER_DATA;
+      continue;
+    }
+
+    /* Ignore completions of polls that were removed or replaced. */
+    fdInfo = &(ioUringPollState->fdInfoArray[fd]);
+    if ((!(fdInfo->registered)) ||
+        (fdInfo->armedEvents == 0) ||
+        (fdInfo->armGeneration != armGeneration))
+    {
+      cqe->user_data = IO_URING_IGNORED_USER_DATA;
+      continue;
+    }
+
+    /* The poll is one-shot, re-arm it on the next blockingPoll. */
+    fdInfo->armedEvents = 0;
+    markFDDirty(ioUringPollState, fd, fdInfo);
+    if (cqe->res == -ECANCELED)
+    {
+      cqe->user_data = IO_URING_IGNORED_USER_DATA;
+      continue;
+    }
+
+    cqe->user_data = (uint64_t)(uintptr_t)(fdInfo->data);
+  }
+  ioUringPollState->nextCQHead = cqTail;
+
+  pollState->pollResult.cqHead = cqHead;
+  pollState->pollResult.numEvents = cqTail - cqHead;
+  return (&(pollState->pollResult));
+}
+
+bool completionIOSupported()
+{
+  if (!checkIOUringAvailable())
+  {
+    return epollCompletionIOSupported();
+  }
+  return ioUringCompletionIOAvailable;
+}
+
+static unsigned getNumRecvBuffersPerGroup(
+  size_t bufferSize)
+{
+  unsigned numRecvBuffers = IO_URING_MIN_RECV_BUFFERS_PER_GROUP;
+  while ((numRecvBuffers < IO_URING_MAX_RECV_BUFFERS_PER_GROUP) &&
+         ((numRecvBuffers * 2 * bufferSize) <=
+          IO_URING_RECV_BUFFER_GROUP_BYTES))
+  {
+    numRecvBuffers *= 2;
+  }
+  return numRecvBuffers;
+}
+
+void addRecvBufferGroup(
+  struct PollState* pollState,
+  struct BufferPool* bufferPool,
+  size_t bufferSize)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct IOUringRecvBufferGroup* group;
+  size_t groupID;
+  unsigned i;
+
+  assert(pollState != NULL);
+  assert(bufferPool != NULL);
+
+  if (!ioUringAvailable)
+  {
+    addRecvBufferGroupToEpollPollState(pollState, bufferPool, bufferSize);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  groupID = ioUringPollState->numRecvBufferGroups;
+  if ((!ioUringCompletionIOAvailable) ||
+      (groupID >= IO_URING_MAX_RECV_BUFFER_GROUPS) ||
+      (bufferSize > UINT32_MAX))
+  {
+    proxyLog("unable to add receive buffer group %ld",
+             (long)groupID);
+    abort();
+  }
+
+  if (!(ioUringPollState->recvBufferArray))
+  {
+    ioUringPollState->recvBufferArray =
+      checkedCalloc(IO_URING_MAX_RECV_BUFFER_GROUPS *
+                    IO_URING_MAX_RECV_BUFFERS_PER_GROUP,
+                    sizeof(void*));
+    pollState->pollResult.recvBufferArray =
+      ioUringPollState->recvBufferArray;
+  }
+
+  group = &(ioUringPollState->recvBufferGroupArray[groupID]);
+  group->bufferPool = bufferPool;
+  group->bufferSize = bufferSize;
+  group->numRingEntries = getNumRecvBuffersPerGroup(bufferSize);
+  group->bufRing =
+    mmap(NULL, group->numRingEntries * sizeof(struct io_uring_buf),
+         PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (group->bufRing == MAP_FAILED)
+  {
+    proxyLog("buffer ring mmap error errno %d: %s",
+             errno,
+             errnoToString(errno));
+    abort();
+  }
+  if (registerBufRing(ioUringPollState->ringFD, group->bufRing,
+                      group->numRingEntries, groupID) < 0)
+  {
+    proxyLog("io_uring register buffer ring error errno %d: %s",
+             errno,
+             errnoToString(errno));
+    abort();
+  }
+  group->ringTail = 0;
+
+  /* Buffers are taken from the pool by the next blockingPoll. */
+  group->freeBufferIndexArray =
+    checkedCalloc(group->numRingEntries, sizeof(uint16_t));
+  for (i = 0; i < group->numRingEntries; ++i)
+  {
+    group->freeBufferIndexArray[i] = group->numRingEntries - 1 - i;
+  }
+  group->numFreeBufferIndexes = group->numRingEntries;
+
+  ++(ioUringPollState->numRecvBufferGroups);
+}
+
+void startAccept(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct io_uring_sqe* sqe;
+
+  assert(pollState != NULL);
+
+  if (!ioUringAvailable)
+  {
+    epollStartAccept(pollState, fd, data);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  sqe = getSQE(ioUringPollState);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = completionIOUserData(data, COMPLETED_ACCEPT);
+  ++(ioUringPollState->numCompletionIOInFlight);
+}
+
+void startRecv(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  size_t bufferGroup,
+  size_t maxBytes)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct io_uring_sqe* sqe;
+
+  assert(pollState != NULL);
+  assert(maxBytes > 0);
+
+  if (!ioUringAvailable)
+  {
+    epollStartRecv(pollState, fd, data, bufferGroup, maxBytes);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  assert(bufferGroup < ioUringPollState->numRecvBufferGroups);
+
+  /* At most the size of a buffer of the group is received. */
+  if (maxBytes > ioUringPollState->recvBufferGroupArray[bufferGroup].bufferSize)
+  {
+    maxBytes = ioUringPollState->recvBufferGroupArray[bufferGroup].bufferSize;
+  }
+
+  sqe = getSQE(ioUringPollState);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->len = maxBytes;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bufferGroup;
+  sqe->user_data = completionIOUserData(data, COMPLETED_RECV);
+  ++(ioUringPollState->numCompletionIOInFlight);
+}
+
+void startSend(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  const void* buffer,
+  size_t size)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct io_uring_sqe* sqe;
+
+  assert(pollState != NULL);
+  assert(size > 0);
+
+  if (!ioUringAvailable)
+  {
+    epollStartSend(pollState, fd, data, buffer, size);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  sqe = getSQE(ioUringPollState);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = ((size > UINT32_MAX) ? UINT32_MAX : size);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = completionIOUserData(data, COMPLETED_SEND);
+  ++(ioUringPollState->numCompletionIOInFlight);
+}
+
+void cancelCompletionIO(
+  struct PollState* pollState,
+  void* data,
+  enum CompletedIOType completedIOType)
+{
+  struct IOUringPollState* ioUringPollState;
+  struct io_uring_sqe* sqe;
+
+  assert(pollState != NULL);
+
+  if (!ioUringAvailable)
+  {
+    epollCancelCompletionIO(pollState, data, completedIOType);
+    return;
+  }
+
+  ioUringPollState = pollState->internalPollState;
+  sqe = getSQE(ioUringPollState);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = completionIOUserData(data, completedIOType);
+  sqe->user_data = IO_URING_IGNORED_USER_DATA;
+}
@@ -30,16 +30,19 @@ struct InternalPollState
 {
   int kqueueFD;
   size_t numFDs;
+  /* Filled by kevent, maxEventsPerPoll entries. */
   struct kevent* keventArray;
-  size_t keventArrayCapacity;
+  size_t maxEventsPerPoll;
 };
 
 void initializePollState(
-  struct PollState* pollState)
+  struct PollState* pollState,
+  size_t maxEventsPerPoll)
 {
   struct InternalPollState* internalPollState;
 
   assert(pollState != NULL);
+  assert(maxEventsPerPoll > 0);
 
   memset(pollState, 0, sizeof(struct PollState));
   internalPollState =
@@ -53,6 +56,9 @@ void initializePollState(
              errnoToString(errno));
     abort();
   }
+  internalPollState->maxEventsPerPoll = maxEventsPerPoll;
+  internalPollState->keventArray =
+    checkedCalloc(maxEventsPerPoll, sizeof(struct kevent));
   proxyLog("created kqueue (fd=%d)",
            internalPollState->kqueueFD);
 }
@@ -119,31 +125,24 @@ void addPollFDToPollState(
   }
   else
   {
-    bool changedCapacity = false;
     ++(internalPollState->numFDs);
-    while ((internalPollState->numFDs * 2) >
-           internalPollState->keventArrayCapacity)
-    {
-      changedCapacity = true;
-      if (internalPollState->keventArrayCapacity == 0)
-      {
-        internalPollState->keventArrayCapacity = 16;
-      }
-      else
-      {
-        internalPollState->keventArrayCapacity *= 2;
-      }
-    }
-    if (changedCapacity)
-    {
-      internalPollState->keventArray =
-        checkedRealloc(internalPollState->keventArray,
-                       internalPollState->keventArrayCapacity *
-                       sizeof(struct kevent));
-    }
   }
 }
 
+bool edgeTriggeredPollSupported()
+{
+  return false;
+}
+
+void addEdgeTriggeredPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  proxyLog("edge triggered poll is not supported");
+  abort();
+}
+
 void updatePollFDInPollState(
   struct PollState* pollState,
   int fd,
@@ -213,22 +212,26 @@ void removePollFDFromPollState(
 }
 
 const struct PollResult* blockingPoll(
-  struct PollState* pollState)
+  struct PollState* pollState,
+  int timeoutMillis)
 {
   struct InternalPollState* internalPollState;
+  struct timespec timeoutTimespec;
 
   assert(pollState != NULL);
 
   internalPollState = pollState->internalPollState;
   if (internalPollState->numFDs > 0)
   {
-    size_t i;
-    const int retVal = signalSafeKevent(
-                   internalPollState->kqueueFD,
-                   NULL, 0,
-                   internalPollState->keventArray,
-                   internalPollState->numFDs * 2,
-                   NULL);
+    int retVal;
+    timeoutTimespec.tv_sec = timeoutMillis / 1000;
+    timeoutTimespec.tv_nsec = (timeoutMillis % 1000) * 1000000L;
+    retVal = signalSafeKevent(
+               internalPollState->kqueueFD,
+               NULL, 0,
+               internalPollState->keventArray,
+               internalPollState->maxEventsPerPoll,
+               ((timeoutMillis < 0) ? NULL : &timeoutTimespec));
     if (retVal < 0)
     {
       proxyLog("kevent wait error errno %d: %s",
@@ -236,21 +239,63 @@ const struct PollResult* blockingPoll(
                errnoToString(errno));
       abort();
     }
-    setPollResultNumReadyFDs(
-      &(pollState->pollResult),
-      retVal);
-    for (i = 0; i < retVal; ++i)
-    {
-      struct ReadyFDInfo* readyFDInfo =
-        &(pollState->pollResult.readyFDInfoArray[i]);
-      const struct kevent* readyKEvent =
-        &(internalPollState->keventArray[i]);
-      readyFDInfo->data = (void*)readyKEvent->udata;
-      readyFDInfo->readyForRead = (readyKEvent->filter == EVFILT_READ);
-      readyFDInfo->readyForWrite = (readyKEvent->filter == EVFILT_WRITE);
-      readyFDInfo->readyForError = false;
-    }
+    pollState->pollResult.numEvents = retVal;
+    pollState->pollResult.keventArray = internalPollState->keventArray;
     return (&(pollState->pollResult));
   }
   return NULL;
 }
+
+bool completionIOSupported()
+{
+  return false;
+}
+
+void addRecvBufferGroup(
+  struct PollState* pollState,
+  struct BufferPool* bufferPool,
+  size_t bufferSize)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startAccept(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startRecv(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  size_t bufferGroup,
+  size_t maxBytes)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startSend(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  const void* buffer,
+  size_t size)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void cancelCompletionIO(
+  struct PollState* pollState,
+  void* data,
+  enum CompletedIOType completedIOType)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
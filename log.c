@@ -14,25 +14,85 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
+/* Asynchronous logging.
+
+   Every thread that logs gets its own single producer, single consumer
+   ring of fixed size log lines.  proxyLog formats the complete line
+   into the next free slot and publishes it without taking a lock.  A
+   dedicated writer thread drains all rings in batches and writes them
+   to stdout.  If a ring is full the line is dropped and counted, so
+   logging never blocks and memory use per thread is bounded.  An idle
+   writer sleeps reading a pipe, and the first line published after
+   that wakes it with a non-blocking write, so producers never take a
+   lock the writer holds while writing to stdout. */
+
 #include "log.h"
+#include "fdutil.h"
 #include "memutil.h"
 #include "timeutil.h"
+#include <errno.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+
+/* Lines longer than this are truncated. */
+#define LOG_LINE_SIZE (256)
+/* Must be a power of 2. */
+#define LOG_RING_NUM_LINES (1024)
+#define LOG_WRITE_BUFFER_SIZE (64 * 1024)
+#define LOG_THREAD_NAME_SIZE (32)
+
+struct LogLine
+{
+  size_t length;
+  char text[LOG_LINE_SIZE];
+};
+
+struct LogThreadState
+{
+  char threadName[LOG_THREAD_NAME_SIZE];
+  /* Written only by the writer thread, after the lines before it are
+     written to stdout. */
+  unsigned long ringHead;
+  /* Lines before copiedHead are in the writer's buffer.  Only used by
+     the writer thread. */
+  unsigned long copiedHead;
+  /* Written only by the owning thread. */
+  unsigned long ringTail;
+  struct LogThreadState* nextLogThreadState;
+  struct LogLine ring[LOG_RING_NUM_LINES];
+};
+
+int proxyLogLevel = PROXY_LOG_LEVEL_INFO;
 
-static bool logThreadNameKeyCreated = false;
+static pthread_once_t logInitOnce = PTHREAD_ONCE_INIT;
 
-static pthread_key_t logThreadNameKey;
+static pthread_key_t logThreadStateKey;
 
-static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Every LogThreadState ever created.  Pushed with compare and swap,
+   entries are never removed. */
+static struct LogThreadState* logThreadStateList = NULL;
 
-static void lockLogMutex()
+static unsigned long droppedLogLines = 0;
+
+static bool logWriterWaiting = false;
+
+/* Read end blocks the idle writer, write end is non-blocking. */
+static int logWakeupPipe[2] = { -1, -1 };
+
+/* Only taken by consumers of the rings: held by the writer except
+   while it waits for new lines, and by flushLogAtExit. */
+static pthread_mutex_t logWriterMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void lockLogWriterMutex()
 {
-  const int retVal = pthread_mutex_lock(&logMutex);
+  const int retVal = pthread_mutex_lock(&logWriterMutex);
   if (retVal != 0)
   {
     printf("pthread_mutex_lock error %d\n", retVal);
@@ -40,9 +100,9 @@ static void lockLogMutex()
   }
 }
 
-static void unlockLogMutex()
+static void unlockLogWriterMutex()
 {
-  const int retVal = pthread_mutex_unlock(&logMutex);
+  const int retVal = pthread_mutex_unlock(&logWriterMutex);
   if (retVal != 0)
   {
     printf("pthread_mutex_unlock error %d\n", retVal);
@@ -50,94 +110,409 @@ static void unlockLogMutex()
   }
 }
 
-static void freeLogThreadName(void* ptr)
+static void writeAll(const char* buffer, size_t length)
 {
-  free(ptr);
+  while (length > 0)
+  {
+    const ssize_t retVal = write(STDOUT_FILENO, buffer, length);
+    if (retVal <= 0)
+    {
+      /* Retry on EINTR, give up on anything else. */
+      if ((retVal < 0) && (errno == EINTR))
+      {
+        continue;
+      }
+      return;
+    }
+    buffer += retVal;
+    length -= retVal;
+  }
 }
 
-/* Must hold logMutex while calling. */
-static void initializeLogThreadNameKey()
+/* Blocks until a producer wakes the writer.  Takes all pending
+   wakeups at once, so a stale one costs at most one extra pass. */
+static void waitForLogWakeup()
 {
-  if (!logThreadNameKeyCreated)
+  char buffer[64];
+
+  while ((read(logWakeupPipe[0], buffer, sizeof(buffer)) < 0) &&
+         (errno == EINTR))
   {
-    const int retVal =
-      pthread_key_create(&logThreadNameKey, &freeLogThreadName);
-    if (retVal != 0)
+  }
+}
+
+static void wakeLogWriter()
+{
+  const char wakeup = 0;
+
+  /* A full pipe already holds a wakeup. */
+  if (write(logWakeupPipe[1], &wakeup, 1) < 0)
+  {
+    return;
+  }
+}
+
+/* Writes the lines copied to writeBuffer, then releases their slots
+   in the rings from firstLogThreadState to lastLogThreadState.  Slots
+   are only released once written, so handleAbortSignal never misses
+   a line the writer has copied but not written yet. */
+static void writeCopiedLogLines(
+  const char* writeBuffer,
+  size_t writeBufferLength,
+  struct LogThreadState* firstLogThreadState,
+  const struct LogThreadState* lastLogThreadState)
+{
+  struct LogThreadState* logThreadState;
+
+  writeAll(writeBuffer, writeBufferLength);
+  for (logThreadState = firstLogThreadState;
+       logThreadState;
+       logThreadState = logThreadState->nextLogThreadState)
+  {
+    __atomic_store_n(&(logThreadState->ringHead),
+                     logThreadState->copiedHead, __ATOMIC_RELEASE);
+    if (logThreadState == lastLogThreadState)
     {
-      printf("pthread_key_create error %d\n", retVal);
-      abort();
+      break;
     }
-    logThreadNameKeyCreated = true;
   }
 }
 
-/* Must hold logMutex while calling. */
-static char* getLogThreadName()
+/* Writes pending lines of every ring to stdout.
+   Must hold logWriterMutex while calling.
+   Returns the number of lines written. */
+static size_t drainLogRings(char* writeBuffer)
 {
-  char* ptr;
+  struct LogThreadState* logThreadState;
+  /* First ring with lines copied to writeBuffer since the last
+     write. */
+  struct LogThreadState* unwrittenLogThreadState =
+    __atomic_load_n(&logThreadStateList, __ATOMIC_ACQUIRE);
+  struct LogThreadState* lastLogThreadState = NULL;
+  size_t writeBufferLength = 0;
+  size_t numLines = 0;
 
-  initializeLogThreadNameKey();
+  for (logThreadState = unwrittenLogThreadState;
+       logThreadState;
+       logThreadState = logThreadState->nextLogThreadState)
+  {
+    unsigned long head = logThreadState->ringHead;
+    const unsigned long tail =
+      __atomic_load_n(&(logThreadState->ringTail), __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      const struct LogLine* logLine =
+        &(logThreadState->ring[head & (LOG_RING_NUM_LINES - 1)]);
+      if ((writeBufferLength + logLine->length) > LOG_WRITE_BUFFER_SIZE)
+      {
+        logThreadState->copiedHead = head;
+        writeCopiedLogLines(writeBuffer, writeBufferLength,
+                            unwrittenLogThreadState, logThreadState);
+        unwrittenLogThreadState = logThreadState;
+        writeBufferLength = 0;
+      }
+      memcpy(&(writeBuffer[writeBufferLength]), logLine->text,
+             logLine->length);
+      writeBufferLength += logLine->length;
+      ++numLines;
+    }
+    logThreadState->copiedHead = head;
+    lastLogThreadState = logThreadState;
+  }
 
-  ptr = pthread_getspecific(logThreadNameKey);
-  if (ptr)
+  if (writeBufferLength > 0)
   {
-    return ptr;
+    writeCopiedLogLines(writeBuffer, writeBufferLength,
+                        unwrittenLogThreadState, lastLogThreadState);
   }
-  else
+  return numLines;
+}
+
+/* Writes "<time> [<threadName>] " to buffer, which must be
+   at least LOG_LINE_SIZE bytes. */
+static size_t formatLogLinePrefix(
+  char* buffer,
+  const char* threadName)
+{
+  size_t length = formatTimeString(buffer);
+  const size_t threadNameLength = strlen(threadName);
+
+  /* threadName is at most LOG_THREAD_NAME_SIZE - 1 characters
+     and the time string at most TIME_STRING_BUFFER_SIZE - 1. */
+  buffer[length++] = ' ';
+  buffer[length++] = '[';
+  memcpy(&(buffer[length]), threadName, threadNameLength);
+  length += threadNameLength;
+  buffer[length++] = ']';
+  buffer[length++] = ' ';
+  return length;
+}
+
+static void writeDroppedLogLinesMessage(unsigned long numDropped)
+{
+  char buffer[LOG_LINE_SIZE];
+  size_t length = formatLogLinePrefix(buffer, "log");
+  const int retVal =
+    snprintf(&(buffer[length]), LOG_LINE_SIZE - length,
+             "dropped %lu log lines\n", numDropped);
+  if (retVal > 0)
+  {
+    length += retVal;
+  }
+  if (length > LOG_LINE_SIZE - 1)
   {
-    return "Unknown";
+    length = LOG_LINE_SIZE - 1;
   }
+  writeAll(buffer, length);
 }
 
-void proxyLogSetThreadName(const char* threadName)
+static void* runLogWriterThread(void* param)
+{
+  char* writeBuffer = checkedMalloc(LOG_WRITE_BUFFER_SIZE);
+  unsigned long reportedDroppedLogLines = 0;
+
+  lockLogWriterMutex();
+
+  for (;;)
+  {
+    unsigned long currentDroppedLogLines;
+
+    if (drainLogRings(writeBuffer) == 0)
+    {
+      /* Announce that the writer is about to wait, then check once more
+         for lines published before the announcement was visible.
+         A producer that sees logWriterWaiting writes a wakeup to the
+         pipe, which stays there until the writer reads it. */
+      __atomic_store_n(&logWriterWaiting, true, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (drainLogRings(writeBuffer) == 0)
+      {
+        unlockLogWriterMutex();
+        waitForLogWakeup();
+        lockLogWriterMutex();
+      }
+      __atomic_store_n(&logWriterWaiting, false, __ATOMIC_SEQ_CST);
+    }
+
+    currentDroppedLogLines =
+      __atomic_load_n(&droppedLogLines, __ATOMIC_RELAXED);
+    if (currentDroppedLogLines != reportedDroppedLogLines)
+    {
+      writeDroppedLogLinesMessage(
+        currentDroppedLogLines - reportedDroppedLogLines);
+      reportedDroppedLogLines = currentDroppedLogLines;
+    }
+  }
+
+  return NULL;
+}
+
+/* Best effort write of all pending lines.  Used when the process is
+   about to die, so lines logged just before abort or exit are kept.
+   Starts from the published ringHead of each ring, so no line is
+   lost, but lines the writer thread is writing at the same moment
+   may be written twice. */
+static void writePendingLogLines()
+{
+  const struct LogThreadState* logThreadState;
+
+  for (logThreadState = __atomic_load_n(&logThreadStateList, __ATOMIC_ACQUIRE);
+       logThreadState;
+       logThreadState = logThreadState->nextLogThreadState)
+  {
+    unsigned long head =
+      __atomic_load_n(&(logThreadState->ringHead), __ATOMIC_ACQUIRE);
+    const unsigned long tail =
+      __atomic_load_n(&(logThreadState->ringTail), __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      const struct LogLine* logLine =
+        &(logThreadState->ring[head & (LOG_RING_NUM_LINES - 1)]);
+      writeAll(logLine->text, logLine->length);
+    }
+  }
+}
+
+/* Only uses write(2), so it is safe in a signal handler. */
+static void handleAbortSignal(int signalNumber)
+{
+  (void)signalNumber;
+  writePendingLogLines();
+}
+
+static void flushLogAtExit()
+{
+  static char writeBuffer[LOG_WRITE_BUFFER_SIZE];
+
+  lockLogWriterMutex();
+  drainLogRings(writeBuffer);
+  unlockLogWriterMutex();
+}
+
+static void initializeLog()
 {
   int retVal;
-  void* oldDataPtr;
-  char* threadNameCopy;
+  pthread_t logWriterThread;
+  struct sigaction sa;
 
-  lockLogMutex();
+  retVal = pthread_key_create(&logThreadStateKey, NULL);
+  if (retVal != 0)
+  {
+    printf("pthread_key_create error %d\n", retVal);
+    abort();
+  }
 
-  initializeLogThreadNameKey();
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &handleAbortSignal;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGABRT, &sa, NULL) < 0)
+  {
+    printf("sigaction error\n");
+    abort();
+  }
 
-  unlockLogMutex();
+  if ((pipe(logWakeupPipe) < 0) ||
+      (setFDNonBlocking(logWakeupPipe[1]) < 0))
+  {
+    printf("error creating log wakeup pipe\n");
+    abort();
+  }
 
-  oldDataPtr = pthread_getspecific(logThreadNameKey);
-  if (oldDataPtr)
+  if (atexit(&flushLogAtExit) != 0)
   {
-    freeLogThreadName(oldDataPtr);
-    oldDataPtr = NULL;
+    printf("atexit error\n");
+    abort();
   }
 
-  threadNameCopy = strdup(threadName);
-  if (!threadNameCopy)
+  retVal = pthread_create(&logWriterThread, NULL, &runLogWriterThread, NULL);
+  if (retVal != 0)
   {
-    printf("strdup failed\n");
+    printf("pthread_create error %d\n", retVal);
     abort();
   }
 
-  retVal = pthread_setspecific(logThreadNameKey, threadNameCopy);
+  retVal = pthread_detach(logWriterThread);
+  if (retVal != 0)
+  {
+    printf("pthread_detach error %d\n", retVal);
+    abort();
+  }
+}
+
+static void initializeLogOnce()
+{
+  const int retVal = pthread_once(&logInitOnce, &initializeLog);
+  if (retVal != 0)
+  {
+    printf("pthread_once error %d\n", retVal);
+    abort();
+  }
+}
+
+/* LogThreadStates are never freed because the writer thread may still
+   be reading them.  cproxy threads live as long as the process. */
+static struct LogThreadState* getLogThreadState()
+{
+  struct LogThreadState* logThreadState;
+  int retVal;
+
+  initializeLogOnce();
+
+  logThreadState = pthread_getspecific(logThreadStateKey);
+  if (logThreadState)
+  {
+    return logThreadState;
+  }
+
+  logThreadState = checkedCalloc(1, sizeof(struct LogThreadState));
+  strcpy(logThreadState->threadName, "Unknown");
+
+  logThreadState->nextLogThreadState =
+    __atomic_load_n(&logThreadStateList, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(
+           &logThreadStateList,
+           &(logThreadState->nextLogThreadState),
+           logThreadState,
+           false,
+           __ATOMIC_RELEASE,
+           __ATOMIC_RELAXED))
+  {
+  }
+
+  retVal = pthread_setspecific(logThreadStateKey, logThreadState);
   if (retVal != 0)
   {
     printf("pthread_setspecific error %d\n", retVal);
     abort();
   }
+
+  return logThreadState;
+}
+
+bool proxyLogSetLevel(const char* levelName)
+{
+  if (strcmp(levelName, "debug") == 0)
+  {
+    proxyLogLevel = PROXY_LOG_LEVEL_DEBUG;
+  }
+  else if (strcmp(levelName, "info") == 0)
+  {
+    proxyLogLevel = PROXY_LOG_LEVEL_INFO;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+void proxyLogSetThreadName(const char* threadName)
+{
+  struct LogThreadState* logThreadState = getLogThreadState();
+
+  snprintf(logThreadState->threadName, LOG_THREAD_NAME_SIZE, "%s",
+           threadName);
 }
 
 void proxyLog(const char* format, ...)
 {
   va_list args;
+  struct LogThreadState* logThreadState = getLogThreadState();
+  const unsigned long tail = logThreadState->ringTail;
+  struct LogLine* logLine;
+  size_t length;
+  int retVal;
 
-  va_start(args, format);
+  if ((tail - __atomic_load_n(&(logThreadState->ringHead), __ATOMIC_ACQUIRE)) >=
+      LOG_RING_NUM_LINES)
+  {
+    __atomic_add_fetch(&droppedLogLines, 1, __ATOMIC_RELAXED);
+    return;
+  }
 
-  lockLogMutex();
+  logLine = &(logThreadState->ring[tail & (LOG_RING_NUM_LINES - 1)]);
+  length = formatLogLinePrefix(logLine->text, logThreadState->threadName);
 
-  printTimeString();
-  printf(" [%s] ", getLogThreadName());
-  vprintf(format, args);
-  printf("\n");
-  fflush(stdout);
+  va_start(args, format);
+  retVal = vsnprintf(&(logLine->text[length]), LOG_LINE_SIZE - length,
+                     format, args);
+  va_end(args);
+  if (retVal > 0)
+  {
+    length += retVal;
+  }
+  if (length > (LOG_LINE_SIZE - 1))
+  {
+    length = LOG_LINE_SIZE - 1;
+  }
+  logLine->text[length] = '\n';
+  logLine->length = length + 1;
 
-  unlockLogMutex();
+  __atomic_store_n(&(logThreadState->ringTail), tail + 1, __ATOMIC_SEQ_CST);
 
-  va_end(args);
+  if (__atomic_load_n(&logWriterWaiting, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&logWriterWaiting, false, __ATOMIC_SEQ_CST))
+  {
+    wakeLogWriter();
+  }
 }
@@ -17,8 +17,47 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdbool.h>
+
+#define PROXY_LOG_LEVEL_DEBUG (0)
+#define PROXY_LOG_LEVEL_INFO (1)
+
+/* Lowest level compiled in.  Build with
+   -DPROXY_MIN_LOG_LEVEL=PROXY_LOG_LEVEL_INFO to remove debug logging
+   entirely. */
+#ifndef PROXY_MIN_LOG_LEVEL
+#define PROXY_MIN_LOG_LEVEL PROXY_LOG_LEVEL_DEBUG
+#endif
+
+/* Lowest level logged at runtime, PROXY_LOG_LEVEL_INFO by default.
+   Set before other threads are started. */
+extern int proxyLogLevel;
+
+/* Returns false if levelName is not a known level. */
+extern bool proxyLogSetLevel(const char* levelName);
+
 extern void proxyLogSetThreadName(const char* threadName);
 
+/* Logs unconditionally. */
 extern void proxyLog(const char* format, ...);
 
+/* Constant false for levels below PROXY_MIN_LOG_LEVEL, so code
+   guarded by it is removed at compile time. */
+#define proxyLogLevelEnabled(level)         \
+  (((level) >= PROXY_MIN_LOG_LEVEL) &&      \
+   ((level) >= proxyLogLevel))
+
+/* Arguments are not evaluated unless the level is enabled. */
+#define proxyLogAtLevel(level, ...)           \
+  do                                          \
+  {                                           \
+    if (proxyLogLevelEnabled(level))          \
+    {                                         \
+      proxyLog(__VA_ARGS__);                  \
+    }                                         \
+  } while (0)
+
+#define proxyLogDebug(...) \
+  proxyLogAtLevel(PROXY_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
 #endif
@@ -57,3 +57,18 @@ void* checkedRealloc(
   }
   return retVal;
 }
+
+void* checkedAlignedAlloc(
+  size_t alignment,
+  size_t size)
+{
+  void* retVal = NULL;
+  const int errorCode = posix_memalign(&retVal, alignment, size);
+  if (errorCode != 0)
+  {
+    printf("posix_memalign failed error %d alignment %ld size %ld\n",
+           errorCode, (long)alignment, (long)size);
+    abort();
+  }
+  return retVal;
+}
@@ -30,4 +30,10 @@ extern void* checkedRealloc(
   void* ptr,
   size_t size);
 
+/* alignment must be a power of 2 multiple of sizeof(void*).
+   Free the result with free(). */
+extern void* checkedAlignedAlloc(
+  size_t alignment,
+  size_t size);
+
 #endif
@@ -18,22 +18,39 @@
 #include "log.h"
 #include "memutil.h"
 #include "pollutil.h"
-#include "sortedtable.h"
 #include <assert.h>
 #include <poll.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#define NO_SLOT (-1)
+
+/* Registered fds are kept densely in pollfdArray, with the data of
+   each at the same slot of dataArray, and slotArray maps each fd to
+   its slot, so every operation is O(1).  Removing an fd leaves a hole
+   with fd -1 that poll ignores; holes are reused by adds and filled
+   by moving the last slot into them in blockingPoll, so slots do not
+   move while a poll result is being handled. */
 struct InternalPollState
 {
   size_t numFDs;
+  /* Used slots of pollfdArray and dataArray, including holes. */
+  size_t numSlots;
+  size_t slotArrayCapacity;
   struct pollfd* pollfdArray;
-  struct SortedTable fdDataTable;
+  void** dataArray;
+  /* Slot of each fd, NO_SLOT if it is not registered. */
+  int32_t* fdSlotArray;
+  size_t fdSlotArrayCapacity;
+  int32_t* holeArray;
+  size_t numHoles;
 };
 
 void initializePollState(
-  struct PollState* pollState)
+  struct PollState* pollState,
+  size_t maxEventsPerPoll)
 {
   struct InternalPollState* internalPollState;
 
@@ -43,10 +60,96 @@ void initializePollState(
   internalPollState =
     checkedCalloc(1, sizeof(struct InternalPollState));
   pollState->internalPollState = internalPollState;
-  initializeSortedTable(&(internalPollState->fdDataTable));
+  pollState->pollResult.pollfdArrayPointer =
+    &(internalPollState->pollfdArray);
+  pollState->pollResult.dataArrayPointer =
+    (void* const* const*)&(internalPollState->dataArray);
   proxyLog("created poll");
 }
 
+static short interestToPollEvents(
+  enum ReadEventInterest readEventInterest,
+  enum WriteEventInterest writeEventInterest)
+{
+  return
+    ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? POLLIN : 0) |
+    ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? POLLOUT : 0);
+}
+
+/* Returns the slot of fd, or NO_SLOT if fd is not registered. */
+static int32_t getFDSlot(
+  const struct InternalPollState* internalPollState,
+  int fd)
+{
+  if ((fd < 0) ||
+      (((size_t)fd) >= internalPollState->fdSlotArrayCapacity))
+  {
+    return NO_SLOT;
+  }
+  return internalPollState->fdSlotArray[fd];
+}
+
+static void setFDSlot(
+  struct InternalPollState* internalPollState,
+  int fd,
+  int32_t slot)
+{
+  assert(fd >= 0);
+
+  if (((size_t)fd) >= internalPollState->fdSlotArrayCapacity)
+  {
+    const size_t oldCapacity = internalPollState->fdSlotArrayCapacity;
+    size_t newCapacity = ((oldCapacity == 0) ? 16 : oldCapacity);
+    size_t i;
+    while (((size_t)fd) >= newCapacity)
+    {
+      newCapacity *= 2;
+    }
+    internalPollState->fdSlotArray =
+      checkedRealloc(internalPollState->fdSlotArray,
+                     newCapacity * sizeof(int32_t));
+    for (i = oldCapacity; i < newCapacity; ++i)
+    {
+      internalPollState->fdSlotArray[i] = NO_SLOT;
+    }
+    internalPollState->fdSlotArrayCapacity = newCapacity;
+  }
+  internalPollState->fdSlotArray[fd] = slot;
+}
+
+static int32_t allocateSlot(
+  struct InternalPollState* internalPollState)
+{
+  if (internalPollState->numHoles > 0)
+  {
+    --(internalPollState->numHoles);
+    return internalPollState->holeArray[internalPollState->numHoles];
+  }
+
+  if (internalPollState->numSlots >= internalPollState->slotArrayCapacity)
+  {
+    internalPollState->slotArrayCapacity =
+      ((internalPollState->slotArrayCapacity == 0) ?
+       16 :
+       (internalPollState->slotArrayCapacity * 2));
+    internalPollState->pollfdArray =
+      checkedRealloc(internalPollState->pollfdArray,
+                     internalPollState->slotArrayCapacity *
+                     sizeof(struct pollfd));
+    internalPollState->dataArray =
+      checkedRealloc(internalPollState->dataArray,
+                     internalPollState->slotArrayCapacity *
+                     sizeof(void*));
+    /* There are never more holes than slots. */
+    internalPollState->holeArray =
+      checkedRealloc(internalPollState->holeArray,
+                     internalPollState->slotArrayCapacity *
+                     sizeof(int32_t));
+  }
+  ++(internalPollState->numSlots);
+  return (internalPollState->numSlots - 1);
+}
+
 void addPollFDToPollState(
   struct PollState* pollState,
   int fd,
@@ -55,30 +158,43 @@ void addPollFDToPollState(
   enum WriteEventInterest writeEventInterest)
 {
   struct InternalPollState* internalPollState;
+  struct pollfd* newPollFD;
+  int32_t slot;
 
   assert(pollState != NULL);
 
   internalPollState = pollState->internalPollState;
-  if (sortedTableContainsKey(
-        &(internalPollState->fdDataTable),
-        fd))
+  if (getFDSlot(internalPollState, fd) != NO_SLOT)
   {
     proxyLog("attempt to add duplicate fd %d to PollState",
              fd);
     abort();
   }
 
+  slot = allocateSlot(internalPollState);
+  setFDSlot(internalPollState, fd, slot);
+  newPollFD = &(internalPollState->pollfdArray[slot]);
+  newPollFD->fd = fd;
+  newPollFD->events =
+    interestToPollEvents(readEventInterest, writeEventInterest);
+  /* Not reported by a poll result that is being handled. */
+  newPollFD->revents = 0;
+  internalPollState->dataArray[slot] = data;
   ++(internalPollState->numFDs);
-  addToSortedTable(
-    &(internalPollState->fdDataTable),
-    fd, data);
-  internalPollState->pollfdArray =
-    checkedRealloc(internalPollState->pollfdArray,
-                   internalPollState->numFDs * sizeof(struct pollfd));
-  internalPollState->pollfdArray[internalPollState->numFDs - 1].fd = fd;
-  internalPollState->pollfdArray[internalPollState->numFDs - 1].events =
-    ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? POLLIN : 0) |
-    ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? POLLOUT : 0);
+}
+
+bool edgeTriggeredPollSupported()
+{
+  return false;
+}
+
+void addEdgeTriggeredPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  proxyLog("edge triggered poll is not supported");
+  abort();
 }
 
 void updatePollFDInPollState(
@@ -89,34 +205,22 @@ void updatePollFDInPollState(
   enum WriteEventInterest writeEventInterest)
 {
   struct InternalPollState* internalPollState;
-  size_t i;
+  int32_t slot;
 
   assert(pollState != NULL);
 
   internalPollState = pollState->internalPollState;
-  if (!sortedTableContainsKey(
-         &(internalPollState->fdDataTable),
-         fd))
+  slot = getFDSlot(internalPollState, fd);
+  if (slot == NO_SLOT)
   {
     proxyLog("attempt to update unknown fd %d in PollState",
              fd);
     abort();
   }
 
-  replaceDataInSortedTable(
-    &(internalPollState->fdDataTable),
-    fd, data);
-
-  for (i = 0; i < internalPollState->numFDs; ++i)
-  {
-    if (internalPollState->pollfdArray[i].fd == fd)
-    {
-      internalPollState->pollfdArray[i].events =
-        ((readEventInterest == INTERESTED_IN_READ_EVENTS) ? POLLIN : 0) |
-        ((writeEventInterest == INTERESTED_IN_WRITE_EVENTS) ? POLLOUT : 0);
-      break;
-    }
-  }
+  internalPollState->pollfdArray[slot].events =
+    interestToPollEvents(readEventInterest, writeEventInterest);
+  internalPollState->dataArray[slot] = data;
 }
 
 void removePollFDFromPollState(
@@ -124,43 +228,63 @@ void removePollFDFromPollState(
   int fd)
 {
   struct InternalPollState* internalPollState;
-  struct pollfd* newPollfdArray;
-  size_t newPollfdArrayIndex;
-  size_t i;
+  int32_t slot;
 
   assert(pollState != NULL);
 
   internalPollState = pollState->internalPollState;
-  if (!sortedTableContainsKey(
-         &(internalPollState->fdDataTable),
-         fd))
+  slot = getFDSlot(internalPollState, fd);
+  if (slot == NO_SLOT)
   {
     proxyLog("attempt to remove unknown fd %d from PollState",
              fd);
     abort();
   }
 
-  newPollfdArray =
-    checkedMalloc((internalPollState->numFDs - 1) * sizeof(struct pollfd));
-  newPollfdArrayIndex = 0;
-  for (i = 0; i < internalPollState->numFDs; ++i)
+  /* Leave a hole that poll ignores and getReadyFDInfo skips. */
+  internalPollState->pollfdArray[slot].fd = -1;
+  internalPollState->pollfdArray[slot].events = 0;
+  internalPollState->pollfdArray[slot].revents = 0;
+  internalPollState->dataArray[slot] = NULL;
+  internalPollState->holeArray[internalPollState->numHoles] = slot;
+  ++(internalPollState->numHoles);
+  internalPollState->fdSlotArray[fd] = NO_SLOT;
+  --(internalPollState->numFDs);
+}
+
+/* Fill holes by moving the last used slot into each of them. */
+static void fillHoles(
+  struct InternalPollState* internalPollState)
+{
+  while (internalPollState->numHoles > 0)
   {
-    if (internalPollState->pollfdArray[i].fd != fd)
+    int32_t hole;
+    size_t lastSlot;
+
+    --(internalPollState->numHoles);
+    hole = internalPollState->holeArray[internalPollState->numHoles];
+
+    /* Drop holes at the end. */
+    while ((internalPollState->numSlots > 0) &&
+           (internalPollState->pollfdArray[
+              internalPollState->numSlots - 1].fd < 0))
     {
-      newPollfdArray[newPollfdArrayIndex].fd =
-        internalPollState->pollfdArray[i].fd;
-      newPollfdArray[newPollfdArrayIndex].events =
-        internalPollState->pollfdArray[i].events;
-      ++newPollfdArrayIndex;
+      --(internalPollState->numSlots);
+    }
+    if (((size_t)hole) >= internalPollState->numSlots)
+    {
+      continue;
     }
-  }
 
-  free(internalPollState->pollfdArray);
-  internalPollState->pollfdArray = newPollfdArray;
-  --(internalPollState->numFDs);
-  removeFromSortedTable(
-    &(internalPollState->fdDataTable),
-    fd);
+    lastSlot = internalPollState->numSlots - 1;
+    internalPollState->pollfdArray[hole] =
+      internalPollState->pollfdArray[lastSlot];
+    internalPollState->dataArray[hole] =
+      internalPollState->dataArray[lastSlot];
+    internalPollState->fdSlotArray[
+      internalPollState->pollfdArray[hole].fd] = hole;
+    --(internalPollState->numSlots);
+  }
 }
 
 static int signalSafePoll(
@@ -182,7 +306,8 @@ static int signalSafePoll(
 }
 
 const struct PollResult* blockingPoll(
-  struct PollState* pollState)
+  struct PollState* pollState,
+  int timeoutMillis)
 {
   struct InternalPollState* internalPollState;
 
@@ -191,13 +316,14 @@ const struct PollResult* blockingPoll(
   internalPollState = pollState->internalPollState;
   if (internalPollState->numFDs > 0)
   {
-    size_t i;
-    size_t readyFDIndex = 0;
-    const int retVal =
+    int retVal;
+
+    fillHoles(internalPollState);
+    retVal =
       signalSafePoll(
         internalPollState->pollfdArray,
-        internalPollState->numFDs,
-        -1);
+        internalPollState->numSlots,
+        timeoutMillis);
     if (retVal < 0)
     {
       proxyLog("poll error errno %d: %s",
@@ -205,31 +331,62 @@ const struct PollResult* blockingPoll(
                errnoToString(errno));
       abort();
     }
-    setPollResultNumReadyFDs(
-      &(pollState->pollResult),
-      retVal);
-    for (i = 0; i < internalPollState->numFDs; ++i)
-    {
-      const struct pollfd* readyPollFD =
-        &(internalPollState->pollfdArray[i]);
-      if (readyPollFD->revents)
-      {
-        struct ReadyFDInfo* readyFDInfo =
-          &(pollState->pollResult.readyFDInfoArray[readyFDIndex]);
-        readyFDInfo->data =
-          findDataInSortedTable(
-            &(internalPollState->fdDataTable),
-            readyPollFD->fd);
-        readyFDInfo->readyForRead =
-          ((readyPollFD->revents & POLLIN) != 0);
-        readyFDInfo->readyForWrite =
-          ((readyPollFD->revents & POLLOUT) != 0);
-        readyFDInfo->readyForError =
-          ((readyPollFD->revents & (POLLERR | POLLHUP | POLLNVAL)) != 0);
-        ++readyFDIndex;
-      }
-    }
+    pollState->pollResult.numEvents = internalPollState->numSlots;
     return (&(pollState->pollResult));
   }
   return NULL;
 }
+
+bool completionIOSupported()
+{
+  return false;
+}
+
+void addRecvBufferGroup(
+  struct PollState* pollState,
+  struct BufferPool* bufferPool,
+  size_t bufferSize)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startAccept(
+  struct PollState* pollState,
+  int fd,
+  void* data)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startRecv(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  size_t bufferGroup,
+  size_t maxBytes)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void startSend(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  const void* buffer,
+  size_t size)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
+
+void cancelCompletionIO(
+  struct PollState* pollState,
+  void* data,
+  enum CompletedIOType completedIOType)
+{
+  proxyLog("completion io is not supported");
+  abort();
+}
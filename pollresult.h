@@ -19,6 +19,52 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+/* Poll implementation selected at compile time. */
+#if defined(PROXY_ENABLE_IO_URING) && defined(__linux__)
+#define PROXY_POLL_IO_URING
+#elif (!defined(PROXY_DISABLE_EPOLL)) && defined(__linux__)
+#define PROXY_POLL_EPOLL
+#elif (!defined(PROXY_DISABLE_KQUEUE)) && (defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || defined(__NetBSD__) || defined(__APPLE__))
+#define PROXY_POLL_KQUEUE
+#else
+#define PROXY_POLL_POLL
+#endif
+
+#if defined(PROXY_POLL_IO_URING)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/epoll.h>
+/* user_data of completions that do not report a ready fd. */
+#define IO_URING_IGNORED_USER_DATA (UINT64_MAX)
+/* user_data of socket operations started with startAccept, startRecv
+   or startSend: the top bit set, the CompletedIOType in the next 3
+   bits, and the data pointer in the low 56 bits. */
+#define IO_URING_COMPLETION_IO_FLAG (UINT64_C(1) << 63)
+#define IO_URING_COMPLETED_IO_TYPE_SHIFT (60)
+#define IO_URING_COMPLETED_IO_TYPE_MASK (UINT64_C(0x7))
+#define IO_URING_COMPLETION_IO_DATA_MASK ((UINT64_C(1) << 56) - 1)
+/* Buffer ids of receive buffers are global to a PollState: the
+   group in the high bits and the index in the group in the low
+   bits. */
+#define IO_URING_RECV_BUFFER_ID_GROUP_SHIFT (8)
+#elif defined(PROXY_POLL_EPOLL)
+#include <sys/epoll.h>
+#elif defined(PROXY_POLL_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#else
+#include <poll.h>
+#endif
+
+enum CompletedIOType
+{
+  NO_COMPLETED_IO,
+  COMPLETED_ACCEPT,
+  COMPLETED_RECV,
+  COMPLETED_SEND
+};
 
 struct ReadyFDInfo
 {
@@ -26,17 +72,156 @@ struct ReadyFDInfo
   bool readyForRead;
   bool readyForWrite;
   bool readyForError;
+  /* Operation started with startAccept, startRecv, or startSend that
+     completed, or NO_COMPLETED_IO if an fd is ready. */
+  enum CompletedIOType completedIOType;
+  /* Accepted fd or number of bytes transferred, or -errno. */
+  int completedIOResult;
+  /* For COMPLETED_ACCEPT, set if accepting goes on. */
+  bool completedIOMore;
+  /* For COMPLETED_RECV, the receive buffer the kernel picked and its
+     group, or NULL if it picked none.  The caller owns the buffer. */
+  void* completedIOBuffer;
+  size_t completedIOBufferGroup;
 };
 
+/* Events returned by one blockingPoll, left in the array the kernel
+   filled.  getReadyFDInfo decodes them in place, so there is no
+   copy and no per-result array.  Events stay valid until the next
+   blockingPoll on the same PollState. */
 struct PollResult
 {
-  size_t numReadyFDs;
-  struct ReadyFDInfo* readyFDInfoArray;
-  size_t arrayCapacity;
+  /* Some events may not report a ready fd and are skipped by
+     getReadyFDInfo. */
+  size_t numEvents;
+#if defined(PROXY_POLL_IO_URING)
+  /* Completions still in the completion ring, NULL when io_uring is
+     not available and epoll is used instead.  The io_uring
+     implementation replaces user_data of each one with the data of
+     its fd, or IO_URING_IGNORED_USER_DATA. */
+  const struct io_uring_cqe* cqeArray;
+  unsigned cqHead;
+  unsigned cqRingMask;
+  /* Receive buffer of each buffer id, NULL until a receive buffer
+     group is added. */
+  void* const* recvBufferArray;
+#endif
+#if defined(PROXY_POLL_IO_URING) || defined(PROXY_POLL_EPOLL)
+  const struct epoll_event* epollEventArray;
+#elif defined(PROXY_POLL_KQUEUE)
+  const struct kevent* keventArray;
+#else
+  /* Every registered fd, with the data of each at the same index.
+     Indexes stay the same until the next blockingPoll, and the
+     arrays are read through the poll state since adding an fd may
+     move them. */
+  struct pollfd* const* pollfdArrayPointer;
+  void* const* const* dataArrayPointer;
+#endif
 };
 
-extern void setPollResultNumReadyFDs(
-  struct PollResult* pollResult,
-  size_t numReadyFDs);
+/* Decode event i of pollResult.  Returns false if the event does
+   not report a ready fd. */
+static inline bool getReadyFDInfo(
+  const struct PollResult* pollResult,
+  size_t i,
+  struct ReadyFDInfo* readyFDInfo)
+{
+#if defined(PROXY_POLL_IO_URING)
+  if (pollResult->cqeArray)
+  {
+    const struct io_uring_cqe* cqe =
+      &(pollResult->cqeArray[(pollResult->cqHead + i) &
+                             pollResult->cqRingMask]);
+    if (cqe->user_data == IO_URING_IGNORED_USER_DATA)
+    {
+      return false;
+    }
+    readyFDInfo->completedIOType = NO_COMPLETED_IO;
+    if (cqe->user_data & IO_URING_COMPLETION_IO_FLAG)
+    {
+      readyFDInfo->data =
+        (void*)(uintptr_t)(cqe->user_data & IO_URING_COMPLETION_IO_DATA_MASK);
+      readyFDInfo->readyForRead = false;
+      readyFDInfo->readyForWrite = false;
+      readyFDInfo->readyForError = false;
+      readyFDInfo->completedIOType =
+        (enum CompletedIOType)((cqe->user_data >>
+                                IO_URING_COMPLETED_IO_TYPE_SHIFT) &
+                               IO_URING_COMPLETED_IO_TYPE_MASK);
+      readyFDInfo->completedIOResult = cqe->res;
+      readyFDInfo->completedIOMore = ((cqe->flags & IORING_CQE_F_MORE) != 0);
+      readyFDInfo->completedIOBuffer = NULL;
+      readyFDInfo->completedIOBufferGroup = 0;
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+      {
+        const unsigned bufferID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        readyFDInfo->completedIOBuffer =
+          pollResult->recvBufferArray[bufferID];
+        readyFDInfo->completedIOBufferGroup =
+          bufferID >> IO_URING_RECV_BUFFER_ID_GROUP_SHIFT;
+      }
+      return true;
+    }
+    readyFDInfo->data = (void*)(uintptr_t)(cqe->user_data);
+    if (cqe->res < 0)
+    {
+      readyFDInfo->readyForRead = false;
+      readyFDInfo->readyForWrite = false;
+      readyFDInfo->readyForError = true;
+    }
+    else
+    {
+      readyFDInfo->readyForRead = ((cqe->res & POLLIN) != 0);
+      readyFDInfo->readyForWrite = ((cqe->res & POLLOUT) != 0);
+      readyFDInfo->readyForError = ((cqe->res & (POLLERR | POLLHUP)) != 0);
+    }
+    return true;
+  }
+#endif
+#if defined(PROXY_POLL_IO_URING) || defined(PROXY_POLL_EPOLL)
+  {
+    const struct epoll_event* readyEpollEvent =
+      &(pollResult->epollEventArray[i]);
+    readyFDInfo->data = readyEpollEvent->data.ptr;
+    readyFDInfo->completedIOType = NO_COMPLETED_IO;
+    readyFDInfo->readyForRead =
+      ((readyEpollEvent->events & EPOLLIN) != 0);
+    readyFDInfo->readyForWrite =
+      ((readyEpollEvent->events & EPOLLOUT) != 0);
+    readyFDInfo->readyForError =
+      ((readyEpollEvent->events & (EPOLLERR | EPOLLHUP)) != 0);
+    return true;
+  }
+#elif defined(PROXY_POLL_KQUEUE)
+  {
+    const struct kevent* readyKEvent = &(pollResult->keventArray[i]);
+    readyFDInfo->data = (void*)readyKEvent->udata;
+    readyFDInfo->completedIOType = NO_COMPLETED_IO;
+    readyFDInfo->readyForRead = (readyKEvent->filter == EVFILT_READ);
+    readyFDInfo->readyForWrite = (readyKEvent->filter == EVFILT_WRITE);
+    readyFDInfo->readyForError = false;
+    return true;
+  }
+#else
+  {
+    const struct pollfd* readyPollFD =
+      &((*(pollResult->pollfdArrayPointer))[i]);
+    if (!(readyPollFD->revents))
+    {
+      return false;
+    }
+    readyFDInfo->data = (*(pollResult->dataArrayPointer))[i];
+    readyFDInfo->completedIOType = NO_COMPLETED_IO;
+    readyFDInfo->readyForRead =
+      ((readyPollFD->revents & POLLIN) != 0);
+    readyFDInfo->readyForWrite =
+      ((readyPollFD->revents & POLLOUT) != 0);
+    readyFDInfo->readyForError =
+      ((readyPollFD->revents & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+    return true;
+  }
+#endif
+}
 
 #endif
@@ -14,9 +14,13 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#if (!defined(PROXY_DISABLE_EPOLL)) && defined(__linux__)
+#include "pollresult.h"
+
+#if defined(PROXY_POLL_IO_URING)
+#include "io_uring_pollutil.c"
+#elif defined(PROXY_POLL_EPOLL)
 #include "epoll_pollutil.c"
-#elif (!defined(PROXY_DISABLE_KQUEUE)) && (defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || defined(__NetBSD__) || defined(__APPLE__))
+#elif defined(PROXY_POLL_KQUEUE)
 #include "kqueue_pollutil.c"
 #else
 #include "poll_pollutil.c"
@@ -18,6 +18,9 @@
 #define POLLUTIL_H
 
 #include "pollresult.h"
+#include <stdbool.h>
+
+struct BufferPool;
 
 struct PollState
 {
@@ -25,8 +28,14 @@ struct PollState
   struct PollResult pollResult;
 };
 
+/* Each blockingPoll returns at most maxEventsPerPoll events, so the
+   memory used for events does not grow with the number of fds.
+   Events not returned by one blockingPoll are returned by the next
+   ones.  The poll implementation, which reports every fd, ignores
+   maxEventsPerPoll. */
 extern void initializePollState(
-  struct PollState* pollState);
+  struct PollState* pollState,
+  size_t maxEventsPerPoll);
 
 enum ReadEventInterest
 {
@@ -48,6 +57,20 @@ extern void addPollFDToPollState(
   enum ReadEventInterest readEventInterest,
   enum WriteEventInterest writeEventInterest);
 
+/* Return true if addEdgeTriggeredPollFDToPollState is
+   supported by the poll implementation. */
+extern bool edgeTriggeredPollSupported();
+
+/* Add fd to PollState with edge triggered notification of both
+   read and write readiness.  The caller must track readiness
+   itself; read or write readiness is only reported again after an
+   operation on fd has returned EAGAIN.  updatePollFDInPollState is
+   a no-op for fds added this way. */
+extern void addEdgeTriggeredPollFDToPollState(
+  struct PollState* pollState,
+  int fd,
+  void* data);
+
 /* Update fd that has been previously added to PollState. */
 extern void updatePollFDInPollState(
   struct PollState* pollState,
@@ -61,7 +84,64 @@ extern void removePollFDFromPollState(
   struct PollState* pollState,
   int fd);
 
+/* Wait for ready fds.  timeoutMillis < 0 waits forever,
+   timeoutMillis == 0 returns immediately.  Read the result with
+   getReadyFDInfo. */
 extern const struct PollResult* blockingPoll(
-  struct PollState* pollState);
+  struct PollState* pollState,
+  int timeoutMillis);
+
+/* Return true if the socket operations below are supported by the
+   poll implementation.  Each one completes asynchronously and its
+   completion is returned by blockingPoll with completedIOType set.
+   At most one operation of each type may be in flight for the same
+   data. */
+extern bool completionIOSupported();
+
+/* Add a group of receive buffers of bufferSize bytes for startRecv.
+   Groups are numbered from 0 in the order they are added.  Buffers
+   are taken from bufferPool only when the kernel runs short of them,
+   and the caller gives each received buffer back to bufferPool when
+   done with it. */
+extern void addRecvBufferGroup(
+  struct PollState* pollState,
+  struct BufferPool* bufferPool,
+  size_t bufferSize);
+
+/* Start accepting connections on non-blocking listening socket fd.
+   Each accepted fd is non-blocking and returned by a completion of
+   its own.  Accepting goes on while completedIOMore is set, and
+   must be started again after a completion without it. */
+extern void startAccept(
+  struct PollState* pollState,
+  int fd,
+  void* data);
+
+/* Start receiving at most maxBytes from fd into a buffer of
+   bufferGroup, picked by the kernel only when bytes arrive. */
+extern void startRecv(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  size_t bufferGroup,
+  size_t maxBytes);
+
+/* Start sending size bytes of buffer to fd.  buffer must stay valid
+   until the send completes. */
+extern void startSend(
+  struct PollState* pollState,
+  int fd,
+  void* data,
+  const void* buffer,
+  size_t size);
+
+/* Cancel the operation of completedIOType in flight for data.  Its
+   completion is still returned, with -ECANCELED unless it completed
+   first.  Must be called before fd is closed, since the operation
+   keeps the socket open. */
+extern void cancelCompletionIO(
+  struct PollState* pollState,
+  void* data,
+  enum CompletedIOType completedIOType);
 
 #endif
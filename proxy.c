@@ -14,6 +14,7 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "backendbalancer.h"
 #include "bufferpool.h"
 #include "errutil.h"
 #include "fdutil.h"
@@ -21,13 +22,20 @@
 #include "log.h"
 #include "memutil.h"
 #include "pollutil.h"
+#include "qsbr.h"
+#include "ringbuffer.h"
 #include "socketutil.h"
+#include "timerwheel.h"
+#include "timeutil.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,11 +43,68 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 
-#define DEFAULT_BUFFER_SIZE (16 * 1024)
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
 #define DEFAULT_NO_DELAY_SETTING (false)
+#define DEFAULT_SPLICE_RELAY_SETTING (false)
+#define DEFAULT_REUSE_PORT_SETTING (false)
+#define DEFAULT_EDGE_TRIGGERED_SETTING (false)
 #define DEFAULT_NUM_IO_THREADS (1)
 #define MAX_OPERATIONS_FOR_ONE_FD (100)
-#define INITIAL_CONNECTION_SOCKET_INFO_POOL_SIZE (16)
+/* Most ready fds handled per event loop iteration.  The rest are
+   returned by the next poll. */
+#define MAX_EVENTS_PER_POLL (256)
+#define DEFAULT_RETAINED_BUFFERS (16)
+#define DEFAULT_HUGE_PAGES_SETTING (BUFFER_POOL_NO_HUGE_PAGES)
+#define DEFAULT_PREWARM_SESSIONS (0)
+#define DEFAULT_BALANCE_MODE (BACKEND_BALANCE_ROUND_ROBIN)
+#define DEFAULT_WARM_SOCKETS (0)
+/* Connects tried for one session before it gives up, moving on to
+   the next address or backend after each failure. */
+#define MAX_CONNECT_ATTEMPTS (4)
+/* Connection Attempt Delay of RFC 8305: how long a remote connect
+   runs before a second connect to the backend's next address races
+   it. */
+#define HAPPY_EYEBALLS_DELAY_MILLIS (250)
+#define NO_TARGET_INDEX (UINT32_MAX)
+/* Timeouts are in seconds, 0 disables a timeout. */
+#define DEFAULT_CONNECT_TIMEOUT_SECONDS (10)
+#define DEFAULT_IDLE_TIMEOUT_SECONDS (0)
+#define DEFAULT_DRAIN_TIMEOUT_SECONDS (30)
+/* Seconds between resolving -r addresses again, 0 resolves them
+   only at startup. */
+#define DEFAULT_RESOLVE_INTERVAL_SECONDS (30)
+#define MAX_RESOLVE_INTERVAL_SECONDS (86400)
+/* Activity times are kept in 32 bits of milliseconds, so timeouts
+   must stay well below 2^32 milliseconds. */
+#define MAX_TIMEOUT_SECONDS (1000 * 1000)
+#define SESSION_TIMER_TICK_MILLIS (100)
+/* Warm sockets idle this long are closed before the backend is
+   likely to close them itself. */
+#define WARM_SOCKET_MAX_IDLE_MILLIS (30 * 1000)
+/* Interval of warm socket pool checks, and the wait after a warm
+   connect fails before connecting to that backend again. */
+#define WARM_SOCKET_CHECK_INTERVAL_MILLIS (1000)
+/* Free pooled buffers that stayed unused this long are released. */
+#define BUFFER_POOL_DECAY_WINDOW_MILLIS (10 * 1000)
+/* Relay buffers come in power of 2 size classes from
+   MIN_RELAY_BUFFER_SIZE up to the -b buffer size. */
+#define MIN_RELAY_BUFFER_SIZE (4 * 1024)
+#define MAX_RELAY_BUFFER_SIZE_CLASSES (24)
+/* A direction's relay buffer grows one size class after this many
+   reads in a row of at least half of it filled it, and shrinks one
+   size class when it is released after this many reads in a row of
+   at most a quarter of it. */
+#define GROW_RELAY_BUFFER_AFTER_FULL_READS (2)
+#define SHRINK_RELAY_BUFFER_AFTER_SMALL_READS (32)
+/* Bits of completionIOFlags in ConnectionSocketInfo. */
+#define RECV_IN_FLIGHT (1 << 0)
+#define SEND_IN_FLIGHT (1 << 1)
+/* Magazines in each buffer depot shared by I/O threads. */
+#define BUFFER_DEPOT_MAX_MAGAZINES (4096)
+#define CACHE_LINE_SIZE (64)
+/* Accepted fds handed to an I/O thread with one pipe write.
+   Writes of at most PIPE_BUF bytes are atomic. */
+#define MAX_ACCEPTED_FD_BATCH_SIZE (PIPE_BUF / sizeof(struct AcceptedFD))
 
 static void printUsageAndExit()
 {
@@ -47,13 +112,49 @@ static void printUsageAndExit()
          "  cproxy -l <local addr>:<local port>\n"
          "         [-l <local addr>:<local port>...]\n"
          "         -r <remote addr>:<remote port>\n"
-         "         [-b <buf size>] [-n] [-t <num io threads>]\n"
+         "         [-r <remote addr>:<remote port>...]\n"
+         "         [-a <balance>] [-b <buf size>] [-c <connect timeout>]\n"
+         "         [-d <drain timeout>] [-e] [-f <resolve interval>]\n"
+         "         [-i <idle timeout>] [-k <num buffers>] [-m <huge pages>]\n"
+         "         [-n] [-p] [-s] [-t <num io threads>] [-u <num sockets>]\n"
+         "         [-v <log level>] [-w <num sessions>]\n"
          "Arguments:\n"
          "  -l <local addr>:<local port>: specify listen address and port\n"
-         "  -r <remote addr>:<remote port>: specify remote address and port\n"
-         "  -b <buf size>: specify session buffer size in bytes\n"
+         "  -r <remote addr>:<remote port>: specify remote address and port,\n"
+         "                                  repeat for more backends\n"
+         "  -a <balance>: choose the backend of each session by rr (round\n"
+         "                robin), least (fewest open connections) or p2c\n"
+         "                (better of 2 random backends by connect latency\n"
+         "                and open connections) (default rr)\n"
+         "  -b <buf size>: specify maximum session buffer size in bytes\n"
+         "                 (default 65536)\n"
+         "  -c <connect timeout>: specify seconds to wait for each remote\n"
+         "                        connect attempt, 0 for no timeout\n"
+         "                        (default 10)\n"
+         "  -d <drain timeout>: specify seconds to wait for write progress\n"
+         "                      after one side disconnects, 0 for no timeout\n"
+         "                      (default 30)\n"
+         "  -e: use edge triggered poll for session sockets (epoll only)\n"
+         "  -f <resolve interval>: specify seconds between resolving remote\n"
+         "                         addresses again, 0 to resolve only at\n"
+         "                         startup (default 30)\n"
+         "  -i <idle timeout>: specify seconds a session may go without\n"
+         "                     reading or writing, 0 for no timeout\n"
+         "                     (default 0)\n"
+         "  -k <num buffers>: specify number of idle buffers each I/O thread\n"
+         "                    keeps after a traffic spike (default 16)\n"
+         "  -m <huge pages>: back buffer pools with huge pages, none,\n"
+         "                   transparent or explicit (Linux only, default none)\n"
          "  -n: enable TCP no delay\n"
-         "  -t: <num io threads>: specify number of I/O threads\n");
+         "  -p: accept in each I/O thread on its own SO_REUSEPORT listen socket\n"
+         "  -s: relay with splice() through per-session pipes (Linux only)\n"
+         "  -t: <num io threads>: specify number of I/O threads\n"
+         "  -u <num sockets>: keep this many connected sockets to each backend\n"
+         "                    ready for new sessions in each I/O thread\n"
+         "                    (default 0)\n"
+         "  -v <log level>: specify log level, debug or info (default info)\n"
+         "  -w <num sessions>: prefault buffers for this many sessions in each\n"
+         "                     I/O thread at startup (default 0)\n");
   exit(1);
 }
 
@@ -69,6 +170,123 @@ static int parseBufferSize(
   return bufferSize;
 }
 
+static int parseRetainedBuffers(
+  const char* optarg)
+{
+  const int retainedBuffers = atoi(optarg);
+  if (retainedBuffers < 0)
+  {
+    proxyLog("invalid retained buffers %s", optarg);
+    exit(1);
+  }
+  return retainedBuffers;
+}
+
+static enum BufferPoolHugePages parseHugePages(
+  const char* optarg)
+{
+  enum BufferPoolHugePages hugePages;
+
+  if (strcmp(optarg, "none") == 0)
+  {
+    hugePages = BUFFER_POOL_NO_HUGE_PAGES;
+  }
+  else if (strcmp(optarg, "transparent") == 0)
+  {
+    hugePages = BUFFER_POOL_TRANSPARENT_HUGE_PAGES;
+  }
+  else if (strcmp(optarg, "explicit") == 0)
+  {
+    hugePages = BUFFER_POOL_EXPLICIT_HUGE_PAGES;
+  }
+  else
+  {
+    proxyLog("invalid huge pages setting %s", optarg);
+    printUsageAndExit();
+  }
+
+  if (!bufferPoolHugePagesSupported(hugePages))
+  {
+    proxyLog("%s huge pages are not supported on this platform", optarg);
+    exit(1);
+  }
+  return hugePages;
+}
+
+static int parsePrewarmSessions(
+  const char* optarg)
+{
+  const int prewarmSessions = atoi(optarg);
+  if (prewarmSessions < 0)
+  {
+    proxyLog("invalid prewarm sessions %s", optarg);
+    exit(1);
+  }
+  return prewarmSessions;
+}
+
+static enum BackendBalanceMode parseBalanceMode(
+  const char* optarg)
+{
+  enum BackendBalanceMode balanceMode;
+
+  if (strcmp(optarg, "rr") == 0)
+  {
+    balanceMode = BACKEND_BALANCE_ROUND_ROBIN;
+  }
+  else if (strcmp(optarg, "least") == 0)
+  {
+    balanceMode = BACKEND_BALANCE_LEAST_OUTSTANDING;
+  }
+  else if (strcmp(optarg, "p2c") == 0)
+  {
+    balanceMode = BACKEND_BALANCE_P2C_EWMA;
+  }
+  else
+  {
+    proxyLog("invalid balance mode %s", optarg);
+    printUsageAndExit();
+  }
+  return balanceMode;
+}
+
+static int64_t parseTimeoutMillis(
+  const char* optarg)
+{
+  const int timeoutSeconds = atoi(optarg);
+  if ((timeoutSeconds < 0) || (timeoutSeconds > MAX_TIMEOUT_SECONDS))
+  {
+    proxyLog("invalid timeout %s", optarg);
+    exit(1);
+  }
+  return (((int64_t)timeoutSeconds) * 1000);
+}
+
+static int64_t parseResolveIntervalMillis(
+  const char* optarg)
+{
+  const int resolveIntervalSeconds = atoi(optarg);
+  if ((resolveIntervalSeconds < 0) ||
+      (resolveIntervalSeconds > MAX_RESOLVE_INTERVAL_SECONDS))
+  {
+    proxyLog("invalid resolve interval %s", optarg);
+    exit(1);
+  }
+  return (((int64_t)resolveIntervalSeconds) * 1000);
+}
+
+static int parseWarmSockets(
+  const char* optarg)
+{
+  const int warmSockets = atoi(optarg);
+  if (warmSockets < 0)
+  {
+    proxyLog("invalid warm sockets %s", optarg);
+    exit(1);
+  }
+  return warmSockets;
+}
+
 static int parseNumIOThreads(
   const char* optarg)
 {
@@ -81,11 +299,13 @@ static int parseNumIOThreads(
   return numIOThreads;
 }
 
-static struct addrinfo* parseAddrPort(
-  const char* optarg)
+/* Resolves an address:port argument into *addressInfo.  Returns the
+   getaddrinfo error, 0 on success. */
+static int resolveAddrPort(
+  const char* optarg,
+  struct addrinfo** addressInfo)
 {
   struct addrinfo hints;
-  struct addrinfo* addressInfo = NULL;
   char addressString[NI_MAXHOST];
   char portString[NI_MAXSERV];
   const size_t optargLen = strlen(optarg);
@@ -133,9 +353,22 @@ static struct addrinfo* parseAddrPort(
   hints.ai_protocol = IPPROTO_TCP;
   hints.ai_flags = AI_ADDRCONFIG;
 
-  if (((retVal = getaddrinfo(addressString, portString, 
-                             &hints, &addressInfo)) != 0) ||
-      (addressInfo == NULL))
+  *addressInfo = NULL;
+  retVal = getaddrinfo(addressString, portString, &hints, addressInfo);
+  if ((retVal == 0) && ((*addressInfo) == NULL))
+  {
+    retVal = EAI_NONAME;
+  }
+  return retVal;
+}
+
+static struct addrinfo* parseAddrPort(
+  const char* optarg)
+{
+  struct addrinfo* addressInfo = NULL;
+  const int retVal = resolveAddrPort(optarg, &addressInfo);
+
+  if (retVal != 0)
   {
     proxyLog("error resolving address %s %s",
              optarg, gai_strerror(retVal));
@@ -162,16 +395,188 @@ static struct addrinfo* parseRemoteAddrPort(
   return addressInfo;
 }
 
+/* Addresses a -r address resolved to.  Sessions try them in order,
+   skipping addresses that failed recently.  An address set does not
+   change once created; when the -r address resolves differently the
+   resolver thread replaces the whole set. */
+struct BackendAddressSet
+{
+  /* 1 for the set resolved at startup, one more for each set that
+     replaces it. */
+  uint32_t generation;
+  struct addrinfo* addrInfo;
+  size_t numAddresses;
+  struct addrinfo** addressArray;
+};
+
+/* One -r address. */
+struct Backend
+{
+  /* Resolved again by the resolver thread. */
+  const char* addrPortArgument;
+  /* Moves to the BackendAddressTable when the proxy starts, and may
+     be freed after the resolver thread replaces it. */
+  struct BackendAddressSet* initialAddressSet;
+  struct AddrPortStrings addrPortStrings;
+};
+
 struct ProxySettings
 {
   size_t bufferSize;
   bool noDelay;
+  bool spliceRelay;
+  bool reusePort;
+  bool edgeTriggered;
+  /* Accept and relay with socket operations that complete through
+     the poll state instead of with readiness, if the poll
+     implementation supports it.  Splice and edge triggered relay
+     always use readiness. */
+  bool completionIO;
   size_t numIOThreads;
+  size_t retainedBuffers;
+  enum BufferPoolHugePages hugePages;
+  size_t prewarmSessions;
+  size_t warmSockets;
+  /* 0 disables a timeout. */
+  int64_t connectTimeoutMillis;
+  int64_t idleTimeoutMillis;
+  int64_t drainTimeoutMillis;
+  /* 0 resolves -r addresses only at startup. */
+  int64_t resolveIntervalMillis;
   struct LinkedList serverAddrInfoList;
-  struct addrinfo* remoteAddrInfo;
-  struct AddrPortStrings remoteAddrPortStrings;
+  size_t numBackends;
+  struct Backend* backendArray;
+  enum BackendBalanceMode balanceMode;
 };
 
+/* Reorders addressArray so address families alternate, starting
+   with the family getaddrinfo preferred, as RFC 8305 recommends.
+   The order within each family is kept. */
+static void interleaveAddressFamilies(
+  struct addrinfo** addressArray,
+  size_t numAddresses)
+{
+  struct addrinfo** originalArray =
+    checkedMalloc(numAddresses * sizeof(struct addrinfo*));
+  const int firstFamily = addressArray[0]->ai_family;
+  size_t nextFirstFamily = 0;
+  size_t nextOtherFamily = 0;
+  size_t i;
+
+  memcpy(originalArray, addressArray,
+         numAddresses * sizeof(struct addrinfo*));
+  for (i = 0; i < numAddresses; ++i)
+  {
+    while ((nextFirstFamily < numAddresses) &&
+           (originalArray[nextFirstFamily]->ai_family != firstFamily))
+    {
+      ++nextFirstFamily;
+    }
+    while ((nextOtherFamily < numAddresses) &&
+           (originalArray[nextOtherFamily]->ai_family == firstFamily))
+    {
+      ++nextOtherFamily;
+    }
+    if ((nextOtherFamily >= numAddresses) ||
+        ((nextFirstFamily < numAddresses) && ((i % 2) == 0)))
+    {
+      addressArray[i] = originalArray[nextFirstFamily];
+      ++nextFirstFamily;
+    }
+    else
+    {
+      addressArray[i] = originalArray[nextOtherFamily];
+      ++nextOtherFamily;
+    }
+  }
+  free(originalArray);
+}
+
+/* Takes ownership of addrInfo. */
+static struct BackendAddressSet* createBackendAddressSet(
+  struct addrinfo* addrInfo,
+  uint32_t generation)
+{
+  struct BackendAddressSet* addressSet =
+    checkedMalloc(sizeof(struct BackendAddressSet));
+  struct addrinfo* address;
+
+  addressSet->generation = generation;
+  addressSet->addrInfo = addrInfo;
+  addressSet->numAddresses = 0;
+  addressSet->addressArray = NULL;
+  for (address = addrInfo; address; address = address->ai_next)
+  {
+    addressSet->addressArray =
+      checkedRealloc(addressSet->addressArray,
+                     (addressSet->numAddresses + 1) *
+                     sizeof(struct addrinfo*));
+    addressSet->addressArray[addressSet->numAddresses] = address;
+    ++(addressSet->numAddresses);
+  }
+  interleaveAddressFamilies(
+    addressSet->addressArray,
+    addressSet->numAddresses);
+  return addressSet;
+}
+
+static void freeBackendAddressSet(
+  struct BackendAddressSet* addressSet)
+{
+  freeaddrinfo(addressSet->addrInfo);
+  free(addressSet->addressArray);
+  free(addressSet);
+}
+
+/* Returns true if addrInfo holds the same addresses as addressSet,
+   in any order. */
+static bool backendAddressSetMatches(
+  const struct BackendAddressSet* addressSet,
+  const struct addrinfo* addrInfo)
+{
+  size_t numAddresses = 0;
+
+  for (; addrInfo; addrInfo = addrInfo->ai_next)
+  {
+    bool found = false;
+    size_t i;
+    for (i = 0; (!found) && (i < addressSet->numAddresses); ++i)
+    {
+      const struct addrinfo* address = addressSet->addressArray[i];
+      found = ((address->ai_addrlen == addrInfo->ai_addrlen) &&
+               (memcmp(address->ai_addr, addrInfo->ai_addr,
+                       addrInfo->ai_addrlen) == 0));
+    }
+    if (!found)
+    {
+      return false;
+    }
+    ++numAddresses;
+  }
+  return (numAddresses == addressSet->numAddresses);
+}
+
+static void addBackend(
+  struct ProxySettings* proxySettings,
+  const char* optarg)
+{
+  struct Backend* backend;
+
+  proxySettings->backendArray =
+    checkedRealloc(proxySettings->backendArray,
+                   (proxySettings->numBackends + 1) *
+                   sizeof(struct Backend));
+  backend = &(proxySettings->backendArray[proxySettings->numBackends]);
+  backend->addrPortArgument = optarg;
+  backend->initialAddressSet =
+    createBackendAddressSet(
+      parseRemoteAddrPort(
+        optarg,
+        &(backend->addrPortStrings)),
+      1);
+  ++(proxySettings->numBackends);
+}
+
 static const struct ProxySettings* processArgs(
   int argc,
   char** argv)
@@ -183,44 +588,122 @@ static const struct ProxySettings* processArgs(
     checkedCalloc(1, sizeof(struct ProxySettings));
   proxySettings->bufferSize = DEFAULT_BUFFER_SIZE;
   proxySettings->noDelay = DEFAULT_NO_DELAY_SETTING;
+  proxySettings->spliceRelay = DEFAULT_SPLICE_RELAY_SETTING;
+  proxySettings->reusePort = DEFAULT_REUSE_PORT_SETTING;
+  proxySettings->edgeTriggered = DEFAULT_EDGE_TRIGGERED_SETTING;
   proxySettings->numIOThreads = DEFAULT_NUM_IO_THREADS;
+  proxySettings->retainedBuffers = DEFAULT_RETAINED_BUFFERS;
+  proxySettings->hugePages = DEFAULT_HUGE_PAGES_SETTING;
+  proxySettings->prewarmSessions = DEFAULT_PREWARM_SESSIONS;
+  proxySettings->balanceMode = DEFAULT_BALANCE_MODE;
+  proxySettings->warmSockets = DEFAULT_WARM_SOCKETS;
+  proxySettings->connectTimeoutMillis = DEFAULT_CONNECT_TIMEOUT_SECONDS * 1000;
+  proxySettings->idleTimeoutMillis = DEFAULT_IDLE_TIMEOUT_SECONDS * 1000;
+  proxySettings->drainTimeoutMillis = DEFAULT_DRAIN_TIMEOUT_SECONDS * 1000;
+  proxySettings->resolveIntervalMillis =
+    DEFAULT_RESOLVE_INTERVAL_SECONDS * 1000;
   initializeLinkedList(&(proxySettings->serverAddrInfoList));
 
   do
   {
-    retVal = getopt(argc, argv, "b:l:nr:t:");
+    retVal = getopt(argc, argv, "a:b:c:d:ef:i:k:l:m:npr:st:u:v:w:");
     switch (retVal)
     {
+    case 'a':
+      proxySettings->balanceMode = parseBalanceMode(optarg);
+      break;
+
     case 'b':
       proxySettings->bufferSize = parseBufferSize(optarg);
       break;
 
+    case 'c':
+      proxySettings->connectTimeoutMillis = parseTimeoutMillis(optarg);
+      break;
+
+    case 'd':
+      proxySettings->drainTimeoutMillis = parseTimeoutMillis(optarg);
+      break;
+
+    case 'e':
+      if (!edgeTriggeredPollSupported())
+      {
+        proxyLog("edge triggered poll is not supported on this platform");
+        exit(1);
+      }
+      proxySettings->edgeTriggered = true;
+      break;
+
+    case 'f':
+      proxySettings->resolveIntervalMillis =
+        parseResolveIntervalMillis(optarg);
+      break;
+
+    case 'i':
+      proxySettings->idleTimeoutMillis = parseTimeoutMillis(optarg);
+      break;
+
+    case 'k':
+      proxySettings->retainedBuffers = parseRetainedBuffers(optarg);
+      break;
+
     case 'l':
       addToLinkedList(&(proxySettings->serverAddrInfoList),
                       parseAddrPort(optarg));
       foundLocalAddress = true;
       break;
 
+    case 'm':
+      proxySettings->hugePages = parseHugePages(optarg);
+      break;
+
     case 'n':
       proxySettings->noDelay = true;
       break;
 
+    case 'p':
+#ifdef SO_REUSEPORT
+      proxySettings->reusePort = true;
+#else
+      proxyLog("SO_REUSEPORT is not supported on this platform");
+      exit(1);
+#endif
+      break;
+
     case 'r':
-      if (foundRemoteAddress)
-      {
-        printUsageAndExit();
-      }
-      proxySettings->remoteAddrInfo =
-        parseRemoteAddrPort(
-          optarg,
-          &(proxySettings->remoteAddrPortStrings));
+      addBackend(proxySettings, optarg);
       foundRemoteAddress = true;
       break;
 
+    case 's':
+#ifdef PROXY_SPLICE_SUPPORTED
+      proxySettings->spliceRelay = true;
+#else
+      proxyLog("splice relay is not supported on this platform");
+      exit(1);
+#endif
+      break;
+
     case 't':
       proxySettings->numIOThreads = parseNumIOThreads(optarg);
       break;
 
+    case 'u':
+      proxySettings->warmSockets = parseWarmSockets(optarg);
+      break;
+
+    case 'v':
+      if (!proxyLogSetLevel(optarg))
+      {
+        proxyLog("invalid log level %s", optarg);
+        printUsageAndExit();
+      }
+      break;
+
+    case 'w':
+      proxySettings->prewarmSessions = parsePrewarmSessions(optarg);
+      break;
+
     case '?':
       printUsageAndExit();
       break;
@@ -233,6 +716,11 @@ static const struct ProxySettings* processArgs(
     printUsageAndExit();
   }
 
+  proxySettings->completionIO =
+    ((!(proxySettings->spliceRelay)) &&
+     (!(proxySettings->edgeTriggered)) &&
+     completionIOSupported());
+
   return proxySettings;
 }
 
@@ -248,40 +736,350 @@ static void setupSignals()
   }
 }
 
-struct ServerSocketInfo
+/* First member of every struct used as poll data,
+   so the owner of an fd can be told from its data. */
+enum PollDataType
 {
-  int socket;
+  SERVER_SOCKET_POLL_DATA,
+  CLIENT_TO_PROXY_POLL_DATA,
+  PROXY_TO_REMOTE_POLL_DATA,
+  WARM_SOCKET_POLL_DATA,
+  RACE_SOCKET_POLL_DATA
 };
 
-enum ConnectionSocketInfoType
+struct ServerSocketInfo
 {
-  CLIENT_TO_PROXY,
-  PROXY_TO_REMOTE
+  enum PollDataType pollDataType;
+  int socket;
 };
 
+/* State of one side of a session used for every event, sized to
+   fit in one cache line.  State only needed to set up, log, or tear
+   down the connection is in ConnectionSocketColdInfo. */
 struct ConnectionSocketInfo
 {
+  /* CLIENT_TO_PROXY_POLL_DATA or PROXY_TO_REMOTE_POLL_DATA. */
+  enum PollDataType pollDataType;
   int socket;
-  enum ConnectionSocketInfoType type;
-  size_t waitingToWriteBufferOffset;
-  size_t waitingToWriteBufferSize;
-  size_t waitingToWriteBufferCapacity;
+  /* In splice relay mode bytes waiting to be written to socket
+     are held in a pipe, buffer is NULL and only size is used. */
+  struct RingBuffer waitingToWriteBuffer;
   bool disconnectWhenWriteFinishes;
   bool waitingForConnect;
   bool waitingForRead;
   bool waitingForWrite;
+  /* Last known readiness of socket, only used with edge triggered
+     poll.  Set by poll events, cleared when an operation returns
+     EAGAIN. */
+  bool socketReadable;
+  bool socketWritable;
+  /* Set while on the I/O thread's pending ready list. */
+  bool pendingReady;
+  /* Set when the connection has been closed but its session is
+     still allocated. */
+  bool destroyed;
+  /* Size class of the relay buffer for bytes waiting to be written
+     to socket, and the read counts that adapt it. */
+  uint8_t relayBufferSizeClass;
+  uint8_t numFullReads;
+  uint8_t numSmallReads;
+  /* With completion io, the RECV_IN_FLIGHT and SEND_IN_FLIGHT bits
+     of operations on socket that have not completed yet. */
+  uint8_t completionIOFlags;
+  /* Low 32 bits of the monotonic time in milliseconds when socket
+     last read or wrote, or started connecting or draining.  Updated
+     on every operation, the session timer compares against it only
+     when it fires. */
+  uint32_t lastActivityMillis;
+  struct ConnectionSocketInfo* nextPendingReadyConnectionSocketInfo;
   struct ConnectionSocketInfo* relatedConnectionSocketInfo;
-  struct AddrPortStrings clientAddrPortStrings;
-  struct AddrPortStrings serverAddrPortStrings;
-  unsigned char waitingToWriteBuffer[];
 };
 
+struct ConnectionSocketColdInfo
+{
+  /* Pipe holding bytes waiting to be written to socket in
+     splice relay mode, -1 otherwise. */
+  int waitingToWritePipeReadFD;
+  int waitingToWritePipeWriteFD;
+  /* Addresses of the connecting and accepting sides of socket.
+     The proxy's own address for socket is looked up only when
+     needed for logging. */
+  struct CompactAddress clientAddress;
+  struct CompactAddress serverAddress;
+};
+
+/* Address a session's remote side connects to, and the connects
+   it tried so far. */
+struct RemoteTarget
+{
+  /* Index in ProxySettings backendArray, and in addressArray of the
+     backend's address set of addressSetGeneration.  targetIndex is
+     NO_TARGET_INDEX if the address was dropped from the set. */
+  uint32_t backendIndex;
+  uint32_t targetIndex;
+  uint32_t addressSetGeneration;
+  uint8_t numConnectAttempts;
+  /* Not limited by MAX_CONNECT_ATTEMPTS, so as wide as numBackends. */
+  size_t numBackendsTried;
+};
+
+/* Connect to another address of the backend racing the one in
+   proxyToRemote, in the style of RFC 8305 happy eyeballs.  The first
+   to complete becomes the remote side and the other is closed. */
+struct RaceSocketInfo
+{
+  /* RACE_SOCKET_POLL_DATA. */
+  enum PollDataType pollDataType;
+  /* -1 while no racing connect is in progress. */
+  int socket;
+  uint32_t targetIndex;
+  /* Set once the connect in proxyToRemote started a race. */
+  bool started;
+  int64_t startMillis;
+};
+
+/* Both sides of a proxied connection.  Sessions come from a pool
+   aligned to CACHE_LINE_SIZE, so the hot state of both sides takes
+   two cache lines and cold state follows in lines of its own.  Relay
+   buffers are page aligned and come from a separate pool. */
+struct Session
+{
+  struct ConnectionSocketInfo clientToProxy;
+  struct ConnectionSocketInfo proxyToRemote;
+  struct ConnectionSocketColdInfo clientToProxyColdInfo;
+  struct ConnectionSocketColdInfo proxyToRemoteColdInfo;
+  /* The session is freed once both sides are destroyed. */
+  int numDestroyedConnections;
+  struct RemoteTarget remoteTarget;
+  struct RaceSocketInfo raceSocketInfo;
+  struct Session* nextDestroyedSession;
+  /* Scheduled while the session has a connect, drain or idle
+     deadline. */
+  struct TimerWheelTimer sessionTimer;
+};
+
+_Static_assert(sizeof(struct ConnectionSocketInfo) <= CACHE_LINE_SIZE,
+               "ConnectionSocketInfo does not fit in a cache line");
+
+static struct Session* getSession(
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  if (connectionSocketInfo->pollDataType == CLIENT_TO_PROXY_POLL_DATA)
+  {
+    return (struct Session*)
+      (((char*)connectionSocketInfo) - offsetof(struct Session, clientToProxy));
+  }
+  return (struct Session*)
+    (((char*)connectionSocketInfo) - offsetof(struct Session, proxyToRemote));
+}
+
+static struct Session* getRaceSession(
+  struct RaceSocketInfo* raceSocketInfo)
+{
+  return (struct Session*)
+    (((char*)raceSocketInfo) - offsetof(struct Session, raceSocketInfo));
+}
+
+static struct ConnectionSocketColdInfo* getColdInfo(
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  struct Session* session = getSession(connectionSocketInfo);
+  if (connectionSocketInfo->pollDataType == CLIENT_TO_PROXY_POLL_DATA)
+  {
+    return (&(session->clientToProxyColdInfo));
+  }
+  return (&(session->proxyToRemoteColdInfo));
+}
+
+static size_t getNumRelayBufferSizeClasses(
+  size_t maxRelayBufferSize)
+{
+  size_t numSizeClasses = 1;
+  size_t relayBufferSize = MIN_RELAY_BUFFER_SIZE;
+  while ((relayBufferSize < maxRelayBufferSize) &&
+         (numSizeClasses < MAX_RELAY_BUFFER_SIZE_CLASSES))
+  {
+    relayBufferSize *= 2;
+    ++numSizeClasses;
+  }
+  return numSizeClasses;
+}
+
+static size_t getRelayBufferSize(
+  size_t maxRelayBufferSize,
+  size_t sizeClass)
+{
+  const size_t relayBufferSize = ((size_t)MIN_RELAY_BUFFER_SIZE) << sizeClass;
+  return ((relayBufferSize < maxRelayBufferSize) ?
+          relayBufferSize : maxRelayBufferSize);
+}
+
+/* A remote socket connected ahead of the session that will use
+   it.  While connected it waits for read so the backend closing it
+   is noticed. */
+struct WarmSocketInfo
+{
+  /* WARM_SOCKET_POLL_DATA. */
+  enum PollDataType pollDataType;
+  int socket;
+  uint32_t backendIndex;
+  uint32_t targetIndex;
+  bool waitingForConnect;
+  /* Set when the socket has been closed or given to a session but
+     the WarmSocketInfo is still allocated. */
+  bool destroyed;
+  /* Time the connect started, then the time it completed. */
+  int64_t startMillis;
+  struct WarmSocketInfo* prev;
+  struct WarmSocketInfo* next;
+};
+
+/* Warm sockets of one I/O thread to one backend. */
+struct WarmSocketPool
+{
+  /* Most recently connected first. */
+  struct WarmSocketInfo* connectedList;
+  struct WarmSocketInfo* connectingList;
+  size_t numSockets;
+  /* No new connects before this time after one failed. */
+  int64_t retryAfterMillis;
+};
+
+/* Current address set of each backend, shared by the resolver
+   thread and the I/O threads.  The resolver thread publishes a new
+   set with an atomic pointer store and frees the set it replaced
+   after a grace period of qsbrDomain, so I/O threads read address
+   sets without locks. */
+struct BackendAddressTable
+{
+  struct BackendAddressSet** addressSetArray;
+  /* One reader for each I/O thread. */
+  struct QSBRDomain qsbrDomain;
+};
+
+struct IOThreadState
+{
+  const struct ProxySettings* proxySettings;
+  struct BackendAddressTable* backendAddressTable;
+  struct QSBRReader* qsbrReader;
+  /* Address set of each backend read from backendAddressTable when
+     the thread last went online, only valid while it is online, and
+     the generation of each that the thread's state refers to. */
+  const struct BackendAddressSet** addressSetArray;
+  uint32_t* addressSetGenerationArray;
+  struct PollState pollState;
+  struct BufferPool sessionPool;
+  /* Page aligned relay buffers for each size class, unused in splice
+     relay mode. */
+  size_t numRelayBufferSizeClasses;
+  struct BufferPool relayBufferPoolArray[MAX_RELAY_BUFFER_SIZE_CLASSES];
+  /* Sessions with both sides destroyed while handling the current
+     poll result.  They are returned to sessionPool only after the
+     whole result has been handled, so later events in the same
+     result can still safely see that they are destroyed. */
+  struct Session* destroyedSessionList;
+  /* With edge triggered poll, connections that are known to be ready
+     for an operation they are waiting for but will get no new poll
+     event.  Handled after the next non-blocking poll. */
+  struct ConnectionSocketInfo* pendingReadyConnectionSocketInfoList;
+  /* Session timers of live sessions. */
+  struct TimerWheel sessionTimerWheel;
+  /* This thread's view of backend load. */
+  struct BackendBalancer backendBalancer;
+  /* Warm socket pool of each backend, NULL if warm sockets are
+     disabled. */
+  struct WarmSocketPool* warmSocketPoolArray;
+  /* Destroyed while handling the current poll result, freed after
+     it like destroyedSessionList. */
+  struct WarmSocketInfo* destroyedWarmSocketList;
+  /* Set when a pool lost a socket since it was last refilled. */
+  bool warmSocketPoolsNeedRefill;
+  int64_t nextWarmSocketCheckMillis;
+};
+
+/* With completion io, start the receive and the send that
+   connectionSocketInfo is waiting for, if they are not in flight.
+   A receive is limited to the free space in the peer's waiting to
+   write buffer, and a send to the bytes up to the end of the
+   buffer's storage. */
+static void startConnectionCompletionIO(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct PollState* pollState = &(ioThreadState->pollState);
+  const struct ConnectionSocketInfo* relatedConnectionSocketInfo =
+    connectionSocketInfo->relatedConnectionSocketInfo;
+  const struct RingBuffer* waitingToWriteBuffer =
+    &(connectionSocketInfo->waitingToWriteBuffer);
+
+  if (connectionSocketInfo->waitingForRead &&
+      relatedConnectionSocketInfo &&
+      (!(connectionSocketInfo->completionIOFlags & RECV_IN_FLIGHT)) &&
+      (!ringBufferIsFull(&(relatedConnectionSocketInfo->waitingToWriteBuffer))))
+  {
+    const struct RingBuffer* relatedWaitingToWriteBuffer =
+      &(relatedConnectionSocketInfo->waitingToWriteBuffer);
+    startRecv(
+      pollState,
+      connectionSocketInfo->socket,
+      connectionSocketInfo,
+      relatedConnectionSocketInfo->relayBufferSizeClass,
+      relatedWaitingToWriteBuffer->capacity -
+      relatedWaitingToWriteBuffer->size);
+    connectionSocketInfo->completionIOFlags |= RECV_IN_FLIGHT;
+  }
+
+  if (connectionSocketInfo->waitingForWrite &&
+      (!(connectionSocketInfo->completionIOFlags & SEND_IN_FLIGHT)) &&
+      (!ringBufferIsEmpty(waitingToWriteBuffer)))
+  {
+    size_t sendSize = waitingToWriteBuffer->size;
+    if (sendSize >
+        (waitingToWriteBuffer->capacity - waitingToWriteBuffer->readOffset))
+    {
+      sendSize =
+        waitingToWriteBuffer->capacity - waitingToWriteBuffer->readOffset;
+    }
+    startSend(
+      pollState,
+      connectionSocketInfo->socket,
+      connectionSocketInfo,
+      &(waitingToWriteBuffer->buffer[waitingToWriteBuffer->readOffset]),
+      sendSize);
+    connectionSocketInfo->completionIOFlags |= SEND_IN_FLIGHT;
+  }
+}
+
+/* With completion io, poll is only used to wait for connects. */
 static void addConnectionSocketInfoToPollState(
-  struct PollState* pollState,
+  struct IOThreadState* ioThreadState,
   struct ConnectionSocketInfo* connectionSocketInfo)
 {
+  if (ioThreadState->proxySettings->edgeTriggered)
+  {
+    addEdgeTriggeredPollFDToPollState(
+      &(ioThreadState->pollState),
+      connectionSocketInfo->socket,
+      connectionSocketInfo);
+    return;
+  }
+
+  if (ioThreadState->proxySettings->completionIO)
+  {
+    addPollFDToPollState(
+      &(ioThreadState->pollState),
+      connectionSocketInfo->socket,
+      connectionSocketInfo,
+      NOT_INTERESTED_IN_READ_EVENTS,
+      (connectionSocketInfo->waitingForConnect ?
+       INTERESTED_IN_WRITE_EVENTS :
+       NOT_INTERESTED_IN_WRITE_EVENTS));
+    startConnectionCompletionIO(connectionSocketInfo, ioThreadState);
+    return;
+  }
+
   addPollFDToPollState(
-    pollState,
+    &(ioThreadState->pollState),
     connectionSocketInfo->socket,
     connectionSocketInfo,
     (connectionSocketInfo->waitingForRead ?
@@ -294,11 +1092,25 @@ static void addConnectionSocketInfoToPollState(
 }
 
 static void updatePollStateForConnectionSocketInfo(
-  struct PollState* pollState,
+  struct IOThreadState* ioThreadState,
   struct ConnectionSocketInfo* connectionSocketInfo)
 {
+  if (ioThreadState->proxySettings->completionIO)
+  {
+    updatePollFDInPollState(
+      &(ioThreadState->pollState),
+      connectionSocketInfo->socket,
+      connectionSocketInfo,
+      NOT_INTERESTED_IN_READ_EVENTS,
+      (connectionSocketInfo->waitingForConnect ?
+       INTERESTED_IN_WRITE_EVENTS :
+       NOT_INTERESTED_IN_WRITE_EVENTS));
+    startConnectionCompletionIO(connectionSocketInfo, ioThreadState);
+    return;
+  }
+
   updatePollFDInPollState(
-    pollState,
+    &(ioThreadState->pollState),
     connectionSocketInfo->socket,
     connectionSocketInfo,
     (connectionSocketInfo->waitingForRead ?
@@ -312,6 +1124,8 @@ static void updatePollStateForConnectionSocketInfo(
 
 static void setupServerSockets(
   const struct LinkedList* serverAddrInfoList,
+  bool reusePort,
+  bool completionIO,
   struct PollState* pollState)
 {
   struct LinkedListNode* nodePtr;
@@ -333,6 +1147,7 @@ static void setupServerSockets(
       exit(1);
     }
 
+    serverSocketInfo->pollDataType = SERVER_SOCKET_POLL_DATA;
     serverSocketInfo->socket = socket(listenAddrInfo->ai_family,
                                       listenAddrInfo->ai_socktype,
                                       listenAddrInfo->ai_protocol);
@@ -352,11 +1167,21 @@ static void setupServerSockets(
       exit(1);
     }
 
-    if (bind(serverSocketInfo->socket,
-             listenAddrInfo->ai_addr,
-             listenAddrInfo->ai_addrlen) < 0)
+#ifdef SO_REUSEPORT
+    if (reusePort && (setSocketReusePort(serverSocketInfo->socket) < 0))
     {
-      proxyLog("bind error on server socket %s:%s",
+      proxyLog("setSocketReusePort error on server socket %s:%s",
+               serverAddrPortStrings.addrString,
+               serverAddrPortStrings.portString);
+      exit(1);
+    }
+#endif
+
+    if (bind(serverSocketInfo->socket,
+             listenAddrInfo->ai_addr,
+             listenAddrInfo->ai_addrlen) < 0)
+    {
+      proxyLog("bind error on server socket %s:%s",
                serverAddrPortStrings.addrString,
                serverAddrPortStrings.portString);
       exit(1);
@@ -383,81 +1208,32 @@ static void setupServerSockets(
              serverAddrPortStrings.portString,
              serverSocketInfo->socket);
 
-    addPollFDToPollState(
-      pollState,
-      serverSocketInfo->socket,
-      serverSocketInfo,
-      INTERESTED_IN_READ_EVENTS,
-      NOT_INTERESTED_IN_WRITE_EVENTS);
+    if (completionIO)
+    {
+      startAccept(pollState, serverSocketInfo->socket, serverSocketInfo);
+    }
+    else
+    {
+      addPollFDToPollState(
+        pollState,
+        serverSocketInfo->socket,
+        serverSocketInfo,
+        INTERESTED_IN_READ_EVENTS,
+        NOT_INTERESTED_IN_WRITE_EVENTS);
+    }
   }
 }
 
 static bool setupClientSocket(
   int clientSocket,
-  const struct ProxySettings* proxySettings,
-  struct AddrPortStrings* clientAddrPortStrings,
-  struct AddrPortStrings* proxyServerAddrPortStrings)
+  const struct ProxySettings* proxySettings)
 {
-  struct sockaddr_storage clientAddress;
-  socklen_t clientAddressSize;
-  struct sockaddr_storage proxyServerAddress;
-  socklen_t proxyServerAddressSize;
-
-  if (setFDNonBlocking(clientSocket) < 0)
-  {
-    proxyLog("error setting non-blocking on accepted socket");
-    return false;
-  }
-
   if ((proxySettings->noDelay) && (setSocketNoDelay(clientSocket) < 0))
   {
     proxyLog("error setting no delay on accepted socket");
     return false;
   }
 
-  clientAddressSize = sizeof(clientAddress);
-  if (getpeername(
-        clientSocket, 
-        (struct sockaddr*)&clientAddress,
-        &clientAddressSize) < 0)
-  {
-    proxyLog("getpeername error errno = %d", errno);
-    return false;
-  }
-
-  if (addressToNameAndPort((struct sockaddr*)&clientAddress,
-                           clientAddressSize,
-                           clientAddrPortStrings) < 0)
-  {
-    proxyLog("error getting client address name and port");
-    return false;
-  }
-
-  proxyServerAddressSize = sizeof(proxyServerAddress);
-  if (getsockname(
-        clientSocket, 
-        (struct sockaddr*)&proxyServerAddress,
-        &proxyServerAddressSize) < 0)
-  {
-    proxyLog("getsockname error errno = %d", errno);
-    return false;
-  }
-
-  if (addressToNameAndPort((struct sockaddr*)&proxyServerAddress,
-                           proxyServerAddressSize,
-                           proxyServerAddrPortStrings) < 0)
-  {
-    proxyLog("error getting proxy server address name and port");
-    return false;
-  }
-
-  proxyLog("connect client to proxy %s:%s -> %s:%s (fd=%d)",
-           clientAddrPortStrings->addrString,
-           clientAddrPortStrings->portString,
-           proxyServerAddrPortStrings->addrString,
-           proxyServerAddrPortStrings->portString,
-           clientSocket);
-
   return true;
 }
 
@@ -475,19 +1251,17 @@ struct RemoteSocketResult
 };
 
 static struct RemoteSocketResult createRemoteSocket(
-  const struct ProxySettings* proxySettings,
-  struct AddrPortStrings* proxyClientAddrPortStrings)
+  const struct addrinfo* remoteAddrInfo,
+  const struct ProxySettings* proxySettings)
 {
   int connectRetVal;
-  struct sockaddr_storage proxyClientAddress;
-  socklen_t proxyClientAddressSize;
   struct RemoteSocketResult result =
   {
     .status = REMOTE_SOCKET_ERROR,
     .remoteSocket =
-       socket(proxySettings->remoteAddrInfo->ai_family,
-              proxySettings->remoteAddrInfo->ai_socktype,
-              proxySettings->remoteAddrInfo->ai_protocol)
+       socket(remoteAddrInfo->ai_family,
+              remoteAddrInfo->ai_socktype,
+              remoteAddrInfo->ai_protocol)
   };
   if (result.remoteSocket < 0)
   {
@@ -508,8 +1282,8 @@ static struct RemoteSocketResult createRemoteSocket(
 
   connectRetVal = connect(
     result.remoteSocket,
-    proxySettings->remoteAddrInfo->ai_addr,
-    proxySettings->remoteAddrInfo->ai_addrlen);
+    remoteAddrInfo->ai_addr,
+    remoteAddrInfo->ai_addrlen);
   if ((connectRetVal < 0) &&
       ((errno == EINPROGRESS) ||
        (errno == EINTR)))
@@ -541,201 +1315,1699 @@ static struct RemoteSocketResult createRemoteSocket(
     return result;
   }
 
-  proxyClientAddressSize = sizeof(proxyClientAddress);
-  if (getsockname(
-        result.remoteSocket,
-        (struct sockaddr*)&proxyClientAddress,
-        &proxyClientAddressSize) < 0)
+  return result;
+}
+
+static const struct BackendAddressSet* getBackendAddressSet(
+  const struct IOThreadState* ioThreadState,
+  size_t backendIndex)
+{
+  return ioThreadState->addressSetArray[backendIndex];
+}
+
+static const struct addrinfo* getRemoteTargetAddress(
+  const struct RemoteTarget* remoteTarget,
+  const struct IOThreadState* ioThreadState)
+{
+  return getBackendAddressSet(
+    ioThreadState,
+    remoteTarget->backendIndex)->addressArray[remoteTarget->targetIndex];
+}
+
+/* Sets remoteTarget to its backend's first usable address. */
+static void chooseFirstTargetOfBackend(
+  struct RemoteTarget* remoteTarget,
+  struct IOThreadState* ioThreadState)
+{
+  remoteTarget->targetIndex =
+    chooseBackendTarget(
+      &(ioThreadState->backendBalancer),
+      remoteTarget->backendIndex,
+      getCachedMonotonicTimeMillis());
+  remoteTarget->addressSetGeneration =
+    ioThreadState->addressSetGenerationArray[remoteTarget->backendIndex];
+}
+
+/* Sets *targetIndex to the usable address of remoteTarget's backend
+   that follows remoteTarget.  Returns false if there is none. */
+static bool getNextTargetOfBackend(
+  const struct RemoteTarget* remoteTarget,
+  size_t* targetIndex,
+  struct IOThreadState* ioThreadState)
+{
+  const struct BackendBalancer* backendBalancer =
+    &(ioThreadState->backendBalancer);
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+
+  if (remoteTarget->targetIndex == NO_TARGET_INDEX)
   {
-    proxyLog("getsockname error errno = %d", errno);
-    signalSafeClose(result.remoteSocket);
-    result.status = REMOTE_SOCKET_ERROR;
-    result.remoteSocket = -1;
-    return result;
+    *targetIndex =
+      chooseBackendTarget(
+        backendBalancer,
+        remoteTarget->backendIndex,
+        nowMillis);
+    return backendIsUsable(
+      backendBalancer,
+      remoteTarget->backendIndex,
+      nowMillis);
+  }
+  *targetIndex = remoteTarget->targetIndex;
+  return chooseNextBackendTarget(
+    backendBalancer,
+    remoteTarget->backendIndex,
+    targetIndex,
+    nowMillis);
+}
+
+static void chooseRemoteTarget(
+  struct RemoteTarget* remoteTarget,
+  struct IOThreadState* ioThreadState)
+{
+  remoteTarget->backendIndex =
+    chooseBackend(
+      &(ioThreadState->backendBalancer),
+      getCachedMonotonicTimeMillis());
+  chooseFirstTargetOfBackend(remoteTarget, ioThreadState);
+  remoteTarget->numConnectAttempts = 0;
+  remoteTarget->numBackendsTried = 1;
+}
+
+/* Moves remoteTarget to the next usable address of its backend, or
+   else to the next backend with a usable address.  Returns false if
+   there is none or the session used up its connect attempts. */
+static bool chooseNextRemoteTarget(
+  struct RemoteTarget* remoteTarget,
+  struct IOThreadState* ioThreadState)
+{
+  const struct BackendBalancer* backendBalancer =
+    &(ioThreadState->backendBalancer);
+  const size_t numBackends = ioThreadState->proxySettings->numBackends;
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  size_t targetIndex;
+
+  if (remoteTarget->numConnectAttempts >= MAX_CONNECT_ATTEMPTS)
+  {
+    return false;
   }
 
-  if (addressToNameAndPort((struct sockaddr*)&proxyClientAddress,
-                           proxyClientAddressSize,
-                           proxyClientAddrPortStrings) < 0)
+  if (getNextTargetOfBackend(remoteTarget, &targetIndex, ioThreadState))
   {
-    proxyLog("error getting proxy client address name and port");
-    signalSafeClose(result.remoteSocket);
-    result.status = REMOTE_SOCKET_ERROR;
-    result.remoteSocket = -1;
-    return result;
+    remoteTarget->targetIndex = targetIndex;
+    return true;
+  }
+
+  while (remoteTarget->numBackendsTried < numBackends)
+  {
+    remoteTarget->backendIndex =
+      (remoteTarget->backendIndex + 1) % numBackends;
+    ++(remoteTarget->numBackendsTried);
+    if (backendIsUsable(
+          backendBalancer,
+          remoteTarget->backendIndex,
+          nowMillis))
+    {
+      chooseFirstTargetOfBackend(remoteTarget, ioThreadState);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Starts a connect to remoteTarget, moving on to the next target
+   while connects fail at once. */
+static struct RemoteSocketResult connectToRemoteTarget(
+  struct RemoteTarget* remoteTarget,
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  struct RemoteSocketResult remoteSocketResult;
+
+  do
+  {
+    ++(remoteTarget->numConnectAttempts);
+    remoteSocketResult =
+      createRemoteSocket(
+        getRemoteTargetAddress(remoteTarget, ioThreadState),
+        proxySettings);
+    if (remoteSocketResult.status != REMOTE_SOCKET_ERROR)
+    {
+      break;
+    }
+    recordBackendConnectFailure(
+      &(ioThreadState->backendBalancer),
+      remoteTarget->backendIndex,
+      remoteTarget->targetIndex,
+      getCachedMonotonicTimeMillis());
+  } while (chooseNextRemoteTarget(remoteTarget, ioThreadState));
+
+  return remoteSocketResult;
+}
+
+static bool setupWaitingToWritePipe(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  const struct ProxySettings* proxySettings)
+{
+#ifdef PROXY_SPLICE_SUPPORTED
+  if (proxySettings->spliceRelay)
+  {
+    struct ConnectionSocketColdInfo* coldInfo =
+      getColdInfo(connectionSocketInfo);
+    int pipeFDs[2];
+    int pipeSize;
+
+    if (createNonBlockingPipe(pipeFDs) < 0)
+    {
+      proxyLog("error creating splice pipe errno = %d", errno);
+      return false;
+    }
+
+    coldInfo->waitingToWritePipeReadFD = pipeFDs[0];
+    coldInfo->waitingToWritePipeWriteFD = pipeFDs[1];
+
+    pipeSize = setPipeSize(pipeFDs[1], proxySettings->bufferSize);
+    if (pipeSize <= 0)
+    {
+      proxyLog("error getting splice pipe size errno = %d", errno);
+      return false;
+    }
+    initializeRingBuffer(
+      &(connectionSocketInfo->waitingToWriteBuffer),
+      NULL,
+      pipeSize);
+  }
+#endif
+  return true;
+}
+
+static void closeWaitingToWritePipe(
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  struct ConnectionSocketColdInfo* coldInfo =
+    getColdInfo(connectionSocketInfo);
+  if (coldInfo->waitingToWritePipeReadFD >= 0)
+  {
+    signalSafeClose(coldInfo->waitingToWritePipeReadFD);
+    coldInfo->waitingToWritePipeReadFD = -1;
+  }
+  if (coldInfo->waitingToWritePipeWriteFD >= 0)
+  {
+    signalSafeClose(coldInfo->waitingToWritePipeWriteFD);
+    coldInfo->waitingToWritePipeWriteFD = -1;
+  }
+}
+
+static void logConnectionDebug(
+  const char* event,
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  struct ConnectionSocketColdInfo* coldInfo;
+  struct CompactAddress* proxyAddress;
+  struct AddrPortStrings clientAddrPortStrings;
+  struct AddrPortStrings serverAddrPortStrings;
+
+  if (!proxyLogLevelEnabled(PROXY_LOG_LEVEL_DEBUG))
+  {
+    return;
+  }
+
+  coldInfo = getColdInfo(connectionSocketInfo);
+  proxyAddress =
+    ((connectionSocketInfo->pollDataType == CLIENT_TO_PROXY_POLL_DATA) ?
+     &(coldInfo->serverAddress) :
+     &(coldInfo->clientAddress));
+  if (proxyAddress->family == AF_UNSPEC)
+  {
+    /* Leaves the address unknown on error. */
+    getSocketLocalCompactAddress(connectionSocketInfo->socket, proxyAddress);
+  }
+  /* Not known for clients accepted with completion io. */
+  if ((connectionSocketInfo->pollDataType == CLIENT_TO_PROXY_POLL_DATA) &&
+      (coldInfo->clientAddress.family == AF_UNSPEC))
+  {
+    getSocketPeerCompactAddress(
+      connectionSocketInfo->socket, &(coldInfo->clientAddress));
+  }
+
+  compactAddressToAddrPortStrings(
+    &(coldInfo->clientAddress),
+    &clientAddrPortStrings);
+  compactAddressToAddrPortStrings(
+    &(coldInfo->serverAddress),
+    &serverAddrPortStrings);
+  proxyLog("%s %s:%s -> %s:%s (fd=%d)",
+           event,
+           clientAddrPortStrings.addrString,
+           clientAddrPortStrings.portString,
+           serverAddrPortStrings.addrString,
+           serverAddrPortStrings.portString,
+           connectionSocketInfo->socket);
+}
+
+static void recordConnectionActivity(
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  connectionSocketInfo->lastActivityMillis =
+    (uint32_t)getCachedMonotonicTimeMillis();
+}
+
+static int64_t getLastActivityMillis(
+  const struct ConnectionSocketInfo* connectionSocketInfo,
+  int64_t nowMillis)
+{
+  const uint32_t millisSinceActivity =
+    ((uint32_t)nowMillis) - connectionSocketInfo->lastActivityMillis;
+  return (nowMillis - millisSinceActivity);
+}
+
+static void initializeConnectionSocketInfo(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct ConnectionSocketColdInfo* coldInfo,
+  enum PollDataType pollDataType,
+  int socket,
+  struct ConnectionSocketInfo* relatedConnectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+
+  memset(connectionSocketInfo, 0, sizeof(struct ConnectionSocketInfo));
+  connectionSocketInfo->pollDataType = pollDataType;
+  connectionSocketInfo->socket = socket;
+  recordConnectionActivity(connectionSocketInfo);
+  connectionSocketInfo->relatedConnectionSocketInfo =
+    relatedConnectionSocketInfo;
+  /* In splice relay mode setupWaitingToWritePipe initializes
+     waitingToWriteBuffer.  Otherwise a relay buffer of the smallest
+     size class is attached only while there are bytes waiting to be
+     written. */
+  if (!(proxySettings->spliceRelay))
+  {
+    initializeRingBuffer(
+      &(connectionSocketInfo->waitingToWriteBuffer),
+      NULL,
+      getRelayBufferSize(proxySettings->bufferSize, 0));
+  }
+
+  memset(coldInfo, 0, sizeof(struct ConnectionSocketColdInfo));
+  coldInfo->waitingToWritePipeReadFD = -1;
+  coldInfo->waitingToWritePipeWriteFD = -1;
+  coldInfo->clientAddress.family = AF_UNSPEC;
+  coldInfo->serverAddress.family = AF_UNSPEC;
+}
+
+static struct BufferPool* getRelayBufferPool(
+  const struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  return (&(ioThreadState->relayBufferPoolArray[
+             connectionSocketInfo->relayBufferSizeClass]));
+}
+
+static void freeSession(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  if (session->clientToProxy.waitingToWriteBuffer.buffer)
+  {
+    returnBufferToBufferPool(
+      getRelayBufferPool(&(session->clientToProxy), ioThreadState),
+      session->clientToProxy.waitingToWriteBuffer.buffer);
+  }
+  if (session->proxyToRemote.waitingToWriteBuffer.buffer)
+  {
+    returnBufferToBufferPool(
+      getRelayBufferPool(&(session->proxyToRemote), ioThreadState),
+      session->proxyToRemote.waitingToWriteBuffer.buffer);
+  }
+  returnBufferToBufferPool(
+    &(ioThreadState->sessionPool),
+    session);
+}
+
+/* Returns true if the remote connect of session may still start a
+   racing connect to another address of its backend. */
+static bool raceConnectPending(
+  const struct Session* session,
+  const struct IOThreadState* ioThreadState)
+{
+  return ((!(session->raceSocketInfo.started)) &&
+          (getBackendAddressSet(
+             ioThreadState,
+             session->remoteTarget.backendIndex)->numAddresses > 1));
+}
+
+/* Returns the time the session times out, or -1 if it has no
+   deadline.  A session waiting for its remote connect has the
+   connect timeout, a session with one side destroyed has the drain
+   timeout for the other side to write what it still holds, and any
+   other session has the idle timeout. */
+static int64_t getSessionDeadlineMillis(
+  const struct Session* session,
+  const struct IOThreadState* ioThreadState,
+  int64_t nowMillis)
+{
+  const struct ProxySettings* proxySettings = ioThreadState->proxySettings;
+  const struct ConnectionSocketInfo* clientToProxy =
+    &(session->clientToProxy);
+  const struct ConnectionSocketInfo* proxyToRemote =
+    &(session->proxyToRemote);
+
+  if (clientToProxy->destroyed || proxyToRemote->destroyed)
+  {
+    const struct ConnectionSocketInfo* drainingConnectionSocketInfo =
+      ((clientToProxy->destroyed) ? proxyToRemote : clientToProxy);
+    if (proxySettings->drainTimeoutMillis > 0)
+    {
+      return (getLastActivityMillis(drainingConnectionSocketInfo, nowMillis) +
+              proxySettings->drainTimeoutMillis);
+    }
+  }
+  else if (proxyToRemote->waitingForConnect)
+  {
+    const int64_t connectStartMillis =
+      getLastActivityMillis(proxyToRemote, nowMillis);
+    int64_t deadlineMillis = -1;
+    if (proxySettings->connectTimeoutMillis > 0)
+    {
+      deadlineMillis =
+        connectStartMillis + proxySettings->connectTimeoutMillis;
+    }
+    if (raceConnectPending(session, ioThreadState) &&
+        ((deadlineMillis < 0) ||
+         ((connectStartMillis + HAPPY_EYEBALLS_DELAY_MILLIS) <
+          deadlineMillis)))
+    {
+      deadlineMillis = connectStartMillis + HAPPY_EYEBALLS_DELAY_MILLIS;
+    }
+    return deadlineMillis;
+  }
+  else if (proxySettings->idleTimeoutMillis > 0)
+  {
+    const int64_t clientToProxyActivityMillis =
+      getLastActivityMillis(clientToProxy, nowMillis);
+    const int64_t proxyToRemoteActivityMillis =
+      getLastActivityMillis(proxyToRemote, nowMillis);
+    return (((clientToProxyActivityMillis > proxyToRemoteActivityMillis) ?
+             clientToProxyActivityMillis : proxyToRemoteActivityMillis) +
+            proxySettings->idleTimeoutMillis);
+  }
+  return -1;
+}
+
+/* Schedules the session timer if the session's deadline is earlier
+   than the timer, or removes it if there is no deadline.  Activity
+   only moves deadlines later, so it never needs to touch the timer;
+   a timer that fires before the deadline is added again. */
+static void updateSessionTimer(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  struct TimerWheel* sessionTimerWheel =
+    &(ioThreadState->sessionTimerWheel);
+  struct TimerWheelTimer* sessionTimer = &(session->sessionTimer);
+  const int64_t deadlineMillis =
+    getSessionDeadlineMillis(
+      session,
+      ioThreadState,
+      getCachedMonotonicTimeMillis());
+
+  if (deadlineMillis < 0)
+  {
+    removeTimerFromTimerWheel(sessionTimerWheel, sessionTimer);
+  }
+  else if ((!timerWheelTimerIsScheduled(sessionTimer)) ||
+           (deadlineMillis < sessionTimer->expireMillis))
+  {
+    removeTimerFromTimerWheel(sessionTimerWheel, sessionTimer);
+    addTimerToTimerWheel(sessionTimerWheel, sessionTimer, deadlineMillis);
+  }
+}
+
+static struct WarmSocketInfo** getWarmSocketList(
+  struct WarmSocketPool* warmSocketPool,
+  const struct WarmSocketInfo* warmSocketInfo)
+{
+  return ((warmSocketInfo->waitingForConnect) ?
+          &(warmSocketPool->connectingList) :
+          &(warmSocketPool->connectedList));
+}
+
+static void pushWarmSocket(
+  struct WarmSocketInfo** warmSocketList,
+  struct WarmSocketInfo* warmSocketInfo)
+{
+  warmSocketInfo->prev = NULL;
+  warmSocketInfo->next = *warmSocketList;
+  if (*warmSocketList)
+  {
+    (*warmSocketList)->prev = warmSocketInfo;
+  }
+  *warmSocketList = warmSocketInfo;
+}
+
+static void unlinkWarmSocket(
+  struct WarmSocketInfo** warmSocketList,
+  struct WarmSocketInfo* warmSocketInfo)
+{
+  if (warmSocketInfo->prev)
+  {
+    warmSocketInfo->prev->next = warmSocketInfo->next;
+  }
+  else
+  {
+    *warmSocketList = warmSocketInfo->next;
+  }
+  if (warmSocketInfo->next)
+  {
+    warmSocketInfo->next->prev = warmSocketInfo->prev;
+  }
+  warmSocketInfo->prev = NULL;
+  warmSocketInfo->next = NULL;
+}
+
+/* Removes warmSocketInfo from its pool and poll state, closing the
+   socket unless a session is taking it over. */
+static void destroyWarmSocket(
+  struct WarmSocketInfo* warmSocketInfo,
+  bool closeSocket,
+  struct IOThreadState* ioThreadState)
+{
+  struct WarmSocketPool* warmSocketPool =
+    &(ioThreadState->warmSocketPoolArray[warmSocketInfo->backendIndex]);
+
+  unlinkWarmSocket(
+    getWarmSocketList(warmSocketPool, warmSocketInfo),
+    warmSocketInfo);
+  --(warmSocketPool->numSockets);
+  ioThreadState->warmSocketPoolsNeedRefill = true;
+  removePollFDFromPollState(
+    &(ioThreadState->pollState),
+    warmSocketInfo->socket);
+  if (closeSocket)
+  {
+    signalSafeClose(warmSocketInfo->socket);
+  }
+  warmSocketInfo->destroyed = true;
+  warmSocketInfo->next = ioThreadState->destroyedWarmSocketList;
+  ioThreadState->destroyedWarmSocketList = warmSocketInfo;
+}
+
+static void failWarmConnect(
+  struct WarmSocketInfo* warmSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+
+  recordBackendConnectFailure(
+    &(ioThreadState->backendBalancer),
+    warmSocketInfo->backendIndex,
+    warmSocketInfo->targetIndex,
+    nowMillis);
+  ioThreadState->warmSocketPoolArray[
+    warmSocketInfo->backendIndex].retryAfterMillis =
+      nowMillis + WARM_SOCKET_CHECK_INTERVAL_MILLIS;
+  destroyWarmSocket(warmSocketInfo, true, ioThreadState);
+}
+
+static bool startWarmConnect(
+  size_t backendIndex,
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  struct WarmSocketPool* warmSocketPool =
+    &(ioThreadState->warmSocketPoolArray[backendIndex]);
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  const size_t targetIndex =
+    chooseBackendTarget(
+      &(ioThreadState->backendBalancer),
+      backendIndex,
+      nowMillis);
+  const struct RemoteSocketResult remoteSocketResult =
+    createRemoteSocket(
+      getBackendAddressSet(
+        ioThreadState,
+        backendIndex)->addressArray[targetIndex],
+      proxySettings);
+  struct WarmSocketInfo* warmSocketInfo;
+
+  if (remoteSocketResult.status == REMOTE_SOCKET_ERROR)
+  {
+    recordBackendConnectFailure(
+      &(ioThreadState->backendBalancer),
+      backendIndex,
+      targetIndex,
+      nowMillis);
+    warmSocketPool->retryAfterMillis =
+      nowMillis + WARM_SOCKET_CHECK_INTERVAL_MILLIS;
+    return false;
+  }
+
+  warmSocketInfo = checkedCalloc(1, sizeof(struct WarmSocketInfo));
+  warmSocketInfo->pollDataType = WARM_SOCKET_POLL_DATA;
+  warmSocketInfo->socket = remoteSocketResult.remoteSocket;
+  warmSocketInfo->backendIndex = backendIndex;
+  warmSocketInfo->targetIndex = targetIndex;
+  warmSocketInfo->waitingForConnect =
+    (remoteSocketResult.status == REMOTE_SOCKET_IN_PROGRESS);
+  warmSocketInfo->startMillis = nowMillis;
+  pushWarmSocket(
+    getWarmSocketList(warmSocketPool, warmSocketInfo),
+    warmSocketInfo);
+  ++(warmSocketPool->numSockets);
+
+  addPollFDToPollState(
+    &(ioThreadState->pollState),
+    warmSocketInfo->socket,
+    warmSocketInfo,
+    ((warmSocketInfo->waitingForConnect) ?
+     NOT_INTERESTED_IN_READ_EVENTS :
+     INTERESTED_IN_READ_EVENTS),
+    ((warmSocketInfo->waitingForConnect) ?
+     INTERESTED_IN_WRITE_EVENTS :
+     NOT_INTERESTED_IN_WRITE_EVENTS));
+  if (!(warmSocketInfo->waitingForConnect))
+  {
+    recordBackendConnectSuccess(
+      &(ioThreadState->backendBalancer),
+      backendIndex,
+      targetIndex,
+      0,
+      nowMillis);
+  }
+  return true;
+}
+
+static void handleWarmSocketReady(
+  struct WarmSocketInfo* warmSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  /* Destroyed earlier while handling the same poll result. */
+  if (warmSocketInfo->destroyed)
+  {
+    return;
+  }
+
+  if (warmSocketInfo->waitingForConnect)
+  {
+    const int socketError = getSocketError(warmSocketInfo->socket);
+    if (socketError == 0)
+    {
+      struct WarmSocketPool* warmSocketPool =
+        &(ioThreadState->warmSocketPoolArray[warmSocketInfo->backendIndex]);
+      const int64_t nowMillis = getCachedMonotonicTimeMillis();
+
+      recordBackendConnectSuccess(
+        &(ioThreadState->backendBalancer),
+        warmSocketInfo->backendIndex,
+        warmSocketInfo->targetIndex,
+        nowMillis - warmSocketInfo->startMillis,
+        nowMillis);
+      unlinkWarmSocket(&(warmSocketPool->connectingList), warmSocketInfo);
+      warmSocketInfo->waitingForConnect = false;
+      warmSocketInfo->startMillis = nowMillis;
+      pushWarmSocket(&(warmSocketPool->connectedList), warmSocketInfo);
+      updatePollFDInPollState(
+        &(ioThreadState->pollState),
+        warmSocketInfo->socket,
+        warmSocketInfo,
+        INTERESTED_IN_READ_EVENTS,
+        NOT_INTERESTED_IN_WRITE_EVENTS);
+    }
+    else if (socketError != EINPROGRESS)
+    {
+      char* socketErrorString = errnoToString(socketError);
+      proxyLog("warm remote connect fd %d errno %d: %s",
+               warmSocketInfo->socket,
+               socketError,
+               socketErrorString);
+      free(socketErrorString);
+      failWarmConnect(warmSocketInfo, ioThreadState);
+    }
+  }
+  else if (!socketIsOpen(warmSocketInfo->socket))
+  {
+    proxyLogDebug("warm remote socket fd %d closed by remote",
+                  warmSocketInfo->socket);
+    destroyWarmSocket(warmSocketInfo, true, ioThreadState);
+  }
+  else
+  {
+    /* The remote spoke first.  Leave its bytes for the session. */
+    updatePollFDInPollState(
+      &(ioThreadState->pollState),
+      warmSocketInfo->socket,
+      warmSocketInfo,
+      NOT_INTERESTED_IN_READ_EVENTS,
+      NOT_INTERESTED_IN_WRITE_EVENTS);
+  }
+}
+
+/* Returns a connected warm socket to the backend of remoteTarget
+   for a new session and sets its target, or returns -1 if there is
+   none. */
+static int takeWarmSocket(
+  struct RemoteTarget* remoteTarget,
+  struct IOThreadState* ioThreadState)
+{
+  struct WarmSocketPool* warmSocketPool;
+
+  if (!(ioThreadState->warmSocketPoolArray))
+  {
+    return -1;
   }
 
-  if (result.status != REMOTE_SOCKET_ERROR)
+  warmSocketPool =
+    &(ioThreadState->warmSocketPoolArray[remoteTarget->backendIndex]);
+  while (warmSocketPool->connectedList)
+  {
+    struct WarmSocketInfo* warmSocketInfo = warmSocketPool->connectedList;
+    const int socket = warmSocketInfo->socket;
+    /* The remote may have closed it since the last poll. */
+    const bool socketOpen = socketIsOpen(socket);
+
+    destroyWarmSocket(warmSocketInfo, !socketOpen, ioThreadState);
+    if (socketOpen)
+    {
+      remoteTarget->targetIndex = warmSocketInfo->targetIndex;
+      return socket;
+    }
+    proxyLogDebug("warm remote socket fd %d closed by remote", socket);
+  }
+  return -1;
+}
+
+static void expireWarmSockets(
+  struct WarmSocketPool* warmSocketPool,
+  int64_t nowMillis,
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  struct WarmSocketInfo* warmSocketInfo;
+  struct WarmSocketInfo* nextWarmSocketInfo;
+
+  for (warmSocketInfo = warmSocketPool->connectingList;
+       warmSocketInfo;
+       warmSocketInfo = nextWarmSocketInfo)
+  {
+    nextWarmSocketInfo = warmSocketInfo->next;
+    if ((proxySettings->connectTimeoutMillis > 0) &&
+        ((nowMillis - warmSocketInfo->startMillis) >=
+         proxySettings->connectTimeoutMillis))
+    {
+      proxyLog("warm remote connect fd %d timed out",
+               warmSocketInfo->socket);
+      failWarmConnect(warmSocketInfo, ioThreadState);
+    }
+  }
+
+  for (warmSocketInfo = warmSocketPool->connectedList;
+       warmSocketInfo;
+       warmSocketInfo = nextWarmSocketInfo)
+  {
+    nextWarmSocketInfo = warmSocketInfo->next;
+    if ((nowMillis - warmSocketInfo->startMillis) >=
+        WARM_SOCKET_MAX_IDLE_MILLIS)
+    {
+      proxyLogDebug("warm remote socket fd %d idle, closing",
+                    warmSocketInfo->socket);
+      destroyWarmSocket(warmSocketInfo, true, ioThreadState);
+    }
+  }
+}
+
+/* Periodically closes warm sockets that took too long to connect or
+   sat idle too long, and starts connects to bring each pool that
+   lost sockets back to size. */
+static void maintainWarmSocketPools(
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  size_t i;
+
+  if (!(ioThreadState->warmSocketPoolArray))
+  {
+    return;
+  }
+
+  if (nowMillis >= ioThreadState->nextWarmSocketCheckMillis)
+  {
+    ioThreadState->nextWarmSocketCheckMillis =
+      nowMillis + WARM_SOCKET_CHECK_INTERVAL_MILLIS;
+    for (i = 0; i < proxySettings->numBackends; ++i)
+    {
+      expireWarmSockets(
+        &(ioThreadState->warmSocketPoolArray[i]),
+        nowMillis,
+        ioThreadState);
+    }
+    /* Also retries pools waiting after a failed connect. */
+    ioThreadState->warmSocketPoolsNeedRefill = true;
+  }
+
+  if (!(ioThreadState->warmSocketPoolsNeedRefill))
+  {
+    return;
+  }
+  ioThreadState->warmSocketPoolsNeedRefill = false;
+  for (i = 0; i < proxySettings->numBackends; ++i)
+  {
+    struct WarmSocketPool* warmSocketPool =
+      &(ioThreadState->warmSocketPoolArray[i]);
+    while ((warmSocketPool->numSockets < proxySettings->warmSockets) &&
+           (nowMillis >= warmSocketPool->retryAfterMillis))
+    {
+      if (!startWarmConnect(i, ioThreadState))
+      {
+        break;
+      }
+    }
+  }
+}
+
+static void freeDestroyedWarmSockets(
+  struct IOThreadState* ioThreadState)
+{
+  while (ioThreadState->destroyedWarmSocketList)
+  {
+    struct WarmSocketInfo* warmSocketInfo =
+      ioThreadState->destroyedWarmSocketList;
+    ioThreadState->destroyedWarmSocketList = warmSocketInfo->next;
+    free(warmSocketInfo);
+  }
+}
+
+/* Closes all warm sockets to backendIndex after its addresses
+   changed, so the pool refills with connects to the new addresses. */
+static void emptyWarmSocketPool(
+  size_t backendIndex,
+  struct IOThreadState* ioThreadState)
+{
+  struct WarmSocketPool* warmSocketPool;
+
+  if (!(ioThreadState->warmSocketPoolArray))
+  {
+    return;
+  }
+
+  warmSocketPool = &(ioThreadState->warmSocketPoolArray[backendIndex]);
+  while (warmSocketPool->connectingList)
+  {
+    destroyWarmSocket(warmSocketPool->connectingList, true, ioThreadState);
+  }
+  while (warmSocketPool->connectedList)
+  {
+    destroyWarmSocket(warmSocketPool->connectedList, true, ioThreadState);
+  }
+  warmSocketPool->retryAfterMillis = 0;
+}
+
+/* Reads the current address set of each backend after the thread
+   went online.  A backend whose set was replaced starts over with
+   no failed addresses and no warm sockets. */
+static void refreshAddressSets(
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  size_t i;
+
+  for (i = 0; i < proxySettings->numBackends; ++i)
+  {
+    const struct BackendAddressSet* addressSet =
+      __atomic_load_n(
+        &(ioThreadState->backendAddressTable->addressSetArray[i]),
+        __ATOMIC_ACQUIRE);
+    ioThreadState->addressSetArray[i] = addressSet;
+    if (addressSet->generation !=
+        ioThreadState->addressSetGenerationArray[i])
+    {
+      ioThreadState->addressSetGenerationArray[i] = addressSet->generation;
+      setBackendNumTargets(
+        &(ioThreadState->backendBalancer),
+        i,
+        addressSet->numAddresses);
+      emptyWarmSocketPool(i, ioThreadState);
+    }
+  }
+}
+
+static void handleNewClientSocket(
+  int clientSocket,
+  const struct CompactAddress* clientAddress,
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  if (!setupClientSocket(
+        clientSocket,
+        proxySettings))
+  {
+    signalSafeClose(clientSocket);
+  }
+  else
+  {
+    struct BackendBalancer* backendBalancer =
+      &(ioThreadState->backendBalancer);
+    struct RemoteTarget remoteTarget;
+    int warmSocket;
+    struct RemoteSocketResult remoteSocketResult;
+
+    chooseRemoteTarget(&remoteTarget, ioThreadState);
+    warmSocket = takeWarmSocket(&remoteTarget, ioThreadState);
+    if (warmSocket >= 0)
+    {
+      remoteSocketResult.status = REMOTE_SOCKET_CONNECTED;
+      remoteSocketResult.remoteSocket = warmSocket;
+    }
+    else
+    {
+      remoteSocketResult =
+        connectToRemoteTarget(&remoteTarget, ioThreadState);
+    }
+    if (remoteSocketResult.status == REMOTE_SOCKET_ERROR)
+    {
+      signalSafeClose(clientSocket);
+    }
+    else
+    {
+      struct Session* session =
+        getBufferFromBufferPool(&(ioThreadState->sessionPool));
+      struct ConnectionSocketInfo* connInfo1 = &(session->clientToProxy);
+      struct ConnectionSocketInfo* connInfo2 = &(session->proxyToRemote);
+
+      session->numDestroyedConnections = 0;
+      session->remoteTarget = remoteTarget;
+      session->raceSocketInfo.pollDataType = RACE_SOCKET_POLL_DATA;
+      session->raceSocketInfo.socket = -1;
+      session->raceSocketInfo.started = false;
+      session->nextDestroyedSession = NULL;
+      initializeTimerWheelTimer(&(session->sessionTimer));
+
+      initializeConnectionSocketInfo(
+        connInfo1,
+        &(session->clientToProxyColdInfo),
+        CLIENT_TO_PROXY_POLL_DATA,
+        clientSocket,
+        connInfo2,
+        ioThreadState);
+      if (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED)
+      {
+        connInfo1->waitingForRead = true;
+      }
+      session->clientToProxyColdInfo.clientAddress = *clientAddress;
+
+      initializeConnectionSocketInfo(
+        connInfo2,
+        &(session->proxyToRemoteColdInfo),
+        PROXY_TO_REMOTE_POLL_DATA,
+        remoteSocketResult.remoteSocket,
+        connInfo1,
+        ioThreadState);
+      if (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED)
+      {
+        connInfo2->waitingForRead = true;
+      }
+      else if (remoteSocketResult.status == REMOTE_SOCKET_IN_PROGRESS)
+      {
+        connInfo2->waitingForConnect = true;
+      }
+      setCompactAddress(
+        &(session->proxyToRemoteColdInfo.serverAddress),
+        getRemoteTargetAddress(&remoteTarget, ioThreadState)->ai_addr);
+
+      if ((!setupWaitingToWritePipe(connInfo1, proxySettings)) ||
+          (!setupWaitingToWritePipe(connInfo2, proxySettings)))
+      {
+        closeWaitingToWritePipe(connInfo1);
+        closeWaitingToWritePipe(connInfo2);
+        freeSession(session, ioThreadState);
+        signalSafeClose(clientSocket);
+        signalSafeClose(remoteSocketResult.remoteSocket);
+      }
+      else
+      {
+        logConnectionDebug("connect client to proxy", connInfo1);
+        logConnectionDebug(
+          ((warmSocket >= 0) ?
+           "warm connect proxy to remote" :
+           (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED) ?
+           "connect complete proxy to remote" :
+           "connect starting proxy to remote"),
+          connInfo2);
+        addConnectionSocketInfoToPollState(ioThreadState, connInfo1);
+        addConnectionSocketInfoToPollState(ioThreadState, connInfo2);
+        updateSessionTimer(session, ioThreadState);
+        addBackendOutstanding(backendBalancer, remoteTarget.backendIndex);
+        if ((warmSocket < 0) &&
+            (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED))
+        {
+          recordBackendConnectSuccess(
+            backendBalancer,
+            remoteTarget.backendIndex,
+            remoteTarget.targetIndex,
+            0,
+            getCachedMonotonicTimeMillis());
+        }
+      }
+    }
+  }
+}
+
+static void printDisconnectMessage(
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  logConnectionDebug(
+    ((connectionSocketInfo->pollDataType == CLIENT_TO_PROXY_POLL_DATA) ?
+     "disconnect client to proxy" :
+     "disconnect proxy to remote"),
+    connectionSocketInfo);
+}
+
+/* Closes the connect racing the remote connect of session, if
+   there is one. */
+static void closeRaceSocket(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  struct RaceSocketInfo* raceSocketInfo = &(session->raceSocketInfo);
+  if (raceSocketInfo->socket >= 0)
+  {
+    removePollFDFromPollState(
+      &(ioThreadState->pollState),
+      raceSocketInfo->socket);
+    signalSafeClose(raceSocketInfo->socket);
+    raceSocketInfo->socket = -1;
+  }
+}
+
+/* After the I/O thread adopted a new address set for the backend of
+   a session that is connecting, finds the address being connected
+   to in the new set.  The racing connect is closed, since its
+   address may be gone. */
+static void updateRemoteTarget(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  struct RemoteTarget* remoteTarget = &(session->remoteTarget);
+  const struct BackendAddressSet* addressSet =
+    getBackendAddressSet(ioThreadState, remoteTarget->backendIndex);
+  size_t i;
+
+  if (remoteTarget->addressSetGeneration == addressSet->generation)
+  {
+    return;
+  }
+
+  remoteTarget->addressSetGeneration = addressSet->generation;
+  remoteTarget->targetIndex = NO_TARGET_INDEX;
+  for (i = 0; i < addressSet->numAddresses; ++i)
+  {
+    struct CompactAddress address;
+    /* Compact addresses are zeroed before being set. */
+    setCompactAddress(&address, addressSet->addressArray[i]->ai_addr);
+    if (memcmp(&address,
+               &(session->proxyToRemoteColdInfo.serverAddress),
+               sizeof(struct CompactAddress)) == 0)
+    {
+      remoteTarget->targetIndex = i;
+      break;
+    }
+  }
+  closeRaceSocket(session, ioThreadState);
+  session->raceSocketInfo.started = false;
+}
+
+/* Once both sides of session are destroyed and no operation started
+   with completion io is still in flight, adds session to the list of
+   sessions to free.  In flight sends read from its relay buffers. */
+static void addToDestroyedSessionListIfDone(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  if ((session->numDestroyedConnections == 2) &&
+      (!(session->clientToProxy.completionIOFlags)) &&
+      (!(session->proxyToRemote.completionIOFlags)))
+  {
+    session->nextDestroyedSession = ioThreadState->destroyedSessionList;
+    ioThreadState->destroyedSessionList = session;
+  }
+}
+
+static void destroyConnection(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct PollState* pollState = &(ioThreadState->pollState);
+  const int socket = connectionSocketInfo->socket;
+  struct Session* session = getSession(connectionSocketInfo);
+  struct ConnectionSocketInfo* relatedConnectionSocketInfo =
+    connectionSocketInfo->relatedConnectionSocketInfo;
+
+  printDisconnectMessage(connectionSocketInfo);
+  closeWaitingToWritePipe(connectionSocketInfo);
+  removePollFDFromPollState(pollState, socket);
+  /* Operations in flight keep the socket open until they complete. */
+  if (connectionSocketInfo->completionIOFlags & RECV_IN_FLIGHT)
+  {
+    cancelCompletionIO(pollState, connectionSocketInfo, COMPLETED_RECV);
+  }
+  if (connectionSocketInfo->completionIOFlags & SEND_IN_FLIGHT)
+  {
+    cancelCompletionIO(pollState, connectionSocketInfo, COMPLETED_SEND);
+  }
+  signalSafeClose(socket);
+  if (connectionSocketInfo->pollDataType == PROXY_TO_REMOTE_POLL_DATA)
+  {
+    closeRaceSocket(session, ioThreadState);
+    removeBackendOutstanding(
+      &(ioThreadState->backendBalancer),
+      session->remoteTarget.backendIndex);
+  }
+
+  connectionSocketInfo->destroyed = true;
+  connectionSocketInfo->relatedConnectionSocketInfo = NULL;
+  ++(session->numDestroyedConnections);
+  if (session->numDestroyedConnections == 2)
+  {
+    removeTimerFromTimerWheel(
+      &(ioThreadState->sessionTimerWheel),
+      &(session->sessionTimer));
+    addToDestroyedSessionListIfDone(session, ioThreadState);
+  }
+
+  if (relatedConnectionSocketInfo)
+  {
+    relatedConnectionSocketInfo->relatedConnectionSocketInfo = NULL;
+    if (relatedConnectionSocketInfo->waitingForWrite)
+    {
+      relatedConnectionSocketInfo->disconnectWhenWriteFinishes = true;
+      relatedConnectionSocketInfo->waitingForRead = false;
+      updatePollStateForConnectionSocketInfo(
+        ioThreadState, relatedConnectionSocketInfo);
+      if (relatedConnectionSocketInfo->completionIOFlags & RECV_IN_FLIGHT)
+      {
+        cancelCompletionIO(
+          pollState, relatedConnectionSocketInfo, COMPLETED_RECV);
+      }
+      /* The drain timeout counts from now. */
+      recordConnectionActivity(relatedConnectionSocketInfo);
+      updateSessionTimer(session, ioThreadState);
+    }
+    else
+    {
+      destroyConnection(
+        relatedConnectionSocketInfo,
+        ioThreadState);
+    }
+  }
+}
+
+/* Closes the remote socket of session and continues with
+   remoteSocket, which connects to remoteTarget of session and has
+   not been added to the poll state. */
+static void replaceRemoteSocket(
+  struct Session* session,
+  int remoteSocket,
+  bool connected,
+  struct IOThreadState* ioThreadState)
+{
+  struct PollState* pollState = &(ioThreadState->pollState);
+  struct ConnectionSocketInfo* clientToProxy = &(session->clientToProxy);
+  struct ConnectionSocketInfo* proxyToRemote = &(session->proxyToRemote);
+
+  removePollFDFromPollState(pollState, proxyToRemote->socket);
+  signalSafeClose(proxyToRemote->socket);
+  proxyToRemote->socket = remoteSocket;
+  proxyToRemote->socketReadable = false;
+  proxyToRemote->socketWritable = false;
+  session->proxyToRemoteColdInfo.clientAddress.family = AF_UNSPEC;
+  setCompactAddress(
+    &(session->proxyToRemoteColdInfo.serverAddress),
+    getRemoteTargetAddress(
+      &(session->remoteTarget),
+      ioThreadState)->ai_addr);
+  if (connected)
+  {
+    proxyToRemote->waitingForConnect = false;
+    proxyToRemote->waitingForRead = true;
+    clientToProxy->waitingForRead = true;
+    updatePollStateForConnectionSocketInfo(ioThreadState, clientToProxy);
+  }
+  addConnectionSocketInfoToPollState(ioThreadState, proxyToRemote);
+  logConnectionDebug(
+    (connected ?
+     "connect complete proxy to remote" :
+     "connect retrying proxy to remote"),
+    proxyToRemote);
+
+  /* A new connect may race this one, and the connect timeout
+     counts from now. */
+  session->raceSocketInfo.started = false;
+  recordConnectionActivity(proxyToRemote);
+  updateSessionTimer(session, ioThreadState);
+}
+
+/* After the remote connect of session failed, records the failure
+   and continues with the racing connect, or else connects to the
+   next target while the client waits.  Returns false if there is no
+   target left to try. */
+static bool retryRemoteConnect(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  struct BackendBalancer* backendBalancer =
+    &(ioThreadState->backendBalancer);
+  struct RemoteTarget* remoteTarget = &(session->remoteTarget);
+  struct RaceSocketInfo* raceSocketInfo = &(session->raceSocketInfo);
+  const size_t oldBackendIndex = remoteTarget->backendIndex;
+  struct RemoteSocketResult remoteSocketResult;
+
+  updateRemoteTarget(session, ioThreadState);
+  if (remoteTarget->targetIndex != NO_TARGET_INDEX)
+  {
+    recordBackendConnectFailure(
+      backendBalancer,
+      remoteTarget->backendIndex,
+      remoteTarget->targetIndex,
+      getCachedMonotonicTimeMillis());
+  }
+
+  if (raceSocketInfo->socket >= 0)
+  {
+    const int raceSocket = raceSocketInfo->socket;
+    removePollFDFromPollState(&(ioThreadState->pollState), raceSocket);
+    raceSocketInfo->socket = -1;
+    remoteTarget->targetIndex = raceSocketInfo->targetIndex;
+    replaceRemoteSocket(session, raceSocket, false, ioThreadState);
+    return true;
+  }
+
+  if (!chooseNextRemoteTarget(remoteTarget, ioThreadState))
+  {
+    return false;
+  }
+  remoteSocketResult = connectToRemoteTarget(remoteTarget, ioThreadState);
+  if (remoteSocketResult.status == REMOTE_SOCKET_ERROR)
+  {
+    return false;
+  }
+
+  removeBackendOutstanding(backendBalancer, oldBackendIndex);
+  addBackendOutstanding(backendBalancer, remoteTarget->backendIndex);
+  if (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED)
+  {
+    recordBackendConnectSuccess(
+      backendBalancer,
+      remoteTarget->backendIndex,
+      remoteTarget->targetIndex,
+      0,
+      getCachedMonotonicTimeMillis());
+  }
+  replaceRemoteSocket(
+    session,
+    remoteSocketResult.remoteSocket,
+    (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED),
+    ioThreadState);
+  return true;
+}
+
+/* Starts a connect to the next usable address of the session's
+   backend, racing the remote connect that has not completed. */
+static void startRaceConnect(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  const struct ProxySettings* proxySettings =
+    ioThreadState->proxySettings;
+  struct BackendBalancer* backendBalancer =
+    &(ioThreadState->backendBalancer);
+  struct RemoteTarget* remoteTarget = &(session->remoteTarget);
+  struct RaceSocketInfo* raceSocketInfo = &(session->raceSocketInfo);
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  size_t targetIndex;
+  struct RemoteSocketResult remoteSocketResult;
+
+  raceSocketInfo->started = true;
+  if ((remoteTarget->numConnectAttempts >= MAX_CONNECT_ATTEMPTS) ||
+      (!getNextTargetOfBackend(remoteTarget, &targetIndex, ioThreadState)))
+  {
+    return;
+  }
+
+  ++(remoteTarget->numConnectAttempts);
+  remoteSocketResult =
+    createRemoteSocket(
+      getBackendAddressSet(
+        ioThreadState,
+        remoteTarget->backendIndex)->addressArray[targetIndex],
+      proxySettings);
+  if (remoteSocketResult.status == REMOTE_SOCKET_ERROR)
+  {
+    recordBackendConnectFailure(
+      backendBalancer,
+      remoteTarget->backendIndex,
+      targetIndex,
+      nowMillis);
+    return;
+  }
+
+  raceSocketInfo->socket = remoteSocketResult.remoteSocket;
+  raceSocketInfo->targetIndex = targetIndex;
+  raceSocketInfo->startMillis = nowMillis;
+  proxyLogDebug("racing remote connect fd %d with fd %d",
+                session->proxyToRemote.socket,
+                raceSocketInfo->socket);
+
+  /* Waits for write even if the connect completed at once, so a
+     race is always won in handleRaceSocketReady. */
+  addPollFDToPollState(
+    &(ioThreadState->pollState),
+    raceSocketInfo->socket,
+    raceSocketInfo,
+    NOT_INTERESTED_IN_READ_EVENTS,
+    INTERESTED_IN_WRITE_EVENTS);
+}
+
+static void handleRaceSocketReady(
+  struct RaceSocketInfo* raceSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct Session* session = getRaceSession(raceSocketInfo);
+  struct BackendBalancer* backendBalancer =
+    &(ioThreadState->backendBalancer);
+  struct RemoteTarget* remoteTarget = &(session->remoteTarget);
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  int raceSocket;
+  int socketError;
+
+  updateRemoteTarget(session, ioThreadState);
+  raceSocket = raceSocketInfo->socket;
+  /* Closed earlier while handling the same poll result, or by
+     updateRemoteTarget. */
+  if (raceSocket < 0)
+  {
+    return;
+  }
+
+  socketError = getSocketError(raceSocket);
+  if (socketError == EINPROGRESS)
+  {
+    return;
+  }
+
+  removePollFDFromPollState(&(ioThreadState->pollState), raceSocket);
+  raceSocketInfo->socket = -1;
+  if (socketError == 0)
+  {
+    /* The racing connect won, the other one is closed. */
+    remoteTarget->targetIndex = raceSocketInfo->targetIndex;
+    recordBackendConnectSuccess(
+      backendBalancer,
+      remoteTarget->backendIndex,
+      remoteTarget->targetIndex,
+      nowMillis - raceSocketInfo->startMillis,
+      nowMillis);
+    replaceRemoteSocket(session, raceSocket, true, ioThreadState);
+  }
+  else
+  {
+    char* socketErrorString = errnoToString(socketError);
+    proxyLog("async remote racing connect fd %d errno %d: %s",
+             raceSocket,
+             socketError,
+             socketErrorString);
+    free(socketErrorString);
+    recordBackendConnectFailure(
+      backendBalancer,
+      remoteTarget->backendIndex,
+      raceSocketInfo->targetIndex,
+      nowMillis);
+    signalSafeClose(raceSocket);
+  }
+}
+
+/* Destroys both sides of a session that reached its deadline,
+   dropping any bytes still waiting to be written. */
+static void timeOutSession(
+  struct Session* session,
+  struct IOThreadState* ioThreadState)
+{
+  struct ConnectionSocketInfo* clientToProxy = &(session->clientToProxy);
+  struct ConnectionSocketInfo* proxyToRemote = &(session->proxyToRemote);
+
+  if (clientToProxy->destroyed || proxyToRemote->destroyed)
+  {
+    logConnectionDebug(
+      "drain timeout",
+      ((clientToProxy->destroyed) ? proxyToRemote : clientToProxy));
+  }
+  else if (proxyToRemote->waitingForConnect)
+  {
+    const int64_t nowMillis = getCachedMonotonicTimeMillis();
+    updateRemoteTarget(session, ioThreadState);
+    if (raceConnectPending(session, ioThreadState) &&
+        ((getLastActivityMillis(proxyToRemote, nowMillis) +
+          HAPPY_EYEBALLS_DELAY_MILLIS) <= nowMillis))
+    {
+      startRaceConnect(session, ioThreadState);
+      updateSessionTimer(session, ioThreadState);
+      return;
+    }
+    proxyLog("async remote connect fd %d timed out",
+             proxyToRemote->socket);
+    if (retryRemoteConnect(session, ioThreadState))
+    {
+      return;
+    }
+  }
+  else
+  {
+    logConnectionDebug("idle timeout", clientToProxy);
+  }
+
+  /* Unlink the sides so neither is left draining. */
+  clientToProxy->relatedConnectionSocketInfo = NULL;
+  proxyToRemote->relatedConnectionSocketInfo = NULL;
+  if (!(clientToProxy->destroyed))
+  {
+    destroyConnection(clientToProxy, ioThreadState);
+  }
+  if (!(proxyToRemote->destroyed))
+  {
+    destroyConnection(proxyToRemote, ioThreadState);
+  }
+}
+
+static void handleExpiredSessionTimers(
+  struct IOThreadState* ioThreadState)
+{
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  struct TimerWheelTimer* sessionTimer =
+    expireTimerWheelTimers(&(ioThreadState->sessionTimerWheel), nowMillis);
+
+  while (sessionTimer)
+  {
+    struct TimerWheelTimer* nextSessionTimer = sessionTimer->next;
+    struct Session* session = (struct Session*)
+      (((char*)sessionTimer) - offsetof(struct Session, sessionTimer));
+    const int64_t deadlineMillis =
+      getSessionDeadlineMillis(
+        session,
+        ioThreadState,
+        nowMillis);
+
+    if (deadlineMillis > nowMillis)
+    {
+      /* Activity since the timer was added moved the deadline. */
+      addTimerToTimerWheel(
+        &(ioThreadState->sessionTimerWheel),
+        sessionTimer,
+        deadlineMillis);
+    }
+    else if (deadlineMillis >= 0)
+    {
+      timeOutSession(session, ioThreadState);
+    }
+
+    sessionTimer = nextSessionTimer;
+  }
+}
+
+static void freeDestroyedSessions(
+  struct IOThreadState* ioThreadState)
+{
+  while (ioThreadState->destroyedSessionList)
+  {
+    struct Session* session = ioThreadState->destroyedSessionList;
+    ioThreadState->destroyedSessionList = session->nextDestroyedSession;
+    freeSession(session, ioThreadState);
+  }
+}
+
+static struct ConnectionSocketInfo* handleConnectionReadyForError(
+  struct ConnectionSocketInfo* connectionSocketInfo)
+{
+  struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
+  const int socketError = getSocketError(connectionSocketInfo->socket);
+  if (socketError != 0)
+  {
+    char* socketErrorString = errnoToString(socketError);
+
+    pDisconnectSocketInfo = connectionSocketInfo;
+
+    proxyLog("fd %d errno %d: %s",
+             connectionSocketInfo->socket,
+             socketError,
+             socketErrorString);
+
+    free(socketErrorString);
+  }
+
+  return pDisconnectSocketInfo;
+}
+
+static bool relayUsesSplicePipes(
+  const struct IOThreadState* ioThreadState)
+{
+#ifdef PROXY_SPLICE_SUPPORTED
+  return ioThreadState->proxySettings->spliceRelay;
+#else
+  return false;
+#endif
+}
+
+/* Relay buffers are only held while they have bytes waiting to be
+   written.  The pool is LIFO, so the buffer attached next is the one
+   most recently released, which is still in cache.  For a session
+   whose peer keeps up, the same buffer is reused like a per-thread
+   scratch area. */
+static void attachWaitingToWriteBuffer(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct RingBuffer* waitingToWriteBuffer =
+    &(connectionSocketInfo->waitingToWriteBuffer);
+  if (!(waitingToWriteBuffer->buffer))
+  {
+    waitingToWriteBuffer->buffer =
+      getBufferFromBufferPool(
+        getRelayBufferPool(connectionSocketInfo, ioThreadState));
+    waitingToWriteBuffer->readOffset = 0;
+  }
+}
+
+static void releaseWaitingToWriteBufferIfEmpty(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct RingBuffer* waitingToWriteBuffer =
+    &(connectionSocketInfo->waitingToWriteBuffer);
+  if (waitingToWriteBuffer->buffer &&
+      ringBufferIsEmpty(waitingToWriteBuffer))
+  {
+    returnBufferToBufferPool(
+      getRelayBufferPool(connectionSocketInfo, ioThreadState),
+      waitingToWriteBuffer->buffer);
+    waitingToWriteBuffer->buffer = NULL;
+
+    /* Shrinking only happens here so no bytes need to be copied. */
+    if ((connectionSocketInfo->numSmallReads >=
+         SHRINK_RELAY_BUFFER_AFTER_SMALL_READS) &&
+        (connectionSocketInfo->relayBufferSizeClass > 0))
+    {
+      --(connectionSocketInfo->relayBufferSizeClass);
+      connectionSocketInfo->numSmallReads = 0;
+      waitingToWriteBuffer->capacity =
+        getRelayBufferSize(
+          ioThreadState->proxySettings->bufferSize,
+          connectionSocketInfo->relayBufferSizeClass);
+    }
+  }
+}
+
+/* Grow the relay buffer of connectionSocketInfo one size class,
+   copying the bytes waiting in it, once enough reads in a row filled
+   it.  A buffer a send started with completion io reads from cannot
+   move, so it grows when the send completes. */
+static void growWaitingToWriteBufferIfFilled(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  if ((connectionSocketInfo->numFullReads >=
+       GROW_RELAY_BUFFER_AFTER_FULL_READS) &&
+      ((size_t)(connectionSocketInfo->relayBufferSizeClass + 1) <
+       ioThreadState->numRelayBufferSizeClasses) &&
+      (!(connectionSocketInfo->completionIOFlags & SEND_IN_FLIGHT)))
+  {
+    struct BufferPool* oldRelayBufferPool =
+      getRelayBufferPool(connectionSocketInfo, ioThreadState);
+    void* oldBuffer;
+
+    ++(connectionSocketInfo->relayBufferSizeClass);
+    connectionSocketInfo->numFullReads = 0;
+    oldBuffer =
+      moveRingBuffer(
+        &(connectionSocketInfo->waitingToWriteBuffer),
+        getBufferFromBufferPool(
+          getRelayBufferPool(connectionSocketInfo, ioThreadState)),
+        getRelayBufferSize(
+          ioThreadState->proxySettings->bufferSize,
+          connectionSocketInfo->relayBufferSizeClass));
+    returnBufferToBufferPool(oldRelayBufferPool, oldBuffer);
+  }
+}
+
+/* Adapt the size class of the relay buffer of connectionSocketInfo
+   after bytesRead bytes were read into it.  Small reads that fill
+   the buffer only top up space freed by a slow writer, so they do
+   not count toward growing.  Grows the buffer right away if it can,
+   since a full buffer stops reading from the peer. */
+static void adaptWaitingToWriteBufferSize(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  size_t bytesRead,
+  struct IOThreadState* ioThreadState)
+{
+  struct RingBuffer* waitingToWriteBuffer =
+    &(connectionSocketInfo->waitingToWriteBuffer);
+
+  if (ringBufferIsFull(waitingToWriteBuffer) &&
+      (bytesRead >= (waitingToWriteBuffer->capacity / 2)))
+  {
+    connectionSocketInfo->numSmallReads = 0;
+    if (connectionSocketInfo->numFullReads <
+        GROW_RELAY_BUFFER_AFTER_FULL_READS)
+    {
+      ++(connectionSocketInfo->numFullReads);
+    }
+    growWaitingToWriteBufferIfFilled(connectionSocketInfo, ioThreadState);
+  }
+  else
   {
-    proxyLog("connect %s proxy to remote %s:%s -> %s:%s (fd=%d)",
-             ((result.status == REMOTE_SOCKET_CONNECTED) ? "complete" : "starting"),
-             proxyClientAddrPortStrings->addrString,
-             proxyClientAddrPortStrings->portString,
-             proxySettings->remoteAddrPortStrings.addrString,
-             proxySettings->remoteAddrPortStrings.portString,
-             result.remoteSocket);
+    connectionSocketInfo->numFullReads = 0;
+    if (bytesRead > (waitingToWriteBuffer->capacity / 4))
+    {
+      connectionSocketInfo->numSmallReads = 0;
+    }
+    else if (connectionSocketInfo->numSmallReads <
+             SHRINK_RELAY_BUFFER_AFTER_SMALL_READS)
+    {
+      ++(connectionSocketInfo->numSmallReads);
+    }
   }
-
-  return result;
 }
 
-static void handleNewClientSocket(
-  int clientSocket,
-  const struct ProxySettings* proxySettings,
-  struct PollState* pollState,
-  struct BufferPool* connectionSocketInfoPool)
+/* Read from fd into the free space in the waiting to write buffer
+   of writeConnectionSocketInfo. */
+static struct ReadFromFDResult readToWaitingToWriteBuffer(
+  int fd,
+  struct ConnectionSocketInfo* writeConnectionSocketInfo,
+  struct IOThreadState* ioThreadState)
 {
-  struct AddrPortStrings clientAddrPortStrings;
-  struct AddrPortStrings proxyServerAddrPortStrings;
-  struct AddrPortStrings proxyClientAddrPortStrings;
-  if (!setupClientSocket(
-        clientSocket,
-        proxySettings,
-        &clientAddrPortStrings,
-        &proxyServerAddrPortStrings))
+  struct RingBuffer* waitingToWriteBuffer =
+    &(writeConnectionSocketInfo->waitingToWriteBuffer);
+  struct ReadFromFDResult readResult;
+#ifdef PROXY_SPLICE_SUPPORTED
+  if (relayUsesSplicePipes(ioThreadState))
   {
-    signalSafeClose(clientSocket);
+    readResult =
+      spliceFromFDToPipe(
+        fd,
+        getColdInfo(writeConnectionSocketInfo)->waitingToWritePipeWriteFD,
+        waitingToWriteBuffer->capacity - waitingToWriteBuffer->size);
+    if (readResult.status == READ_FROM_FD_SUCCESS)
+    {
+      waitingToWriteBuffer->size += readResult.bytesRead;
+    }
   }
   else
+#endif
   {
-    const struct RemoteSocketResult remoteSocketResult =
-      createRemoteSocket(proxySettings,
-                         &proxyClientAddrPortStrings);
-    if (remoteSocketResult.status == REMOTE_SOCKET_ERROR)
-    {
-      signalSafeClose(clientSocket);
-    }
-    else
+    attachWaitingToWriteBuffer(writeConnectionSocketInfo, ioThreadState);
+    readResult = readFromFDToRingBuffer(fd, waitingToWriteBuffer);
+    if (readResult.status == READ_FROM_FD_SUCCESS)
     {
-      struct ConnectionSocketInfo* connInfo1;
-      struct ConnectionSocketInfo* connInfo2;
-
-      connInfo1 = getBufferFromBufferPool(connectionSocketInfoPool);
-      connInfo1->socket = clientSocket;
-      connInfo1->type = CLIENT_TO_PROXY;
-      connInfo1->waitingToWriteBufferOffset = 0;
-      connInfo1->waitingToWriteBufferSize = 0;
-      connInfo1->waitingToWriteBufferCapacity = proxySettings->bufferSize;
-      connInfo1->disconnectWhenWriteFinishes = false;
-      if (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED)
-      {
-        connInfo1->waitingForConnect = false;
-        connInfo1->waitingForRead = true;
-        connInfo1->waitingForWrite = false;
-      }
-      else if (remoteSocketResult.status == REMOTE_SOCKET_IN_PROGRESS)
-      {
-        connInfo1->waitingForConnect = false;
-        connInfo1->waitingForRead = false;
-        connInfo1->waitingForWrite = false;
-      }
-      memcpy(&(connInfo1->clientAddrPortStrings),
-             &clientAddrPortStrings,
-             sizeof(struct AddrPortStrings));
-      memcpy(&(connInfo1->serverAddrPortStrings),
-             &proxyServerAddrPortStrings,
-             sizeof(struct AddrPortStrings));
-
-      connInfo2 = getBufferFromBufferPool(connectionSocketInfoPool);
-      connInfo2->socket = remoteSocketResult.remoteSocket;
-      connInfo2->type = PROXY_TO_REMOTE;
-      connInfo2->waitingToWriteBufferOffset = 0;
-      connInfo2->waitingToWriteBufferSize = 0;
-      connInfo2->waitingToWriteBufferCapacity = proxySettings->bufferSize;
-      connInfo2->disconnectWhenWriteFinishes = false;
-      if (remoteSocketResult.status == REMOTE_SOCKET_CONNECTED)
-      {
-        connInfo2->waitingForConnect = false;
-        connInfo2->waitingForRead = true;
-        connInfo2->waitingForWrite = false;
-      }
-      else if (remoteSocketResult.status == REMOTE_SOCKET_IN_PROGRESS)
-      {
-        connInfo2->waitingForConnect = true;
-        connInfo2->waitingForRead = false;
-        connInfo2->waitingForWrite = false;
-      }
-      memcpy(&(connInfo2->clientAddrPortStrings),
-             &proxyClientAddrPortStrings,
-             sizeof(struct AddrPortStrings));
-      memcpy(&(connInfo2->serverAddrPortStrings),
-             &(proxySettings->remoteAddrPortStrings),
-             sizeof(struct AddrPortStrings));
-
-      connInfo1->relatedConnectionSocketInfo = connInfo2;
-      connInfo2->relatedConnectionSocketInfo = connInfo1;
-
-      addConnectionSocketInfoToPollState(pollState, connInfo1);
-      addConnectionSocketInfoToPollState(pollState, connInfo2);
+      adaptWaitingToWriteBufferSize(
+        writeConnectionSocketInfo,
+        readResult.bytesRead,
+        ioThreadState);
     }
+    releaseWaitingToWriteBufferIfEmpty(writeConnectionSocketInfo,
+                                       ioThreadState);
   }
+  return readResult;
 }
 
-static void printDisconnectMessage(
-  const struct ConnectionSocketInfo* connectionSocketInfo)
-{
-  proxyLog("disconnect %s %s:%s -> %s:%s (fd=%d)",
-           ((connectionSocketInfo->type == CLIENT_TO_PROXY) ?
-            "client to proxy" :
-            "proxy to remote"),
-           connectionSocketInfo->clientAddrPortStrings.addrString,
-           connectionSocketInfo->clientAddrPortStrings.portString,
-           connectionSocketInfo->serverAddrPortStrings.addrString,
-           connectionSocketInfo->serverAddrPortStrings.portString,
-           connectionSocketInfo->socket);
+/* Write from the waiting to write buffer of connectionSocketInfo
+   to its socket. */
+static struct WriteToFDResult writeFromWaitingToWriteBuffer(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct RingBuffer* waitingToWriteBuffer =
+    &(connectionSocketInfo->waitingToWriteBuffer);
+#ifdef PROXY_SPLICE_SUPPORTED
+  if (relayUsesSplicePipes(ioThreadState))
+  {
+    const struct WriteToFDResult writeResult =
+      spliceFromPipeToFD(
+        getColdInfo(connectionSocketInfo)->waitingToWritePipeReadFD,
+        connectionSocketInfo->socket,
+        waitingToWriteBuffer->size);
+    if (writeResult.status == WRITE_TO_FD_SUCCESS)
+    {
+      waitingToWriteBuffer->size -= writeResult.bytesWritten;
+    }
+    return writeResult;
+  }
+#endif
+  return writeFromRingBufferToFD(
+    connectionSocketInfo->socket,
+    waitingToWriteBuffer);
 }
 
-static void destroyConnection(
+/* Write the waiting to write buffer of connectionSocketInfo until
+   it is empty or the socket would block.  Starts waiting for write
+   if the socket would block.  Returns connectionSocketInfo on write
+   error, otherwise NULL. */
+static struct ConnectionSocketInfo* writeWaitingToWriteBuffer(
   struct ConnectionSocketInfo* connectionSocketInfo,
-  struct PollState* pollState,
-  struct BufferPool* connectionSocketInfoPool)
+  struct IOThreadState* ioThreadState)
 {
-  const int socket = connectionSocketInfo->socket;
-  struct ConnectionSocketInfo* relatedConnectionSocketInfo =
-    connectionSocketInfo->relatedConnectionSocketInfo;
-
-  printDisconnectMessage(connectionSocketInfo);
-  returnBufferToBufferPool(connectionSocketInfoPool, connectionSocketInfo);
-  removePollFDFromPollState(pollState, socket);
-  signalSafeClose(socket);
+  struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
+  bool writeWouldBlock = false;
 
-  if (relatedConnectionSocketInfo)
+  while ((!ringBufferIsEmpty(&(connectionSocketInfo->waitingToWriteBuffer))) &&
+         (!pDisconnectSocketInfo) &&
+         (!writeWouldBlock))
   {
-    relatedConnectionSocketInfo->relatedConnectionSocketInfo = NULL;
-    if (relatedConnectionSocketInfo->waitingForWrite)
+    const struct WriteToFDResult writeResult =
+      writeFromWaitingToWriteBuffer(connectionSocketInfo, ioThreadState);
+    if (writeResult.status == WRITE_TO_FD_WOULD_BLOCK)
     {
-      relatedConnectionSocketInfo->disconnectWhenWriteFinishes = true;
-      relatedConnectionSocketInfo->waitingForRead = false;
-      updatePollStateForConnectionSocketInfo(
-        pollState, relatedConnectionSocketInfo);
+      writeWouldBlock = true;
+      connectionSocketInfo->socketWritable = false;
+    }
+    else if (writeResult.status == WRITE_TO_FD_ERROR)
+    {
+      pDisconnectSocketInfo = connectionSocketInfo;
     }
     else
     {
-      destroyConnection(
-        relatedConnectionSocketInfo,
-        pollState,
-        connectionSocketInfoPool);
+      recordConnectionActivity(connectionSocketInfo);
     }
   }
-}
-
-static struct ConnectionSocketInfo* handleConnectionReadyForError(
-  struct ConnectionSocketInfo* connectionSocketInfo)
-{
-  struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
-  const int socketError = getSocketError(connectionSocketInfo->socket);
-  if (socketError != 0)
-  {
-    char* socketErrorString = errnoToString(socketError);
 
-    pDisconnectSocketInfo = connectionSocketInfo;
-
-    proxyLog("fd %d errno %d: %s",
-             connectionSocketInfo->socket,
-             socketError,
-             socketErrorString);
+  releaseWaitingToWriteBufferIfEmpty(connectionSocketInfo, ioThreadState);
 
-    free(socketErrorString);
+  if (writeWouldBlock && (!(connectionSocketInfo->waitingForWrite)))
+  {
+    connectionSocketInfo->waitingForWrite = true;
+    updatePollStateForConnectionSocketInfo(ioThreadState, connectionSocketInfo);
   }
 
   return pDisconnectSocketInfo;
@@ -743,7 +3015,7 @@ static struct ConnectionSocketInfo* handleConnectionReadyForError(
 
 static struct ConnectionSocketInfo* handleConnectionReadyForRead(
   struct ConnectionSocketInfo* connectionSocketInfo,
-  struct PollState* pollState)
+  struct IOThreadState* ioThreadState)
 {
   struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
   struct ConnectionSocketInfo* relatedConnectionSocketInfo =
@@ -751,67 +3023,77 @@ static struct ConnectionSocketInfo* handleConnectionReadyForRead(
 
   if (connectionSocketInfo->waitingForRead)
   {
+    const struct RingBuffer* relatedWaitingToWriteBuffer;
     bool readWouldBlock = false;
-    bool writeWouldBlock = false;
+    bool bufferFull = false;
     int numReads = 0;
 
     assert(relatedConnectionSocketInfo != NULL);
 
+    relatedWaitingToWriteBuffer =
+      &(relatedConnectionSocketInfo->waitingToWriteBuffer);
+
+    /* Keep reading into free space while earlier bytes are still
+       waiting to be written; only stop reading when the peer's
+       buffer is full. */
     while ((!pDisconnectSocketInfo) &&
            (!readWouldBlock) &&
-           (!writeWouldBlock) &&
+           (!bufferFull) &&
            (numReads < MAX_OPERATIONS_FOR_ONE_FD))
     {
-      const struct ReadFromFDResult readResult = readFromFD(
-        connectionSocketInfo->socket,
-        relatedConnectionSocketInfo->waitingToWriteBuffer,
-        relatedConnectionSocketInfo->waitingToWriteBufferCapacity);
-      ++numReads;
-      if (readResult.status == READ_FROM_FD_WOULD_BLOCK)
-      {
-        readWouldBlock = true;
-      }
-      else if ((readResult.status == READ_FROM_FD_ERROR) ||
-               (readResult.status == READ_FROM_FD_EOF))
+      if (ringBufferIsFull(relatedWaitingToWriteBuffer))
       {
-        pDisconnectSocketInfo = connectionSocketInfo;
+        bufferFull = true;
       }
       else
       {
-        relatedConnectionSocketInfo->waitingToWriteBufferOffset = 0;
-        relatedConnectionSocketInfo->waitingToWriteBufferSize =
-          readResult.bytesRead;
-        while ((relatedConnectionSocketInfo->waitingToWriteBufferSize > 
-                relatedConnectionSocketInfo->waitingToWriteBufferOffset) &&
-               (!pDisconnectSocketInfo) &&
-               (!writeWouldBlock))
+        const struct ReadFromFDResult readResult =
+          readToWaitingToWriteBuffer(
+            connectionSocketInfo->socket,
+            relatedConnectionSocketInfo,
+            ioThreadState);
+        ++numReads;
+        if (readResult.status == READ_FROM_FD_WOULD_BLOCK)
         {
-          const struct WriteToFDResult writeResult = writeToFD(
-            relatedConnectionSocketInfo->socket,
-            &(relatedConnectionSocketInfo->waitingToWriteBuffer[
-              relatedConnectionSocketInfo->waitingToWriteBufferOffset]),
-            relatedConnectionSocketInfo->waitingToWriteBufferSize -
-            relatedConnectionSocketInfo->waitingToWriteBufferOffset);
-          if (writeResult.status == WRITE_TO_FD_WOULD_BLOCK)
+          readWouldBlock = true;
+          /* A pipe can run out of slots before it holds its capacity
+             in bytes, so splice may block on a non-empty pipe.  Treat
+             that as full; the pending write will resume reading.
+             The socket may still be readable in that case. */
+          if (relayUsesSplicePipes(ioThreadState) &&
+              (!ringBufferIsEmpty(relatedWaitingToWriteBuffer)))
           {
-            relatedConnectionSocketInfo->waitingForWrite = true;
-            updatePollStateForConnectionSocketInfo(pollState, relatedConnectionSocketInfo);
-            connectionSocketInfo->waitingForRead = false;
-            updatePollStateForConnectionSocketInfo(pollState, connectionSocketInfo);
-            writeWouldBlock = true;
+            bufferFull = true;
           }
-          else if (writeResult.status == WRITE_TO_FD_ERROR)
+          else
           {
-            pDisconnectSocketInfo = relatedConnectionSocketInfo;
+            connectionSocketInfo->socketReadable = false;
           }
-          else
+        }
+        else if ((readResult.status == READ_FROM_FD_ERROR) ||
+                 (readResult.status == READ_FROM_FD_EOF))
+        {
+          pDisconnectSocketInfo = connectionSocketInfo;
+        }
+        else
+        {
+          recordConnectionActivity(connectionSocketInfo);
+          if (!(relatedConnectionSocketInfo->waitingForWrite))
           {
-            relatedConnectionSocketInfo->waitingToWriteBufferOffset +=
-              writeResult.bytesWritten;
+            pDisconnectSocketInfo =
+              writeWaitingToWriteBuffer(
+                relatedConnectionSocketInfo,
+                ioThreadState);
           }
         }
       }
     }
+
+    if ((!pDisconnectSocketInfo) && bufferFull)
+    {
+      connectionSocketInfo->waitingForRead = false;
+      updatePollStateForConnectionSocketInfo(ioThreadState, connectionSocketInfo);
+    }
   }
 
   return pDisconnectSocketInfo;
@@ -819,7 +3101,7 @@ static struct ConnectionSocketInfo* handleConnectionReadyForRead(
 
 static struct ConnectionSocketInfo* handleConnectionReadyForWrite(
   struct ConnectionSocketInfo* connectionSocketInfo,
-  struct PollState* pollState)
+  struct IOThreadState* ioThreadState)
 {
   struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
   struct ConnectionSocketInfo* relatedConnectionSocketInfo =
@@ -834,17 +3116,30 @@ static struct ConnectionSocketInfo* handleConnectionReadyForWrite(
     socketError = getSocketError(connectionSocketInfo->socket);
     if (socketError == 0)
     {
-      proxyLog("connect complete proxy to remote %s:%s -> %s:%s (fd=%d)",
-               connectionSocketInfo->clientAddrPortStrings.addrString,
-               connectionSocketInfo->clientAddrPortStrings.portString,
-               connectionSocketInfo->serverAddrPortStrings.addrString,
-               connectionSocketInfo->serverAddrPortStrings.portString,
-               connectionSocketInfo->socket);
+      const int64_t nowMillis = getCachedMonotonicTimeMillis();
+      struct Session* session = getSession(connectionSocketInfo);
+      const struct RemoteTarget* remoteTarget = &(session->remoteTarget);
+      logConnectionDebug("connect complete proxy to remote",
+                         connectionSocketInfo);
+      updateRemoteTarget(session, ioThreadState);
+      if (remoteTarget->targetIndex != NO_TARGET_INDEX)
+      {
+        /* Activity was last recorded when the connect started. */
+        recordBackendConnectSuccess(
+          &(ioThreadState->backendBalancer),
+          remoteTarget->backendIndex,
+          remoteTarget->targetIndex,
+          nowMillis - getLastActivityMillis(connectionSocketInfo, nowMillis),
+          nowMillis);
+      }
+      closeRaceSocket(session, ioThreadState);
       connectionSocketInfo->waitingForConnect = false;
       connectionSocketInfo->waitingForRead = true;
-      updatePollStateForConnectionSocketInfo(pollState, connectionSocketInfo);
+      updatePollStateForConnectionSocketInfo(ioThreadState, connectionSocketInfo);
       relatedConnectionSocketInfo->waitingForRead = true;
-      updatePollStateForConnectionSocketInfo(pollState, relatedConnectionSocketInfo);
+      updatePollStateForConnectionSocketInfo(ioThreadState, relatedConnectionSocketInfo);
+      recordConnectionActivity(connectionSocketInfo);
+      updateSessionTimer(getSession(connectionSocketInfo), ioThreadState);
     }
     else if (socketError == EINPROGRESS)
     {
@@ -864,33 +3159,14 @@ static struct ConnectionSocketInfo* handleConnectionReadyForWrite(
 
   else if (connectionSocketInfo->waitingForWrite)
   {
-    bool writeWouldBlock = false;
-    while ((connectionSocketInfo->waitingToWriteBufferSize > 
-            connectionSocketInfo->waitingToWriteBufferOffset) &&
-           (!pDisconnectSocketInfo) &&
-           (!writeWouldBlock))
-    {
-      const struct WriteToFDResult writeResult = writeToFD(
-        connectionSocketInfo->socket,
-        &(connectionSocketInfo->waitingToWriteBuffer[
-           connectionSocketInfo->waitingToWriteBufferOffset]),
-        connectionSocketInfo->waitingToWriteBufferSize -
-        connectionSocketInfo->waitingToWriteBufferOffset);
-      if (writeResult.status == WRITE_TO_FD_WOULD_BLOCK)
-      {
-        writeWouldBlock = true;
-      }
-      else if (writeResult.status == WRITE_TO_FD_ERROR)
-      {
-        pDisconnectSocketInfo = connectionSocketInfo;
-      }
-      else
-      {
-        connectionSocketInfo->waitingToWriteBufferOffset +=
-          writeResult.bytesWritten;
-      }
-    }
-    if ((!pDisconnectSocketInfo) && (!writeWouldBlock))
+    struct RingBuffer* waitingToWriteBuffer =
+      &(connectionSocketInfo->waitingToWriteBuffer);
+    const size_t sizeBeforeWrite = waitingToWriteBuffer->size;
+
+    pDisconnectSocketInfo =
+      writeWaitingToWriteBuffer(connectionSocketInfo, ioThreadState);
+    if ((!pDisconnectSocketInfo) &&
+        ringBufferIsEmpty(waitingToWriteBuffer))
     {
       if (connectionSocketInfo->disconnectWhenWriteFinishes)
       {
@@ -898,37 +3174,291 @@ static struct ConnectionSocketInfo* handleConnectionReadyForWrite(
       }
       else
       {
-        assert(relatedConnectionSocketInfo != NULL);
-
-        connectionSocketInfo->waitingToWriteBufferOffset = 0;
-        connectionSocketInfo->waitingToWriteBufferSize = 0;
         connectionSocketInfo->waitingForWrite = false;
-        updatePollStateForConnectionSocketInfo(pollState, connectionSocketInfo);
-        relatedConnectionSocketInfo->waitingForRead = true;
-        updatePollStateForConnectionSocketInfo(pollState, relatedConnectionSocketInfo);
+        updatePollStateForConnectionSocketInfo(ioThreadState, connectionSocketInfo);
       }
     }
+
+    /* Writing freed space in the buffer, so resume reading
+       from the peer if it stopped because the buffer was full. */
+    if ((!pDisconnectSocketInfo) &&
+        (waitingToWriteBuffer->size < sizeBeforeWrite) &&
+        relatedConnectionSocketInfo &&
+        (!(relatedConnectionSocketInfo->waitingForRead)))
+    {
+      relatedConnectionSocketInfo->waitingForRead = true;
+      updatePollStateForConnectionSocketInfo(ioThreadState, relatedConnectionSocketInfo);
+    }
   }
 
   return pDisconnectSocketInfo;
 }
 
-enum HandleConnectionReadyResult
+/* With edge triggered poll, add connectionSocketInfo to the pending
+   ready list if its socket is known to be ready for an operation it
+   is waiting for, since poll will not report that readiness again. */
+static void addToPendingReadyListIfReady(
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
 {
-  POLL_STATE_INVALIDATED_RESULT,
-  POLL_STATE_NOT_INVALIDATED_RESULT
-};
+  if ((!(connectionSocketInfo->destroyed)) &&
+      (!(connectionSocketInfo->pendingReady)) &&
+      ((connectionSocketInfo->waitingForRead &&
+        connectionSocketInfo->socketReadable) ||
+       ((connectionSocketInfo->waitingForConnect ||
+         connectionSocketInfo->waitingForWrite) &&
+        connectionSocketInfo->socketWritable)))
+  {
+    connectionSocketInfo->pendingReady = true;
+    connectionSocketInfo->nextPendingReadyConnectionSocketInfo =
+      ioThreadState->pendingReadyConnectionSocketInfoList;
+    ioThreadState->pendingReadyConnectionSocketInfoList =
+      connectionSocketInfo;
+  }
+}
+
+/* Gives the buffer of a receive completion back to its pool. */
+static void returnReceivedBuffer(
+  const struct ReadyFDInfo* readyFDInfo,
+  struct IOThreadState* ioThreadState)
+{
+  if (readyFDInfo->completedIOBuffer)
+  {
+    returnBufferToBufferPool(
+      &(ioThreadState->relayBufferPoolArray[
+          readyFDInfo->completedIOBufferGroup]),
+      readyFDInfo->completedIOBuffer);
+  }
+}
+
+/* With completion io, move bytesReceived bytes received into buffer,
+   of relay buffer size class sizeClass, to the waiting to write
+   buffer of writeConnectionSocketInfo.  An empty waiting to write
+   buffer takes buffer itself if it is of its size class, so the
+   bytes are not copied. */
+static void addReceivedToWaitingToWriteBuffer(
+  struct ConnectionSocketInfo* writeConnectionSocketInfo,
+  void* buffer,
+  size_t sizeClass,
+  size_t bytesReceived,
+  struct IOThreadState* ioThreadState)
+{
+  struct RingBuffer* waitingToWriteBuffer =
+    &(writeConnectionSocketInfo->waitingToWriteBuffer);
+
+  if (!(waitingToWriteBuffer->buffer))
+  {
+    /* The buffer shrank while the receive was in flight. */
+    if (bytesReceived > waitingToWriteBuffer->capacity)
+    {
+      writeConnectionSocketInfo->relayBufferSizeClass = sizeClass;
+      waitingToWriteBuffer->capacity =
+        getRelayBufferSize(
+          ioThreadState->proxySettings->bufferSize,
+          sizeClass);
+    }
+    if (writeConnectionSocketInfo->relayBufferSizeClass == sizeClass)
+    {
+      waitingToWriteBuffer->buffer = buffer;
+      waitingToWriteBuffer->readOffset = 0;
+      buffer = NULL;
+    }
+  }
+
+  if (buffer)
+  {
+    attachWaitingToWriteBuffer(writeConnectionSocketInfo, ioThreadState);
+    copyToRingBuffer(waitingToWriteBuffer, buffer, bytesReceived);
+    returnBufferToBufferPool(
+      &(ioThreadState->relayBufferPoolArray[sizeClass]),
+      buffer);
+  }
+  else
+  {
+    waitingToWriteBuffer->size = bytesReceived;
+  }
+  adaptWaitingToWriteBufferSize(
+    writeConnectionSocketInfo,
+    bytesReceived,
+    ioThreadState);
+}
 
-static enum HandleConnectionReadyResult handleConnectionReady(
+/* Handle a completed receive on connectionSocketInfo, which is not
+   destroyed.  Returns connectionSocketInfo on EOF or error,
+   otherwise NULL. */
+static struct ConnectionSocketInfo* handleConnectionRecvCompleted(
   const struct ReadyFDInfo* readyFDInfo,
   struct ConnectionSocketInfo* connectionSocketInfo,
-  struct PollState* pollState,
-  struct BufferPool* connectionSocketInfoPool)
+  struct IOThreadState* ioThreadState)
+{
+  struct ConnectionSocketInfo* relatedConnectionSocketInfo =
+    connectionSocketInfo->relatedConnectionSocketInfo;
+  const int result = readyFDInfo->completedIOResult;
+
+  if ((result <= 0) || (!relatedConnectionSocketInfo))
+  {
+    returnReceivedBuffer(readyFDInfo, ioThreadState);
+    /* Receiving was canceled when the peer was destroyed. */
+    if (!relatedConnectionSocketInfo)
+    {
+      return NULL;
+    }
+    /* The kernel ran out of receive buffers, they are added
+       again before the receive is started again. */
+    if (result == -ENOBUFS)
+    {
+      startConnectionCompletionIO(connectionSocketInfo, ioThreadState);
+      return NULL;
+    }
+    return connectionSocketInfo;
+  }
+
+  addReceivedToWaitingToWriteBuffer(
+    relatedConnectionSocketInfo,
+    readyFDInfo->completedIOBuffer,
+    readyFDInfo->completedIOBufferGroup,
+    result,
+    ioThreadState);
+  recordConnectionActivity(connectionSocketInfo);
+  if (ringBufferIsFull(&(relatedConnectionSocketInfo->waitingToWriteBuffer)))
+  {
+    connectionSocketInfo->waitingForRead = false;
+  }
+  relatedConnectionSocketInfo->waitingForWrite = true;
+  startConnectionCompletionIO(relatedConnectionSocketInfo, ioThreadState);
+  startConnectionCompletionIO(connectionSocketInfo, ioThreadState);
+  return NULL;
+}
+
+/* Handle a completed send on connectionSocketInfo, which is not
+   destroyed.  Returns connectionSocketInfo on error or when it is
+   done draining, otherwise NULL. */
+static struct ConnectionSocketInfo* handleConnectionSendCompleted(
+  const struct ReadyFDInfo* readyFDInfo,
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct ConnectionSocketInfo* relatedConnectionSocketInfo =
+    connectionSocketInfo->relatedConnectionSocketInfo;
+  struct RingBuffer* waitingToWriteBuffer =
+    &(connectionSocketInfo->waitingToWriteBuffer);
+  const int result = readyFDInfo->completedIOResult;
+
+  if (result < 0)
+  {
+    return connectionSocketInfo;
+  }
+
+  consumeRingBuffer(waitingToWriteBuffer, result);
+  recordConnectionActivity(connectionSocketInfo);
+  if (ringBufferIsEmpty(waitingToWriteBuffer))
+  {
+    releaseWaitingToWriteBufferIfEmpty(connectionSocketInfo, ioThreadState);
+    if (connectionSocketInfo->disconnectWhenWriteFinishes)
+    {
+      return connectionSocketInfo;
+    }
+    connectionSocketInfo->waitingForWrite = false;
+  }
+  else
+  {
+    growWaitingToWriteBufferIfFilled(connectionSocketInfo, ioThreadState);
+    startConnectionCompletionIO(connectionSocketInfo, ioThreadState);
+  }
+
+  /* Sending freed space in the buffer, so resume receiving
+     from the peer if it stopped because the buffer was full. */
+  if ((result > 0) &&
+      relatedConnectionSocketInfo &&
+      (!(relatedConnectionSocketInfo->waitingForRead)))
+  {
+    relatedConnectionSocketInfo->waitingForRead = true;
+    startConnectionCompletionIO(relatedConnectionSocketInfo, ioThreadState);
+  }
+  return NULL;
+}
+
+/* Handle the completion of a receive or send started with completion
+   io on connectionSocketInfo.  Completions of a destroyed connection
+   only free its session once none are left. */
+static void handleConnectionIOCompleted(
+  const struct ReadyFDInfo* readyFDInfo,
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
+{
+  struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
+
+  if (readyFDInfo->completedIOType == COMPLETED_RECV)
+  {
+    connectionSocketInfo->completionIOFlags &= ~RECV_IN_FLIGHT;
+    if (connectionSocketInfo->destroyed)
+    {
+      returnReceivedBuffer(readyFDInfo, ioThreadState);
+    }
+    else
+    {
+      pDisconnectSocketInfo =
+        handleConnectionRecvCompleted(
+          readyFDInfo,
+          connectionSocketInfo,
+          ioThreadState);
+    }
+  }
+  else
+  {
+    connectionSocketInfo->completionIOFlags &= ~SEND_IN_FLIGHT;
+    if (!(connectionSocketInfo->destroyed))
+    {
+      pDisconnectSocketInfo =
+        handleConnectionSendCompleted(
+          readyFDInfo,
+          connectionSocketInfo,
+          ioThreadState);
+    }
+  }
+
+  if (connectionSocketInfo->destroyed)
+  {
+    addToDestroyedSessionListIfDone(
+      getSession(connectionSocketInfo), ioThreadState);
+  }
+  else if (pDisconnectSocketInfo)
+  {
+    destroyConnection(pDisconnectSocketInfo, ioThreadState);
+  }
+}
+
+static void handleConnectionReady(
+  const struct ReadyFDInfo* readyFDInfo,
+  struct ConnectionSocketInfo* connectionSocketInfo,
+  struct IOThreadState* ioThreadState)
 {
-  enum HandleConnectionReadyResult handleConnectionReadyResult =
-    POLL_STATE_NOT_INVALIDATED_RESULT;
   struct ConnectionSocketInfo* pDisconnectSocketInfo = NULL;
 
+  if (readyFDInfo->completedIOType != NO_COMPLETED_IO)
+  {
+    handleConnectionIOCompleted(
+      readyFDInfo,
+      connectionSocketInfo,
+      ioThreadState);
+    return;
+  }
+
+  /* Destroyed earlier while handling the same poll result. */
+  if (connectionSocketInfo->destroyed)
+  {
+    return;
+  }
+
+  if (readyFDInfo->readyForRead)
+  {
+    connectionSocketInfo->socketReadable = true;
+  }
+  if (readyFDInfo->readyForWrite)
+  {
+    connectionSocketInfo->socketWritable = true;
+  }
+
 #ifdef DEBUG_PROXY
   proxyLog("fd %d readyForRead %d readyForWrite %d readyForError %d",
            connectionSocketInfo->socket,
@@ -951,7 +3481,7 @@ static enum HandleConnectionReadyResult handleConnectionReady(
     pDisconnectSocketInfo =
       handleConnectionReadyForRead(
         connectionSocketInfo,
-        pollState);
+        ioThreadState);
   }
 
   if (readyFDInfo->readyForWrite &&
@@ -960,45 +3490,122 @@ static enum HandleConnectionReadyResult handleConnectionReady(
     pDisconnectSocketInfo =
       handleConnectionReadyForWrite(
         connectionSocketInfo,
-        pollState);
+        ioThreadState);
   }
 
-  if (pDisconnectSocketInfo)
+  /* A failed remote connect moves on to the next target. */
+  if (pDisconnectSocketInfo &&
+      ((!(pDisconnectSocketInfo->waitingForConnect)) ||
+       (!retryRemoteConnect(getSession(pDisconnectSocketInfo),
+                            ioThreadState))))
   {
     destroyConnection(
       pDisconnectSocketInfo,
-      pollState,
-      connectionSocketInfoPool);
-    handleConnectionReadyResult = POLL_STATE_INVALIDATED_RESULT;
+      ioThreadState);
+  }
+
+  if (ioThreadState->proxySettings->edgeTriggered)
+  {
+    addToPendingReadyListIfReady(
+      connectionSocketInfo, ioThreadState);
+    if (connectionSocketInfo->relatedConnectionSocketInfo)
+    {
+      addToPendingReadyListIfReady(
+        connectionSocketInfo->relatedConnectionSocketInfo, ioThreadState);
+    }
+  }
+}
+
+/* Handle connections on the pending ready list as if poll had
+   reported their last known readiness. */
+static void handlePendingReadyConnections(
+  struct IOThreadState* ioThreadState)
+{
+  struct ConnectionSocketInfo* connectionSocketInfo =
+    ioThreadState->pendingReadyConnectionSocketInfoList;
+
+  ioThreadState->pendingReadyConnectionSocketInfoList = NULL;
+
+  while (connectionSocketInfo)
+  {
+    struct ConnectionSocketInfo* nextConnectionSocketInfo =
+      connectionSocketInfo->nextPendingReadyConnectionSocketInfo;
+    struct ReadyFDInfo readyFDInfo;
+
+    connectionSocketInfo->pendingReady = false;
+    connectionSocketInfo->nextPendingReadyConnectionSocketInfo = NULL;
+
+    readyFDInfo.data = connectionSocketInfo;
+    readyFDInfo.readyForRead = connectionSocketInfo->socketReadable;
+    readyFDInfo.readyForWrite = connectionSocketInfo->socketWritable;
+    readyFDInfo.readyForError = false;
+    readyFDInfo.completedIOType = NO_COMPLETED_IO;
+    handleConnectionReady(
+      &readyFDInfo,
+      connectionSocketInfo,
+      ioThreadState);
+
+    connectionSocketInfo = nextConnectionSocketInfo;
   }
+}
+
+/* Drop destroyed connections from the pending ready list
+   before their memory is freed. */
+static void removeDestroyedFromPendingReadyList(
+  struct IOThreadState* ioThreadState)
+{
+  struct ConnectionSocketInfo** pConnectionSocketInfo =
+    &(ioThreadState->pendingReadyConnectionSocketInfoList);
 
-  return handleConnectionReadyResult;
+  while (*pConnectionSocketInfo)
+  {
+    struct ConnectionSocketInfo* connectionSocketInfo =
+      *pConnectionSocketInfo;
+    if (connectionSocketInfo->destroyed)
+    {
+      *pConnectionSocketInfo =
+        connectionSocketInfo->nextPendingReadyConnectionSocketInfo;
+    }
+    else
+    {
+      pConnectionSocketInfo =
+        &(connectionSocketInfo->nextPendingReadyConnectionSocketInfo);
+    }
+  }
 }
 
+/* An accepted socket and the client address returned by accept,
+   as handed from the acceptor thread to an I/O thread. */
+struct AcceptedFD
+{
+  int fd;
+  struct CompactAddress clientAddress;
+};
+
 struct IOThreadReceiveFDInfo
 {
   int addClientMessageFD;
-  int receivedFD;
-  size_t receiveIndex;
+  size_t receivedBytes;
+  struct AcceptedFD receivedFDArray[MAX_ACCEPTED_FD_BATCH_SIZE];
 };
 
 static void handleAddClientMessageFDReady(
-  const struct ProxySettings* proxySettings,
   struct IOThreadReceiveFDInfo* pIOThreadReceiveFDInfo,
-  struct PollState* pollState,
-  struct BufferPool* connectionSocketInfoPool)
+  struct IOThreadState* ioThreadState)
 {
   bool readWouldBlock = false;
   unsigned char* pCharBuffer =
-    (unsigned char*)(&(pIOThreadReceiveFDInfo->receivedFD));
+    (unsigned char*)(pIOThreadReceiveFDInfo->receivedFDArray);
 
+  /* Each read drains up to a whole batch of fds written by the
+     acceptor thread. */
   do
   {
-    size_t bytesToRead = sizeof(int) - pIOThreadReceiveFDInfo->receiveIndex;
     const struct ReadFromFDResult readResult = readFromFD(
       pIOThreadReceiveFDInfo->addClientMessageFD,
-      &(pCharBuffer[pIOThreadReceiveFDInfo->receiveIndex]),
-      bytesToRead);
+      &(pCharBuffer[pIOThreadReceiveFDInfo->receivedBytes]),
+      sizeof(pIOThreadReceiveFDInfo->receivedFDArray) -
+      pIOThreadReceiveFDInfo->receivedBytes);
     if (readResult.status == READ_FROM_FD_WOULD_BLOCK)
     {
       readWouldBlock = true;
@@ -1018,21 +3625,112 @@ static void handleAddClientMessageFDReady(
     }
     else
     {
-      pIOThreadReceiveFDInfo->receiveIndex += readResult.bytesRead;
-      bytesToRead -= readResult.bytesRead;
+      size_t numFDs;
+      size_t i;
+
+      pIOThreadReceiveFDInfo->receivedBytes += readResult.bytesRead;
+      numFDs =
+        pIOThreadReceiveFDInfo->receivedBytes / sizeof(struct AcceptedFD);
+      for (i = 0; i < numFDs; ++i)
+      {
+        handleNewClientSocket(
+          pIOThreadReceiveFDInfo->receivedFDArray[i].fd,
+          &(pIOThreadReceiveFDInfo->receivedFDArray[i].clientAddress),
+          ioThreadState);
+      }
+
+      /* Keep any partial fd for the next read. */
+      pIOThreadReceiveFDInfo->receivedBytes -=
+        numFDs * sizeof(struct AcceptedFD);
+      memmove(pCharBuffer,
+              &(pCharBuffer[numFDs * sizeof(struct AcceptedFD)]),
+              pIOThreadReceiveFDInfo->receivedBytes);
     }
+  } while (!readWouldBlock);
+}
+
+/* Returns the fd of an accept completion on serverSocketInfo, or -1
+   if the accept failed.  Starts accepting again if it stopped. */
+static int getCompletedAcceptFD(
+  struct ServerSocketInfo* serverSocketInfo,
+  const struct ReadyFDInfo* readyFDInfo,
+  struct PollState* pollState)
+{
+  if (!(readyFDInfo->completedIOMore))
+  {
+    startAccept(pollState, serverSocketInfo->socket, serverSocketInfo);
+  }
+  if (readyFDInfo->completedIOResult < 0)
+  {
+    proxyLog("accept error errno %d", -(readyFDInfo->completedIOResult));
+    return -1;
+  }
+  proxyLogDebug("accepted fd %d", readyFDInfo->completedIOResult);
+  return readyFDInfo->completedIOResult;
+}
+
+static void handleIOThreadServerSocketReady(
+  struct ServerSocketInfo* serverSocketInfo,
+  const struct ReadyFDInfo* readyFDInfo,
+  struct IOThreadState* ioThreadState)
+{
+  bool acceptError = false;
+  int numAccepts = 0;
 
-    if (bytesToRead == 0)
+  if (readyFDInfo->completedIOType == COMPLETED_ACCEPT)
+  {
+    const int acceptedFD =
+      getCompletedAcceptFD(
+        serverSocketInfo,
+        readyFDInfo,
+        &(ioThreadState->pollState));
+    if (acceptedFD >= 0)
     {
+      /* Looked up only if it is logged. */
+      struct CompactAddress clientCompactAddress;
+      memset(&clientCompactAddress, 0, sizeof(clientCompactAddress));
+      clientCompactAddress.family = AF_UNSPEC;
       handleNewClientSocket(
-        pIOThreadReceiveFDInfo->receivedFD,
-        proxySettings,
-        pollState,
-        connectionSocketInfoPool);
-      pIOThreadReceiveFDInfo->receivedFD = 0;
-      pIOThreadReceiveFDInfo->receiveIndex = 0;
+        acceptedFD,
+        &clientCompactAddress,
+        ioThreadState);
     }
-  } while (!readWouldBlock);
+    return;
+  }
+
+  while ((!acceptError) &&
+         (numAccepts < MAX_OPERATIONS_FOR_ONE_FD))
+  {
+    struct sockaddr_storage clientAddress;
+    socklen_t clientAddressSize = sizeof(clientAddress);
+    const int acceptedFD =
+      signalSafeAcceptNonBlocking(
+        serverSocketInfo->socket,
+        (struct sockaddr*)&clientAddress,
+        &clientAddressSize);
+    ++numAccepts;
+    if (acceptedFD < 0)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+      {
+        proxyLog("accept error errno %d", errno);
+      }
+      acceptError = true;
+    }
+    else
+    {
+      struct CompactAddress clientCompactAddress;
+
+      proxyLogDebug("accepted fd %d", acceptedFD);
+      setCompactAddress(
+        &clientCompactAddress,
+        (struct sockaddr*)&clientAddress);
+      handleNewClientSocket(
+        acceptedFD,
+        &clientCompactAddress,
+        ioThreadState);
+    }
+  }
 }
 
 struct IOThreadCreateMessage
@@ -1040,8 +3738,108 @@ struct IOThreadCreateMessage
   int ioThreadNumber;
   int addClientMessageFD;
   const struct ProxySettings* proxySettings;
+  struct BufferDepot* sessionDepot;
+  /* One depot for each relay buffer size class. */
+  struct BufferDepot* relayBufferDepotArray;
+  struct BackendAddressTable* backendAddressTable;
 };
 
+static size_t maxSize(
+  size_t a,
+  size_t b)
+{
+  return ((a > b) ? a : b);
+}
+
+static void trimIOThreadBufferPools(
+  struct IOThreadState* ioThreadState)
+{
+  const int64_t nowMillis = getCachedMonotonicTimeMillis();
+  size_t numFreed;
+  size_t i;
+
+  numFreed = trimBufferPool(&(ioThreadState->sessionPool), nowMillis);
+  if (numFreed > 0)
+  {
+    proxyLogDebug("trimmed %ld idle session buffers", (long)numFreed);
+  }
+  for (i = 0; i < ioThreadState->numRelayBufferSizeClasses; ++i)
+  {
+    numFreed =
+      trimBufferPool(&(ioThreadState->relayBufferPoolArray[i]), nowMillis);
+    if (numFreed > 0)
+    {
+      proxyLogDebug("trimmed %ld idle %ld byte relay buffers",
+                    (long)numFreed,
+                    (long)getRelayBufferSize(
+                      ioThreadState->proxySettings->bufferSize, i));
+    }
+  }
+}
+
+static bool ioThreadBufferPoolsHaveSurplus(
+  const struct IOThreadState* ioThreadState)
+{
+  size_t i;
+
+  if (bufferPoolHasSurplus(&(ioThreadState->sessionPool)))
+  {
+    return true;
+  }
+  for (i = 0; i < ioThreadState->numRelayBufferSizeClasses; ++i)
+  {
+    if (bufferPoolHasSurplus(&(ioThreadState->relayBufferPoolArray[i])))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int getIOThreadPollTimeout(
+  const struct IOThreadState* ioThreadState)
+{
+  int64_t timeoutMillis;
+
+  /* Don't block if pending ready connections need handling. */
+  if (ioThreadState->pendingReadyConnectionSocketInfoList)
+  {
+    return 0;
+  }
+  timeoutMillis =
+    getTimerWheelTimeoutMillis(
+      &(ioThreadState->sessionTimerWheel),
+      getCachedMonotonicTimeMillis());
+  /* Wake up to trim pools that hold surplus buffers even if there
+     is no traffic. */
+  if (((timeoutMillis < 0) ||
+       (timeoutMillis > BUFFER_POOL_DECAY_WINDOW_MILLIS)) &&
+      ioThreadBufferPoolsHaveSurplus(ioThreadState))
+  {
+    timeoutMillis = BUFFER_POOL_DECAY_WINDOW_MILLIS;
+  }
+  /* Wake up for the next warm socket pool check. */
+  if (ioThreadState->warmSocketPoolArray)
+  {
+    int64_t warmSocketCheckMillis =
+      ioThreadState->nextWarmSocketCheckMillis -
+      getCachedMonotonicTimeMillis();
+    if (warmSocketCheckMillis < 0)
+    {
+      warmSocketCheckMillis = 0;
+    }
+    if ((timeoutMillis < 0) || (warmSocketCheckMillis < timeoutMillis))
+    {
+      timeoutMillis = warmSocketCheckMillis;
+    }
+  }
+  if (timeoutMillis > INT_MAX)
+  {
+    timeoutMillis = INT_MAX;
+  }
+  return ((int)timeoutMillis);
+}
+
 static void setIOThreadName(int ioThreadNumber)
 {
   char threadNameBuffer[80];
@@ -1055,11 +3853,17 @@ static void* runIOThread(void* param)
   struct IOThreadCreateMessage* pIOThreadCreateMessage = param;
   const struct ProxySettings* proxySettings =
     pIOThreadCreateMessage->proxySettings;
+  struct BufferDepot* sessionDepot =
+    pIOThreadCreateMessage->sessionDepot;
+  struct BufferDepot* relayBufferDepotArray =
+    pIOThreadCreateMessage->relayBufferDepotArray;
+  struct BackendAddressTable* backendAddressTable =
+    pIOThreadCreateMessage->backendAddressTable;
+  const int ioThreadNumber = pIOThreadCreateMessage->ioThreadNumber;
   struct IOThreadReceiveFDInfo ioThreadReceiveFDInfo;
-  struct PollState pollState;
-  struct BufferPool connectionSocketInfoPool;
+  struct IOThreadState ioThreadState;
 
-  setIOThreadName(pIOThreadCreateMessage->ioThreadNumber);
+  setIOThreadName(ioThreadNumber);
 
   memset(&ioThreadReceiveFDInfo, 0, sizeof(ioThreadReceiveFDInfo));
   ioThreadReceiveFDInfo.addClientMessageFD =
@@ -1069,66 +3873,203 @@ static void* runIOThread(void* param)
   pIOThreadCreateMessage = NULL;
   param = NULL;
 
-  initializePollState(&pollState);
+  memset(&ioThreadState, 0, sizeof(ioThreadState));
+  ioThreadState.proxySettings = proxySettings;
+  ioThreadState.backendAddressTable = backendAddressTable;
+  ioThreadState.qsbrReader =
+    getQSBRReader(&(backendAddressTable->qsbrDomain), ioThreadNumber);
 
-  if (setFDNonBlocking(ioThreadReceiveFDInfo.addClientMessageFD) < 0)
+  initializePollState(&(ioThreadState.pollState), MAX_EVENTS_PER_POLL);
+
+  if (proxySettings->reusePort)
   {
-    proxyLog("error setting addClientMessageFD non blocking");
-    abort();
+    setupServerSockets(
+      &(proxySettings->serverAddrInfoList),
+      true,
+      proxySettings->completionIO,
+      &(ioThreadState.pollState));
+  }
+  else
+  {
+    if (setFDNonBlocking(ioThreadReceiveFDInfo.addClientMessageFD) < 0)
+    {
+      proxyLog("error setting addClientMessageFD non blocking");
+      abort();
+    }
+
+    addPollFDToPollState(
+      &(ioThreadState.pollState),
+      ioThreadReceiveFDInfo.addClientMessageFD,
+      NULL,
+      INTERESTED_IN_READ_EVENTS,
+      NOT_INTERESTED_IN_WRITE_EVENTS);
   }
 
-  addPollFDToPollState(
-    &pollState, 
-    ioThreadReceiveFDInfo.addClientMessageFD,
-    NULL,
-    INTERESTED_IN_READ_EVENTS,
-    NOT_INTERESTED_IN_WRITE_EVENTS);
+  updateCachedTime();
+
+  initializeTimerWheel(
+    &(ioThreadState.sessionTimerWheel),
+    SESSION_TIMER_TICK_MILLIS,
+    getCachedMonotonicTimeMillis());
 
+  initializeBackendBalancer(
+    &(ioThreadState.backendBalancer),
+    proxySettings->balanceMode,
+    proxySettings->numBackends,
+    ioThreadNumber);
+
+  /* Pools are filled on the first pass through the event loop. */
+  if (proxySettings->warmSockets > 0)
+  {
+    ioThreadState.warmSocketPoolArray =
+      checkedCalloc(proxySettings->numBackends,
+                    sizeof(struct WarmSocketPool));
+    ioThreadState.nextWarmSocketCheckMillis =
+      getCachedMonotonicTimeMillis();
+  }
+
+  /* Generations start at 0, so the first refresh sets up the
+     balancer targets of every backend. */
+  ioThreadState.addressSetArray =
+    checkedCalloc(proxySettings->numBackends,
+                  sizeof(const struct BackendAddressSet*));
+  ioThreadState.addressSetGenerationArray =
+    checkedCalloc(proxySettings->numBackends, sizeof(uint32_t));
+  qsbrReaderOnline(ioThreadState.qsbrReader);
+  refreshAddressSets(&ioThreadState);
+
+  /* Prewarmed buffers are retained, so they are never trimmed or
+     moved to a depot. */
   initializeBufferPool(
-    &connectionSocketInfoPool,
-    sizeof(struct ConnectionSocketInfo) + proxySettings->bufferSize,
-    INITIAL_CONNECTION_SOCKET_INFO_POOL_SIZE);
+    &(ioThreadState.sessionPool),
+    sizeof(struct Session),
+    CACHE_LINE_SIZE,
+    proxySettings->hugePages,
+    sessionDepot);
+  enableBufferPoolTrimming(
+    &(ioThreadState.sessionPool),
+    maxSize(proxySettings->retainedBuffers,
+            proxySettings->prewarmSessions),
+    BUFFER_POOL_DECAY_WINDOW_MILLIS,
+    getCachedMonotonicTimeMillis());
+  prewarmBufferPool(
+    &(ioThreadState.sessionPool),
+    proxySettings->prewarmSessions);
+  /* In splice relay mode session data lives in pipes.  Sessions
+     start with relay buffers of the smallest size class, so only
+     those are prewarmed. */
+  if (!(proxySettings->spliceRelay))
+  {
+    size_t i;
+
+    ioThreadState.numRelayBufferSizeClasses =
+      getNumRelayBufferSizeClasses(proxySettings->bufferSize);
+    for (i = 0; i < ioThreadState.numRelayBufferSizeClasses; ++i)
+    {
+      const size_t numPrewarmBuffers =
+        ((i == 0) ? (2 * proxySettings->prewarmSessions) : 0);
+      initializeBufferPool(
+        &(ioThreadState.relayBufferPoolArray[i]),
+        getRelayBufferSize(proxySettings->bufferSize, i),
+        sysconf(_SC_PAGESIZE),
+        proxySettings->hugePages,
+        (relayBufferDepotArray ? &(relayBufferDepotArray[i]) : NULL));
+      enableBufferPoolTrimming(
+        &(ioThreadState.relayBufferPoolArray[i]),
+        maxSize(proxySettings->retainedBuffers, numPrewarmBuffers),
+        BUFFER_POOL_DECAY_WINDOW_MILLIS,
+        getCachedMonotonicTimeMillis());
+      prewarmBufferPool(
+        &(ioThreadState.relayBufferPoolArray[i]),
+        numPrewarmBuffers);
+      /* Receive buffer group i is of size class i. */
+      if (proxySettings->completionIO)
+      {
+        addRecvBufferGroup(
+          &(ioThreadState.pollState),
+          &(ioThreadState.relayBufferPoolArray[i]),
+          getRelayBufferSize(proxySettings->bufferSize, i));
+      }
+    }
+  }
 
   while (true)
   {
     size_t i;
-    bool pollStateInvalidated = false;
-    const struct PollResult* pollResult = blockingPoll(&pollState);
+    const struct PollResult* pollResult;
+
+    /* Address sets are not used while blocked, so the resolver
+       thread does not wait for this thread to have events. */
+    qsbrReaderOffline(ioThreadState.qsbrReader);
+    pollResult =
+      blockingPoll(
+        &(ioThreadState.pollState),
+        getIOThreadPollTimeout(&ioThreadState));
     if (!pollResult)
     {
       proxyLog("blockingPoll failed");
       abort();
     }
 
-    for (i = 0; 
-         (!pollStateInvalidated) &&
-         (i < pollResult->numReadyFDs);
-         ++i)
+    updateCachedTime();
+    qsbrReaderOnline(ioThreadState.qsbrReader);
+    refreshAddressSets(&ioThreadState);
+
+    for (i = 0; i < pollResult->numEvents; ++i)
     {
-      struct ReadyFDInfo* readyFDInfo =
-        &(pollResult->readyFDInfoArray[i]);
-      if (!(readyFDInfo->data))
+      struct ReadyFDInfo readyFDInfo;
+      if (!getReadyFDInfo(pollResult, i, &readyFDInfo))
+      {
+        continue;
+      }
+      if (!(readyFDInfo.data))
       {
         handleAddClientMessageFDReady(
-          proxySettings,
           &ioThreadReceiveFDInfo,
-          &pollState,
-          &connectionSocketInfoPool);
+          &ioThreadState);
+      }
+      else if (*((const enum PollDataType*)(readyFDInfo.data)) ==
+               SERVER_SOCKET_POLL_DATA)
+      {
+        handleIOThreadServerSocketReady(
+          readyFDInfo.data,
+          &readyFDInfo,
+          &ioThreadState);
+      }
+      else if (*((const enum PollDataType*)(readyFDInfo.data)) ==
+               WARM_SOCKET_POLL_DATA)
+      {
+        handleWarmSocketReady(
+          readyFDInfo.data,
+          &ioThreadState);
+      }
+      else if (*((const enum PollDataType*)(readyFDInfo.data)) ==
+               RACE_SOCKET_POLL_DATA)
+      {
+        handleRaceSocketReady(
+          readyFDInfo.data,
+          &ioThreadState);
       }
       else
       {
-        struct ConnectionSocketInfo* connectionSocketInfo =
-          readyFDInfo->data;
-        if (handleConnectionReady(
-              readyFDInfo,
-              connectionSocketInfo,
-              &pollState,
-              &connectionSocketInfoPool) == POLL_STATE_INVALIDATED_RESULT)
-        {
-          pollStateInvalidated = true;
-        }
+        handleConnectionReady(
+          &readyFDInfo,
+          readyFDInfo.data,
+          &ioThreadState);
       }
     }
+
+    handlePendingReadyConnections(&ioThreadState);
+
+    handleExpiredSessionTimers(&ioThreadState);
+
+    maintainWarmSocketPools(&ioThreadState);
+
+    removeDestroyedFromPendingReadyList(&ioThreadState);
+    freeDestroyedSessions(&ioThreadState);
+    freeDestroyedWarmSockets(&ioThreadState);
+
+    trimIOThreadBufferPools(&ioThreadState);
   }
 
   return NULL;
@@ -1165,20 +4106,53 @@ static struct IOThreadPipeInfo* createIOThreadPipes(
 static void startIOThreads(
   const struct ProxySettings* proxySettings,
   const struct IOThreadPipeInfo* ioThreadPipeInfoArray,
+  struct BackendAddressTable* backendAddressTable,
   struct LinkedList* pthreadList)
 {
   size_t i;
   struct IOThreadCreateMessage* pIOThreadCreateMessage;
   pthread_t* pPthread;
   int pthreadRetVal;
+  struct BufferDepot* sessionDepot = NULL;
+  struct BufferDepot* relayBufferDepotArray = NULL;
+
+  /* Depots let buffers freed on a quiet I/O thread serve a busy one. */
+  if (proxySettings->numIOThreads > 1)
+  {
+    sessionDepot = checkedMalloc(sizeof(struct BufferDepot));
+    initializeBufferDepot(
+      sessionDepot,
+      sizeof(struct Session),
+      CACHE_LINE_SIZE,
+      BUFFER_DEPOT_MAX_MAGAZINES);
+    if (!(proxySettings->spliceRelay))
+    {
+      const size_t numRelayBufferSizeClasses =
+        getNumRelayBufferSizeClasses(proxySettings->bufferSize);
+      relayBufferDepotArray =
+        checkedCalloc(numRelayBufferSizeClasses, sizeof(struct BufferDepot));
+      for (i = 0; i < numRelayBufferSizeClasses; ++i)
+      {
+        initializeBufferDepot(
+          &(relayBufferDepotArray[i]),
+          getRelayBufferSize(proxySettings->bufferSize, i),
+          sysconf(_SC_PAGESIZE),
+          BUFFER_DEPOT_MAX_MAGAZINES);
+      }
+    }
+  }
 
   for (i = 0; i < proxySettings->numIOThreads; ++i)
   {
     pIOThreadCreateMessage =
       checkedMalloc(sizeof(struct IOThreadCreateMessage));
     pIOThreadCreateMessage->ioThreadNumber = i;
-    pIOThreadCreateMessage->addClientMessageFD = ioThreadPipeInfoArray[i].readFD;
+    pIOThreadCreateMessage->addClientMessageFD =
+      (ioThreadPipeInfoArray ? ioThreadPipeInfoArray[i].readFD : -1);
     pIOThreadCreateMessage->proxySettings = proxySettings;
+    pIOThreadCreateMessage->sessionDepot = sessionDepot;
+    pIOThreadCreateMessage->relayBufferDepotArray = relayBufferDepotArray;
+    pIOThreadCreateMessage->backendAddressTable = backendAddressTable;
     pPthread = checkedMalloc(sizeof(pthread_t));
 
     pthreadRetVal =
@@ -1195,26 +4169,33 @@ static void startIOThreads(
   }
 }
 
-static void writeAcceptedFDToIOThread(
-  const struct ProxySettings* proxySettings,
-  const int* ioThreadPipeWriteFDs,
-  size_t* nextPipeWriteFDIndex,
-  const int acceptedFD)
+struct AcceptedFDBatch
+{
+  size_t numFDs;
+  struct AcceptedFD fdArray[MAX_ACCEPTED_FD_BATCH_SIZE];
+};
+
+/* Hand all fds in acceptedFDBatch to an I/O thread
+   with a single pipe write. */
+static void writeAcceptedFDBatchToIOThread(
+  int ioThreadPipeWriteFD,
+  struct AcceptedFDBatch* acceptedFDBatch)
 {
-  const unsigned char* pCharBuffer = (const unsigned char*)(&acceptedFD);
-  size_t bytesToWrite = sizeof(int);
+  const unsigned char* pCharBuffer =
+    (const unsigned char*)(acceptedFDBatch->fdArray);
+  size_t bytesToWrite = acceptedFDBatch->numFDs * sizeof(struct AcceptedFD);
   size_t totalBytesWritten = 0;
 
-  do
+  while (bytesToWrite > 0)
   {
     const struct WriteToFDResult writeResult = writeToFD(
-      ioThreadPipeWriteFDs[*nextPipeWriteFDIndex],
+      ioThreadPipeWriteFD,
       &(pCharBuffer[totalBytesWritten]),
       bytesToWrite);
     if (writeResult.status != WRITE_TO_FD_SUCCESS)
     {
       proxyLog("error writing to pipeFD %d",
-               ioThreadPipeWriteFDs[*nextPipeWriteFDIndex]);
+               ioThreadPipeWriteFD);
       abort();
     }
     else
@@ -1222,27 +4203,99 @@ static void writeAcceptedFDToIOThread(
       bytesToWrite -= writeResult.bytesWritten;
       totalBytesWritten += writeResult.bytesWritten;
     }
-  } while (bytesToWrite > 0);
+  }
+
+  acceptedFDBatch->numFDs = 0;
+}
+
+static void flushAcceptedFDBatches(
+  const struct ProxySettings* proxySettings,
+  const int* ioThreadPipeWriteFDs,
+  struct AcceptedFDBatch* acceptedFDBatchArray)
+{
+  size_t i;
+
+  for (i = 0; i < proxySettings->numIOThreads; ++i)
+  {
+    writeAcceptedFDBatchToIOThread(
+      ioThreadPipeWriteFDs[i],
+      &(acceptedFDBatchArray[i]));
+  }
+}
 
-  ++(*nextPipeWriteFDIndex);
-  if ((*nextPipeWriteFDIndex) >= proxySettings->numIOThreads)
+static void addAcceptedFDToBatch(
+  const struct ProxySettings* proxySettings,
+  const int* ioThreadPipeWriteFDs,
+  struct AcceptedFDBatch* acceptedFDBatchArray,
+  size_t* nextIOThreadIndex,
+  const int acceptedFD,
+  const struct sockaddr* clientAddress)
+{
+  struct AcceptedFDBatch* acceptedFDBatch =
+    &(acceptedFDBatchArray[*nextIOThreadIndex]);
+  struct AcceptedFD* pAcceptedFD =
+    &(acceptedFDBatch->fdArray[acceptedFDBatch->numFDs]);
+
+  pAcceptedFD->fd = acceptedFD;
+  setCompactAddress(&(pAcceptedFD->clientAddress), clientAddress);
+  ++(acceptedFDBatch->numFDs);
+  if (acceptedFDBatch->numFDs >= MAX_ACCEPTED_FD_BATCH_SIZE)
+  {
+    writeAcceptedFDBatchToIOThread(
+      ioThreadPipeWriteFDs[*nextIOThreadIndex],
+      acceptedFDBatch);
+  }
+
+  ++(*nextIOThreadIndex);
+  if ((*nextIOThreadIndex) >= proxySettings->numIOThreads)
   {
-    *nextPipeWriteFDIndex = 0;
+    *nextIOThreadIndex = 0;
   }
 }
 
 static void handleServerSocketReady(
-  const struct ServerSocketInfo* serverSocketInfo,
+  struct ServerSocketInfo* serverSocketInfo,
+  const struct ReadyFDInfo* readyFDInfo,
+  struct PollState* pollState,
   const struct ProxySettings* proxySettings,
   const int* ioThreadPipeWriteFDs,
-  size_t* nextPipeWriteFDIndex)
+  struct AcceptedFDBatch* acceptedFDBatchArray,
+  size_t* nextIOThreadIndex)
 {
   bool acceptError = false;
   int numAccepts = 0;
+
+  if (readyFDInfo->completedIOType == COMPLETED_ACCEPT)
+  {
+    const int acceptedFD =
+      getCompletedAcceptFD(serverSocketInfo, readyFDInfo, pollState);
+    if (acceptedFD >= 0)
+    {
+      /* Looked up by the I/O thread only if it is logged. */
+      struct sockaddr_storage clientAddress;
+      memset(&clientAddress, 0, sizeof(clientAddress));
+      clientAddress.ss_family = AF_UNSPEC;
+      addAcceptedFDToBatch(
+        proxySettings,
+        ioThreadPipeWriteFDs,
+        acceptedFDBatchArray,
+        nextIOThreadIndex,
+        acceptedFD,
+        (struct sockaddr*)&clientAddress);
+    }
+    return;
+  }
+
   while ((!acceptError) &&
          (numAccepts < MAX_OPERATIONS_FOR_ONE_FD))
   {
-    const int acceptedFD = signalSafeAccept(serverSocketInfo->socket, NULL, NULL);
+    struct sockaddr_storage clientAddress;
+    socklen_t clientAddressSize = sizeof(clientAddress);
+    const int acceptedFD =
+      signalSafeAcceptNonBlocking(
+        serverSocketInfo->socket,
+        (struct sockaddr*)&clientAddress,
+        &clientAddressSize);
     ++numAccepts;
     if (acceptedFD < 0)
     {
@@ -1254,12 +4307,14 @@ static void handleServerSocketReady(
     }
     else
     {
-      proxyLog("accepted fd %d", acceptedFD);
-      writeAcceptedFDToIOThread(
+      proxyLogDebug("accepted fd %d", acceptedFD);
+      addAcceptedFDToBatch(
         proxySettings,
         ioThreadPipeWriteFDs,
-        nextPipeWriteFDIndex,
-        acceptedFD);
+        acceptedFDBatchArray,
+        nextIOThreadIndex,
+        acceptedFD,
+        (struct sockaddr*)&clientAddress);
     }
   }
 }
@@ -1275,7 +4330,8 @@ static void* runAcceptorThread(void* param)
   struct AcceptorThreadCreateMessage* pCreateMessage = param;
   const int* ioThreadPipeWriteFDs = pCreateMessage->ioThreadPipeWriteFDs;
   const struct ProxySettings* proxySettings = pCreateMessage->proxySettings;
-  size_t nextPipeWriteFDIndex = 0;
+  size_t nextIOThreadIndex = 0;
+  struct AcceptedFDBatch* acceptedFDBatchArray;
   struct PollState pollState;
 
   proxyLogSetThreadName("acceptor");
@@ -1284,34 +4340,56 @@ static void* runAcceptorThread(void* param)
   pCreateMessage = NULL;
   param = NULL;
 
-  initializePollState(&pollState);
+  initializePollState(&pollState, MAX_EVENTS_PER_POLL);
+
+  acceptedFDBatchArray =
+    checkedCalloc(
+      proxySettings->numIOThreads,
+      sizeof(struct AcceptedFDBatch));
 
   setupServerSockets(
     &(proxySettings->serverAddrInfoList),
+    false,
+    proxySettings->completionIO,
     &pollState);
 
   while (true)
   {
     size_t i;
-    const struct PollResult* pollResult = blockingPoll(&pollState);
+    const struct PollResult* pollResult = blockingPoll(&pollState, -1);
     if (!pollResult)
     {
       proxyLog("blockingPoll failed");
       abort();
     }
 
+    updateCachedTime();
+
     for (i = 0; 
-         i < pollResult->numReadyFDs;
+         i < pollResult->numEvents;
          ++i)
     {
-      const struct ReadyFDInfo* readyFDInfo = &(pollResult->readyFDInfoArray[i]);
-      const struct ServerSocketInfo* serverSocketInfo = readyFDInfo->data;
+      struct ReadyFDInfo readyFDInfo;
+      struct ServerSocketInfo* serverSocketInfo;
+      if (!getReadyFDInfo(pollResult, i, &readyFDInfo))
+      {
+        continue;
+      }
+      serverSocketInfo = readyFDInfo.data;
       handleServerSocketReady(
         serverSocketInfo, 
+        &readyFDInfo,
+        &pollState,
         proxySettings,
         ioThreadPipeWriteFDs,
-        &nextPipeWriteFDIndex);
+        acceptedFDBatchArray,
+        &nextIOThreadIndex);
     }
+
+    flushAcceptedFDBatches(
+      proxySettings,
+      ioThreadPipeWriteFDs,
+      acceptedFDBatchArray);
   }
 
   return NULL;
@@ -1357,6 +4435,138 @@ static void startAcceptorThread(
   addToLinkedList(pthreadList, pPthread);
 }
 
+struct ResolverThreadCreateMessage
+{
+  const struct ProxySettings* proxySettings;
+  struct BackendAddressTable* backendAddressTable;
+};
+
+/* Resolves the -r argument of backendIndex again and publishes the
+   result if its addresses changed.  The set it replaces is freed
+   once every I/O thread has gone offline or is no longer using it.
+   Sessions already connecting keep their sockets and find their
+   address again in the new set. */
+static void resolveBackendAddressSet(
+  const struct ProxySettings* proxySettings,
+  size_t backendIndex,
+  struct BackendAddressTable* backendAddressTable)
+{
+  const struct Backend* backend =
+    &(proxySettings->backendArray[backendIndex]);
+  /* This thread is the only writer. */
+  struct BackendAddressSet* oldAddressSet =
+    backendAddressTable->addressSetArray[backendIndex];
+  struct BackendAddressSet* newAddressSet;
+  struct addrinfo* addrInfo = NULL;
+  const int retVal = resolveAddrPort(backend->addrPortArgument, &addrInfo);
+
+  if (retVal != 0)
+  {
+    proxyLog("error resolving address %s %s, keeping %ld addresses",
+             backend->addrPortArgument,
+             gai_strerror(retVal),
+             (unsigned long)(oldAddressSet->numAddresses));
+    return;
+  }
+
+  if (backendAddressSetMatches(oldAddressSet, addrInfo))
+  {
+    freeaddrinfo(addrInfo);
+    return;
+  }
+
+  newAddressSet =
+    createBackendAddressSet(addrInfo, oldAddressSet->generation + 1);
+  __atomic_store_n(
+    &(backendAddressTable->addressSetArray[backendIndex]),
+    newAddressSet,
+    __ATOMIC_RELEASE);
+  proxyLog("remote address %s changed (resolved addresses = %ld)",
+           backend->addrPortArgument,
+           (unsigned long)(newAddressSet->numAddresses));
+
+  waitForQSBRGracePeriod(&(backendAddressTable->qsbrDomain));
+  freeBackendAddressSet(oldAddressSet);
+}
+
+static void* runResolverThread(void* param)
+{
+  struct ResolverThreadCreateMessage* pCreateMessage = param;
+  const struct ProxySettings* proxySettings = pCreateMessage->proxySettings;
+  struct BackendAddressTable* backendAddressTable =
+    pCreateMessage->backendAddressTable;
+
+  proxyLogSetThreadName("resolver");
+
+  free(pCreateMessage);
+  pCreateMessage = NULL;
+  param = NULL;
+
+  while (true)
+  {
+    size_t i;
+
+    sleepMillis(proxySettings->resolveIntervalMillis);
+
+    for (i = 0; i < proxySettings->numBackends; ++i)
+    {
+      resolveBackendAddressSet(proxySettings, i, backendAddressTable);
+    }
+  }
+
+  return NULL;
+}
+
+static void startResolverThread(
+  const struct ProxySettings* proxySettings,
+  struct BackendAddressTable* backendAddressTable,
+  struct LinkedList* pthreadList)
+{
+  struct ResolverThreadCreateMessage* pResolverThreadCreateMessage;
+  int pthreadRetVal;
+  pthread_t* pPthread;
+
+  pResolverThreadCreateMessage =
+    checkedMalloc(sizeof(struct ResolverThreadCreateMessage));
+  pResolverThreadCreateMessage->proxySettings = proxySettings;
+  pResolverThreadCreateMessage->backendAddressTable = backendAddressTable;
+  pPthread = checkedMalloc(sizeof(pthread_t));
+
+  pthreadRetVal =
+    pthread_create(
+      pPthread, NULL,
+      &runResolverThread,
+      pResolverThreadCreateMessage);
+  if (pthreadRetVal != 0)
+  {
+    proxyLog("pthread_create error %d", pthreadRetVal);
+    abort();
+  }
+
+  addToLinkedList(pthreadList, pPthread);
+}
+
+static struct BackendAddressTable* createBackendAddressTable(
+  const struct ProxySettings* proxySettings)
+{
+  struct BackendAddressTable* backendAddressTable =
+    checkedMalloc(sizeof(struct BackendAddressTable));
+  size_t i;
+
+  backendAddressTable->addressSetArray =
+    checkedCalloc(proxySettings->numBackends,
+                  sizeof(struct BackendAddressSet*));
+  for (i = 0; i < proxySettings->numBackends; ++i)
+  {
+    backendAddressTable->addressSetArray[i] =
+      proxySettings->backendArray[i].initialAddressSet;
+  }
+  initializeQSBRDomain(
+    &(backendAddressTable->qsbrDomain),
+    proxySettings->numIOThreads);
+  return backendAddressTable;
+}
+
 static void joinThreads(
   struct LinkedList* pthreadList)
 {
@@ -1379,25 +4589,79 @@ static void joinThreads(
 static void runProxy(
   const struct ProxySettings* proxySettings)
 {
-  struct IOThreadPipeInfo* ioThreadPipeInfoArray;
+  struct IOThreadPipeInfo* ioThreadPipeInfoArray = NULL;
+  struct BackendAddressTable* backendAddressTable;
   struct LinkedList pthreadList = EMPTY_LINKED_LIST;
+  size_t i;
 
   setupSignals();
 
-  proxyLog("remote address = %s:%s",
-           proxySettings->remoteAddrPortStrings.addrString,
-           proxySettings->remoteAddrPortStrings.portString);
+  for (i = 0; i < proxySettings->numBackends; ++i)
+  {
+    proxyLog("remote address = %s:%s (resolved addresses = %ld)",
+             proxySettings->backendArray[i].addrPortStrings.addrString,
+             proxySettings->backendArray[i].addrPortStrings.portString,
+             (unsigned long)(
+               proxySettings->backendArray[i].initialAddressSet->numAddresses));
+  }
+  proxyLog("balance mode = %s",
+           backendBalanceModeString(proxySettings->balanceMode));
+  proxyLog("warm sockets = %ld",
+           (unsigned long)(proxySettings->warmSockets));
   proxyLog("buffer size = %ld",
            (unsigned long)(proxySettings->bufferSize));
   proxyLog("no delay = %d",
            (unsigned int)(proxySettings->noDelay));
+  proxyLog("splice relay = %d",
+           (unsigned int)(proxySettings->spliceRelay));
+  proxyLog("edge triggered = %d",
+           (unsigned int)(proxySettings->edgeTriggered));
+  proxyLog("completion io = %d",
+           (unsigned int)(proxySettings->completionIO));
+  proxyLog("reuse port = %d",
+           (unsigned int)(proxySettings->reusePort));
   proxyLog("num io threads = %ld",
            (unsigned long)(proxySettings->numIOThreads));
+  proxyLog("retained buffers = %ld",
+           (unsigned long)(proxySettings->retainedBuffers));
+  proxyLog("huge pages = %s",
+           bufferPoolHugePagesString(proxySettings->hugePages));
+  proxyLog("prewarm sessions = %ld",
+           (unsigned long)(proxySettings->prewarmSessions));
+  proxyLog("connect timeout millis = %ld",
+           (long)(proxySettings->connectTimeoutMillis));
+  proxyLog("idle timeout millis = %ld",
+           (long)(proxySettings->idleTimeoutMillis));
+  proxyLog("drain timeout millis = %ld",
+           (long)(proxySettings->drainTimeoutMillis));
+  proxyLog("resolve interval millis = %ld",
+           (long)(proxySettings->resolveIntervalMillis));
+  proxyLog("log level = %s",
+           ((proxyLogLevel == PROXY_LOG_LEVEL_DEBUG) ? "debug" : "info"));
+
+  backendAddressTable = createBackendAddressTable(proxySettings);
+
+  /* With reuse port each I/O thread accepts on its own listen
+     sockets, so there is no acceptor thread to hand off fds. */
+  if (proxySettings->reusePort)
+  {
+    startIOThreads(
+      proxySettings, NULL, backendAddressTable, &pthreadList);
+  }
+  else
+  {
+    ioThreadPipeInfoArray = createIOThreadPipes(proxySettings->numIOThreads);
 
-  ioThreadPipeInfoArray = createIOThreadPipes(proxySettings->numIOThreads);
+    startIOThreads(
+      proxySettings, ioThreadPipeInfoArray, backendAddressTable,
+      &pthreadList);
+    startAcceptorThread(proxySettings, ioThreadPipeInfoArray, &pthreadList);
+  }
 
-  startIOThreads(proxySettings, ioThreadPipeInfoArray, &pthreadList);
-  startAcceptorThread(proxySettings, ioThreadPipeInfoArray, &pthreadList);
+  if (proxySettings->resolveIntervalMillis > 0)
+  {
+    startResolverThread(proxySettings, backendAddressTable, &pthreadList);
+  }
 
   free(ioThreadPipeInfoArray);
   ioThreadPipeInfoArray = NULL;
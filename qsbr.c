@@ -0,0 +1,91 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "qsbr.h"
+#include "memutil.h"
+#include "timeutil.h"
+
+/* How long a writer sleeps between checks for a grace period. */
+#define GRACE_PERIOD_POLL_MILLIS (1)
+
+void initializeQSBRDomain(
+  struct QSBRDomain* qsbrDomain,
+  size_t numReaders)
+{
+  size_t i;
+
+  qsbrDomain->numReaders = numReaders;
+  qsbrDomain->readerArray =
+    checkedCalloc(numReaders, sizeof(struct QSBRReader*));
+  for (i = 0; i < numReaders; ++i)
+  {
+    qsbrDomain->readerArray[i] =
+      checkedAlignedAlloc(QSBR_READER_ALIGNMENT, QSBR_READER_ALIGNMENT);
+    qsbrDomain->readerArray[i]->state = 0;
+  }
+}
+
+struct QSBRReader* getQSBRReader(
+  struct QSBRDomain* qsbrDomain,
+  size_t readerIndex)
+{
+  return qsbrDomain->readerArray[readerIndex];
+}
+
+void qsbrReaderOnline(
+  struct QSBRReader* qsbrReader)
+{
+  __atomic_store_n(&(qsbrReader->state), qsbrReader->state + 1,
+                   __ATOMIC_RELAXED);
+  /* Pairs with the fence in waitForQSBRGracePeriod, so either the
+     writer sees the reader online or the reader's loads that follow
+     see what the writer published. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void qsbrReaderOffline(
+  struct QSBRReader* qsbrReader)
+{
+  /* Release, so the reader's loads complete before the writer can
+     see it offline. */
+  __atomic_store_n(&(qsbrReader->state), qsbrReader->state + 1,
+                   __ATOMIC_RELEASE);
+}
+
+void waitForQSBRGracePeriod(
+  struct QSBRDomain* qsbrDomain)
+{
+  size_t i;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (i = 0; i < qsbrDomain->numReaders; ++i)
+  {
+    const struct QSBRReader* qsbrReader = qsbrDomain->readerArray[i];
+    const uint64_t state =
+      __atomic_load_n(&(qsbrReader->state), __ATOMIC_ACQUIRE);
+
+    /* An online reader may hold replaced pointers until its state
+       changes, which means it went offline. */
+    if ((state % 2) == 1)
+    {
+      while (__atomic_load_n(&(qsbrReader->state), __ATOMIC_ACQUIRE) ==
+             state)
+      {
+        sleepMillis(GRACE_PERIOD_POLL_MILLIS);
+      }
+    }
+  }
+}
@@ -0,0 +1,67 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QSBR_H
+#define QSBR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Readers are allocated one per cache line. */
+#define QSBR_READER_ALIGNMENT (64)
+
+struct QSBRReader
+{
+  /* Odd while the reader is online.  Written only by the reader. */
+  uint64_t state;
+};
+
+/* Quiescent state based reclamation.  Readers are threads that read
+   pointers published by a writer only while they are online, and go
+   offline at points where they hold no pointer they read before,
+   such as while blocked in poll.  A writer that replaced a published
+   pointer may free what it pointed to once every reader has been
+   offline since, so readers take no locks and write nothing shared
+   per read. */
+struct QSBRDomain
+{
+  size_t numReaders;
+  struct QSBRReader** readerArray;
+};
+
+/* Readers start offline. */
+extern void initializeQSBRDomain(
+  struct QSBRDomain* qsbrDomain,
+  size_t numReaders);
+
+extern struct QSBRReader* getQSBRReader(
+  struct QSBRDomain* qsbrDomain,
+  size_t readerIndex);
+
+/* Pointers published before a reader goes online are visible to it
+   once it is online. */
+extern void qsbrReaderOnline(
+  struct QSBRReader* qsbrReader);
+
+extern void qsbrReaderOffline(
+  struct QSBRReader* qsbrReader);
+
+/* Called by a writer after replacing published pointers.  Returns
+   once no reader can still hold the pointers replaced. */
+extern void waitForQSBRGracePeriod(
+  struct QSBRDomain* qsbrDomain);
+
+#endif
@@ -0,0 +1,196 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ringbuffer.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/uio.h>
+
+void initializeRingBuffer(
+  struct RingBuffer* ringBuffer,
+  void* buffer,
+  size_t capacity)
+{
+  assert(ringBuffer != NULL);
+
+  memset(ringBuffer, 0, sizeof(struct RingBuffer));
+  ringBuffer->buffer = buffer;
+  ringBuffer->capacity = capacity;
+}
+
+void* moveRingBuffer(
+  struct RingBuffer* ringBuffer,
+  void* newBuffer,
+  size_t newCapacity)
+{
+  unsigned char* oldBuffer;
+  size_t firstPartSize;
+
+  assert(ringBuffer != NULL);
+  assert(newCapacity >= ringBuffer->size);
+
+  oldBuffer = ringBuffer->buffer;
+  firstPartSize = ringBuffer->capacity - ringBuffer->readOffset;
+  if (firstPartSize >= ringBuffer->size)
+  {
+    memcpy(newBuffer, &(oldBuffer[ringBuffer->readOffset]),
+           ringBuffer->size);
+  }
+  else
+  {
+    memcpy(newBuffer, &(oldBuffer[ringBuffer->readOffset]),
+           firstPartSize);
+    memcpy(((unsigned char*)newBuffer) + firstPartSize, oldBuffer,
+           ringBuffer->size - firstPartSize);
+  }
+
+  ringBuffer->buffer = newBuffer;
+  ringBuffer->capacity = newCapacity;
+  ringBuffer->readOffset = 0;
+  return oldBuffer;
+}
+
+void copyToRingBuffer(
+  struct RingBuffer* ringBuffer,
+  const void* data,
+  size_t size)
+{
+  size_t writeOffset;
+  size_t firstPartSize;
+
+  assert(ringBuffer != NULL);
+  assert(size <= (ringBuffer->capacity - ringBuffer->size));
+
+  writeOffset = ringBuffer->readOffset + ringBuffer->size;
+  if (writeOffset >= ringBuffer->capacity)
+  {
+    writeOffset -= ringBuffer->capacity;
+  }
+  firstPartSize = ringBuffer->capacity - writeOffset;
+  if (firstPartSize >= size)
+  {
+    memcpy(&(ringBuffer->buffer[writeOffset]), data, size);
+  }
+  else
+  {
+    memcpy(&(ringBuffer->buffer[writeOffset]), data, firstPartSize);
+    memcpy(ringBuffer->buffer,
+           ((const unsigned char*)data) + firstPartSize,
+           size - firstPartSize);
+  }
+  ringBuffer->size += size;
+}
+
+void consumeRingBuffer(
+  struct RingBuffer* ringBuffer,
+  size_t size)
+{
+  assert(ringBuffer != NULL);
+  assert(size <= ringBuffer->size);
+
+  ringBuffer->size -= size;
+  if (ringBuffer->size == 0)
+  {
+    /* Start over at the beginning so the next read
+       gets one contiguous region. */
+    ringBuffer->readOffset = 0;
+  }
+  else
+  {
+    ringBuffer->readOffset += size;
+    if (ringBuffer->readOffset >= ringBuffer->capacity)
+    {
+      ringBuffer->readOffset -= ringBuffer->capacity;
+    }
+  }
+}
+
+struct ReadFromFDResult readFromFDToRingBuffer(
+  int fd,
+  struct RingBuffer* ringBuffer)
+{
+  struct iovec iov[2];
+  int iovcnt = 0;
+  size_t writeOffset;
+  size_t bytesFree;
+  struct ReadFromFDResult readResult;
+
+  assert(ringBuffer != NULL);
+  assert(!ringBufferIsFull(ringBuffer));
+
+  writeOffset = ringBuffer->readOffset + ringBuffer->size;
+  if (writeOffset >= ringBuffer->capacity)
+  {
+    writeOffset -= ringBuffer->capacity;
+  }
+  bytesFree = ringBuffer->capacity - ringBuffer->size;
+
+  iov[iovcnt].iov_base = &(ringBuffer->buffer[writeOffset]);
+  if ((writeOffset + bytesFree) <= ringBuffer->capacity)
+  {
+    iov[iovcnt].iov_len = bytesFree;
+    ++iovcnt;
+  }
+  else
+  {
+    iov[iovcnt].iov_len = ringBuffer->capacity - writeOffset;
+    ++iovcnt;
+    iov[iovcnt].iov_base = ringBuffer->buffer;
+    iov[iovcnt].iov_len = bytesFree - iov[0].iov_len;
+    ++iovcnt;
+  }
+
+  readResult = readvFromFD(fd, iov, iovcnt);
+  if (readResult.status == READ_FROM_FD_SUCCESS)
+  {
+    ringBuffer->size += readResult.bytesRead;
+  }
+  return readResult;
+}
+
+struct WriteToFDResult writeFromRingBufferToFD(
+  int fd,
+  struct RingBuffer* ringBuffer)
+{
+  struct iovec iov[2];
+  int iovcnt = 0;
+  struct WriteToFDResult writeResult;
+
+  assert(ringBuffer != NULL);
+  assert(!ringBufferIsEmpty(ringBuffer));
+
+  iov[iovcnt].iov_base = &(ringBuffer->buffer[ringBuffer->readOffset]);
+  if ((ringBuffer->readOffset + ringBuffer->size) <= ringBuffer->capacity)
+  {
+    iov[iovcnt].iov_len = ringBuffer->size;
+    ++iovcnt;
+  }
+  else
+  {
+    iov[iovcnt].iov_len = ringBuffer->capacity - ringBuffer->readOffset;
+    ++iovcnt;
+    iov[iovcnt].iov_base = ringBuffer->buffer;
+    iov[iovcnt].iov_len = ringBuffer->size - iov[0].iov_len;
+    ++iovcnt;
+  }
+
+  writeResult = writevToFD(fd, iov, iovcnt);
+  if (writeResult.status == WRITE_TO_FD_SUCCESS)
+  {
+    consumeRingBuffer(ringBuffer, writeResult.bytesWritten);
+  }
+  return writeResult;
+}
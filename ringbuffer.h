@@ -0,0 +1,86 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include "fdutil.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Circular buffer of bytes waiting to be written to an fd.
+   Bytes in the buffer start at readOffset and wrap around
+   at capacity.  32 bit offsets keep it small enough to embed in
+   per-connection state. */
+struct RingBuffer
+{
+  unsigned char* buffer;
+  uint32_t capacity;
+  uint32_t readOffset;
+  uint32_t size;
+};
+
+extern void initializeRingBuffer(
+  struct RingBuffer* ringBuffer,
+  void* buffer,
+  size_t capacity);
+
+static inline bool ringBufferIsEmpty(
+  const struct RingBuffer* ringBuffer)
+{
+  return (ringBuffer->size == 0);
+}
+
+static inline bool ringBufferIsFull(
+  const struct RingBuffer* ringBuffer)
+{
+  return (ringBuffer->size >= ringBuffer->capacity);
+}
+
+/* Copy the bytes in ringBuffer to the start of newBuffer and make
+   newBuffer its buffer.  newCapacity must be at least the size of
+   ringBuffer.  Returns the old buffer. */
+extern void* moveRingBuffer(
+  struct RingBuffer* ringBuffer,
+  void* newBuffer,
+  size_t newCapacity);
+
+/* Copy size bytes from data to the free space in ringBuffer.  size
+   must be at most the free space. */
+extern void copyToRingBuffer(
+  struct RingBuffer* ringBuffer,
+  const void* data,
+  size_t size);
+
+/* Remove size bytes that were written from the start of
+   ringBuffer. */
+extern void consumeRingBuffer(
+  struct RingBuffer* ringBuffer,
+  size_t size);
+
+/* Read from fd into all free space in ringBuffer with one readv. */
+extern struct ReadFromFDResult readFromFDToRingBuffer(
+  int fd,
+  struct RingBuffer* ringBuffer);
+
+/* Write as much of ringBuffer as possible to fd with one writev,
+   and remove the bytes written from ringBuffer. */
+extern struct WriteToFDResult writeFromRingBufferToFD(
+  int fd,
+  struct RingBuffer* ringBuffer);
+
+#endif
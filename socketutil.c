@@ -14,10 +14,17 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include "socketutil.h"
+#include "fdutil.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -41,6 +48,81 @@ int addressToNameAndPort(
   return 0;
 }
 
+void setCompactAddress(
+  struct CompactAddress* compactAddress,
+  const struct sockaddr* address)
+{
+  memset(compactAddress, 0, sizeof(struct CompactAddress));
+  if (address->sa_family == AF_INET)
+  {
+    const struct sockaddr_in* inAddress =
+      (const struct sockaddr_in*)address;
+    compactAddress->family = AF_INET;
+    compactAddress->port = inAddress->sin_port;
+    compactAddress->addr.inAddr = inAddress->sin_addr;
+  }
+  else if (address->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6* in6Address =
+      (const struct sockaddr_in6*)address;
+    compactAddress->family = AF_INET6;
+    compactAddress->port = in6Address->sin6_port;
+    compactAddress->addr.in6Addr = in6Address->sin6_addr;
+  }
+  else
+  {
+    compactAddress->family = AF_UNSPEC;
+  }
+}
+
+int getSocketLocalCompactAddress(
+  int socket,
+  struct CompactAddress* compactAddress)
+{
+  struct sockaddr_storage address;
+  socklen_t addressSize = sizeof(address);
+
+  if (getsockname(socket, (struct sockaddr*)&address, &addressSize) < 0)
+  {
+    return -1;
+  }
+  setCompactAddress(compactAddress, (struct sockaddr*)&address);
+  return 0;
+}
+
+int getSocketPeerCompactAddress(
+  int socket,
+  struct CompactAddress* compactAddress)
+{
+  struct sockaddr_storage address;
+  socklen_t addressSize = sizeof(address);
+
+  if (getpeername(socket, (struct sockaddr*)&address, &addressSize) < 0)
+  {
+    return -1;
+  }
+  setCompactAddress(compactAddress, (struct sockaddr*)&address);
+  return 0;
+}
+
+void compactAddressToAddrPortStrings(
+  const struct CompactAddress* compactAddress,
+  struct AddrPortStrings* addrPortStrings)
+{
+  if ((compactAddress->family == AF_UNSPEC) ||
+      (!inet_ntop(compactAddress->family,
+                  &(compactAddress->addr),
+                  addrPortStrings->addrString,
+                  NI_MAXHOST)))
+  {
+    strcpy(addrPortStrings->addrString, "?");
+    strcpy(addrPortStrings->portString, "?");
+    return;
+  }
+  snprintf(addrPortStrings->portString, NI_MAXSERV, "%u",
+           (unsigned int)ntohs(compactAddress->port));
+}
+
 int setSocketListening(
   int socket)
 {
@@ -54,6 +136,15 @@ int setSocketReuseAddress(
   return setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 }
 
+#ifdef SO_REUSEPORT
+int setSocketReusePort(
+  int socket)
+{
+  int optval = 1;
+  return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+}
+#endif
+
 int setSocketNoDelay(
   int socket)
 {
@@ -75,6 +166,19 @@ int getSocketError(
   return optval;
 }
 
+int socketIsOpen(
+  int socket)
+{
+  char peekByte;
+  ssize_t retVal;
+  do
+  {
+    retVal = recv(socket, &peekByte, 1, MSG_PEEK | MSG_DONTWAIT);
+  } while ((retVal < 0) && (errno == EINTR));
+  return ((retVal > 0) ||
+          ((retVal < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))));
+}
+
 int signalSafeAccept(
   int sockfd,
   struct sockaddr* addr,
@@ -91,3 +195,35 @@ int signalSafeAccept(
   } while (interrupted);
   return retVal;
 }
+
+int signalSafeAcceptNonBlocking(
+  int sockfd,
+  struct sockaddr* addr,
+  socklen_t* addrlen)
+{
+  bool interrupted;
+  int retVal;
+#if defined(SOCK_NONBLOCK) && (defined(__linux__) || defined(__FreeBSD__))
+  do
+  {
+    retVal = accept4(sockfd, addr, addrlen, SOCK_NONBLOCK);
+    interrupted =
+      ((retVal < 0) &&
+       (errno == EINTR));
+  } while (interrupted);
+#else
+  do
+  {
+    retVal = accept(sockfd, addr, addrlen);
+    interrupted =
+      ((retVal < 0) &&
+       (errno == EINTR));
+  } while (interrupted);
+  if ((retVal >= 0) && (setFDNonBlocking(retVal) < 0))
+  {
+    signalSafeClose(retVal);
+    retVal = -1;
+  }
+#endif
+  return retVal;
+}
@@ -19,6 +19,7 @@
 
 #include <netdb.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 struct AddrPortStrings
 {
@@ -31,21 +32,71 @@ extern int addressToNameAndPort(
   const socklen_t addressSize,
   struct AddrPortStrings* addrPortStrings);
 
+/* IPv4 or IPv6 address and port in binary form, much smaller than
+   AddrPortStrings.  family is AF_UNSPEC if the address is unknown. */
+struct CompactAddress
+{
+  sa_family_t family;
+  /* Network byte order. */
+  in_port_t port;
+  union
+  {
+    struct in_addr inAddr;
+    struct in6_addr in6Addr;
+  } addr;
+};
+
+/* Sets compactAddress to AF_UNSPEC for other address families. */
+extern void setCompactAddress(
+  struct CompactAddress* compactAddress,
+  const struct sockaddr* address);
+
+extern int getSocketLocalCompactAddress(
+  int socket,
+  struct CompactAddress* compactAddress);
+
+extern int getSocketPeerCompactAddress(
+  int socket,
+  struct CompactAddress* compactAddress);
+
+/* Formats "?" for an unknown address. */
+extern void compactAddressToAddrPortStrings(
+  const struct CompactAddress* compactAddress,
+  struct AddrPortStrings* addrPortStrings);
+
 extern int setSocketListening(
   int socket);
 
 extern int setSocketReuseAddress(
   int socket);
 
+#ifdef SO_REUSEPORT
+extern int setSocketReusePort(
+  int socket);
+#endif
+
 extern int setSocketNoDelay(
   int socket);
 
 extern int getSocketError(
   int socket);
 
+/* Returns 1 if socket is still open, 0 if the peer closed it or it
+   has an error.  Bytes waiting to be read are left in place. */
+extern int socketIsOpen(
+  int socket);
+
 extern int signalSafeAccept(
   int sockfd,
   struct sockaddr* addr,
   socklen_t* addrlen);
 
+/* Accept a connection and return it already non-blocking.
+   Uses accept4(SOCK_NONBLOCK) where available to save a
+   syscall per accepted socket. */
+extern int signalSafeAcceptNonBlocking(
+  int sockfd,
+  struct sockaddr* addr,
+  socklen_t* addrlen);
+
 #endif
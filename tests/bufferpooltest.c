@@ -0,0 +1,97 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Regression tests for bufferpool.c.  Failures abort in assert. */
+
+#undef NDEBUG
+#include "bufferpool.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BUFFER_SIZE 4096
+#define DECAY_WINDOW_MILLIS 1000
+
+/* A magazine exported in the middle of a decay window must lower the
+   window minimum, or the next trim decommits more buffers than the
+   pool holds, through stale bufferArray entries. */
+/* Pools are never destroyed, so they are static to keep their memory
+   reachable. */
+static struct BufferDepot bufferDepot;
+static struct BufferPool bufferPool;
+static struct BufferPool otherBufferPool;
+
+static void testExportThenTrim()
+{
+  void* bufferArray[(2 * BUFFER_MAGAZINE_SIZE) + 1];
+  void* importedBufferArray[BUFFER_MAGAZINE_SIZE];
+  const size_t numBuffers = (2 * BUFFER_MAGAZINE_SIZE) + 1;
+  size_t i;
+
+  initializeBufferDepot(&bufferDepot, BUFFER_SIZE, BUFFER_SIZE, 4);
+  initializeBufferPool(&bufferPool, BUFFER_SIZE, BUFFER_SIZE,
+                       BUFFER_POOL_NO_HUGE_PAGES, &bufferDepot);
+  initializeBufferPool(&otherBufferPool, BUFFER_SIZE, BUFFER_SIZE,
+                       BUFFER_POOL_NO_HUGE_PAGES, &bufferDepot);
+  enableBufferPoolTrimming(&bufferPool, 0, DECAY_WINDOW_MILLIS, 0);
+
+  for (i = 0; i < numBuffers; ++i)
+  {
+    bufferArray[i] = getBufferFromBufferPool(&bufferPool);
+  }
+  /* Start a window with 2 magazines of committed free buffers. */
+  for (i = 0; i < (numBuffers - 1); ++i)
+  {
+    returnBufferToBufferPool(&bufferPool, bufferArray[i]);
+  }
+  trimBufferPool(&bufferPool, DECAY_WINDOW_MILLIS);
+  assert(bufferPool.decommittedBuffers == 0);
+  assert(bufferPool.minCommittedBuffersInWindow ==
+         (2 * BUFFER_MAGAZINE_SIZE));
+
+  /* One more return exports a magazine to the depot, and another
+     thread takes it and fills its buffers. */
+  returnBufferToBufferPool(&bufferPool, bufferArray[numBuffers - 1]);
+  assert(bufferPool.buffersInPool == (BUFFER_MAGAZINE_SIZE + 1));
+  assert(bufferPool.minCommittedBuffersInWindow <=
+         bufferPool.buffersInPool);
+  for (i = 0; i < BUFFER_MAGAZINE_SIZE; ++i)
+  {
+    importedBufferArray[i] = getBufferFromBufferPool(&otherBufferPool);
+    memset(importedBufferArray[i], 'x', BUFFER_SIZE);
+  }
+
+  trimBufferPool(&bufferPool, 2 * DECAY_WINDOW_MILLIS);
+  assert(bufferPool.decommittedBuffers <= bufferPool.buffersInPool);
+  assert(bufferPool.minCommittedBuffersInWindow <=
+         bufferPool.buffersInPool);
+  trimBufferPool(&bufferPool, 3 * DECAY_WINDOW_MILLIS);
+  assert(bufferPool.decommittedBuffers == bufferPool.buffersInPool);
+
+  /* Trimming never touches buffers in use by the other pool. */
+  for (i = 0; i < BUFFER_MAGAZINE_SIZE; ++i)
+  {
+    const char* buffer = importedBufferArray[i];
+    assert((buffer[0] == 'x') && (buffer[BUFFER_SIZE - 1] == 'x'));
+  }
+}
+
+int main()
+{
+  testExportThenTrim();
+  printf("bufferpooltest passed\n");
+  return 0;
+}
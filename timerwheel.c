@@ -0,0 +1,294 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "timerwheel.h"
+#include <assert.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS_PER_LEVEL - 1)
+/* Ticks covered by the whole wheel. */
+#define MAX_TIMER_TICKS \
+  (((int64_t)1) << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS))
+
+static int levelShift(
+  int level)
+{
+  return (level * TIMER_WHEEL_LEVEL_BITS);
+}
+
+static uint64_t rotateRight(
+  uint64_t value,
+  unsigned int bits)
+{
+  return ((value >> bits) | (value << ((64 - bits) & 63)));
+}
+
+static int64_t getExpireTick(
+  const struct TimerWheel* timerWheel,
+  const struct TimerWheelTimer* timer)
+{
+  /* Round up so timers never expire early. */
+  return ((timer->expireMillis + timerWheel->tickMillis - 1) /
+          timerWheel->tickMillis);
+}
+
+static void insertTimer(
+  struct TimerWheel* timerWheel,
+  struct TimerWheelTimer* timer,
+  int64_t expireTick)
+{
+  int64_t delta;
+  int level = 0;
+  unsigned int slot;
+  struct TimerWheelTimer* sentinel;
+
+  if (expireTick < timerWheel->currentTick)
+  {
+    expireTick = timerWheel->currentTick;
+  }
+  delta = expireTick - timerWheel->currentTick;
+  if (delta >= MAX_TIMER_TICKS)
+  {
+    expireTick = timerWheel->currentTick + MAX_TIMER_TICKS - 1;
+    delta = MAX_TIMER_TICKS - 1;
+  }
+  while ((level < (TIMER_WHEEL_LEVELS - 1)) &&
+         (delta >= (((int64_t)1) << levelShift(level + 1))))
+  {
+    ++level;
+  }
+
+  slot = (expireTick >> levelShift(level)) & SLOT_MASK;
+  sentinel = &(timerWheel->slotArray[level][slot]);
+  timer->wheelSlot = (level * TIMER_WHEEL_SLOTS_PER_LEVEL) + slot;
+  timer->prev = sentinel->prev;
+  timer->next = sentinel;
+  sentinel->prev->next = timer;
+  sentinel->prev = timer;
+  timerWheel->occupiedSlotBitmap[level] |= (((uint64_t)1) << slot);
+}
+
+/* Detaches all timers in a slot and returns them as a NULL
+   terminated list. */
+static struct TimerWheelTimer* takeSlot(
+  struct TimerWheel* timerWheel,
+  int level,
+  unsigned int slot)
+{
+  struct TimerWheelTimer* sentinel = &(timerWheel->slotArray[level][slot]);
+  struct TimerWheelTimer* timerList = NULL;
+
+  if (sentinel->next != sentinel)
+  {
+    timerList = sentinel->next;
+    sentinel->prev->next = NULL;
+    sentinel->next = sentinel;
+    sentinel->prev = sentinel;
+    timerWheel->occupiedSlotBitmap[level] &= ~(((uint64_t)1) << slot);
+  }
+  return timerList;
+}
+
+/* Returns the first tick after currentTick at which the wheel
+   expires or moves down timers, or -1 if it has none. */
+static int64_t getNextEventTick(
+  const struct TimerWheel* timerWheel)
+{
+  int64_t nextEventTick = -1;
+  int level;
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+  {
+    const uint64_t bitmap = timerWheel->occupiedSlotBitmap[level];
+    if (bitmap != 0)
+    {
+      /* Slot of level covering the tick after currentTick
+         is processed at (levelTick + 1) << levelShift(level). */
+      const int64_t levelTick =
+        timerWheel->currentTick >> levelShift(level);
+      const unsigned int firstSlot = (levelTick + 1) & SLOT_MASK;
+      const int64_t distance =
+        __builtin_ctzll(rotateRight(bitmap, firstSlot)) + 1;
+      const int64_t eventTick =
+        (levelTick + distance) << levelShift(level);
+      if ((nextEventTick < 0) || (eventTick < nextEventTick))
+      {
+        nextEventTick = eventTick;
+      }
+    }
+  }
+  return nextEventTick;
+}
+
+void initializeTimerWheel(
+  struct TimerWheel* timerWheel,
+  int64_t tickMillis,
+  int64_t nowMillis)
+{
+  int level;
+  int slot;
+
+  assert(tickMillis > 0);
+  timerWheel->tickMillis = tickMillis;
+  timerWheel->currentTick = nowMillis / tickMillis;
+  timerWheel->numTimers = 0;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+  {
+    timerWheel->occupiedSlotBitmap[level] = 0;
+    for (slot = 0; slot < TIMER_WHEEL_SLOTS_PER_LEVEL; ++slot)
+    {
+      struct TimerWheelTimer* sentinel =
+        &(timerWheel->slotArray[level][slot]);
+      sentinel->prev = sentinel;
+      sentinel->next = sentinel;
+    }
+  }
+}
+
+void initializeTimerWheelTimer(
+  struct TimerWheelTimer* timer)
+{
+  timer->prev = NULL;
+  timer->next = NULL;
+  timer->expireMillis = 0;
+  timer->wheelSlot = 0;
+}
+
+bool timerWheelTimerIsScheduled(
+  const struct TimerWheelTimer* timer)
+{
+  return (timer->prev != NULL);
+}
+
+void addTimerToTimerWheel(
+  struct TimerWheel* timerWheel,
+  struct TimerWheelTimer* timer,
+  int64_t expireMillis)
+{
+  int64_t expireTick;
+
+  assert(!timerWheelTimerIsScheduled(timer));
+  timer->expireMillis = expireMillis;
+  expireTick = getExpireTick(timerWheel, timer);
+  /* The current tick has already been processed. */
+  if (expireTick <= timerWheel->currentTick)
+  {
+    expireTick = timerWheel->currentTick + 1;
+  }
+  insertTimer(timerWheel, timer, expireTick);
+  ++(timerWheel->numTimers);
+}
+
+void removeTimerFromTimerWheel(
+  struct TimerWheel* timerWheel,
+  struct TimerWheelTimer* timer)
+{
+  if (timerWheelTimerIsScheduled(timer))
+  {
+    const int level = timer->wheelSlot / TIMER_WHEEL_SLOTS_PER_LEVEL;
+    const unsigned int slot = timer->wheelSlot & SLOT_MASK;
+    struct TimerWheelTimer* sentinel = &(timerWheel->slotArray[level][slot]);
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+    if (sentinel->next == sentinel)
+    {
+      timerWheel->occupiedSlotBitmap[level] &= ~(((uint64_t)1) << slot);
+    }
+    --(timerWheel->numTimers);
+  }
+}
+
+struct TimerWheelTimer* expireTimerWheelTimers(
+  struct TimerWheel* timerWheel,
+  int64_t nowMillis)
+{
+  const int64_t nowTick = nowMillis / timerWheel->tickMillis;
+  struct TimerWheelTimer* expiredList = NULL;
+  struct TimerWheelTimer* expiredListTail = NULL;
+
+  while (timerWheel->currentTick < nowTick)
+  {
+    const int64_t nextEventTick = getNextEventTick(timerWheel);
+    int level;
+    struct TimerWheelTimer* timer;
+
+    if ((nextEventTick < 0) || (nextEventTick > nowTick))
+    {
+      timerWheel->currentTick = nowTick;
+      break;
+    }
+    timerWheel->currentTick = nextEventTick;
+
+    /* Move timers down from the highest level first, so timers
+       that land in a lower level slot starting at this tick move
+       down again. */
+    for (level = TIMER_WHEEL_LEVELS - 1; level > 0; --level)
+    {
+      const int64_t levelTickMask = (((int64_t)1) << levelShift(level)) - 1;
+      if ((timerWheel->currentTick & levelTickMask) == 0)
+      {
+        timer = takeSlot(
+          timerWheel, level,
+          (timerWheel->currentTick >> levelShift(level)) & SLOT_MASK);
+        while (timer)
+        {
+          struct TimerWheelTimer* nextTimer = timer->next;
+          insertTimer(timerWheel, timer, getExpireTick(timerWheel, timer));
+          timer = nextTimer;
+        }
+      }
+    }
+
+    timer = takeSlot(timerWheel, 0, timerWheel->currentTick & SLOT_MASK);
+    if (timer)
+    {
+      if (expiredListTail)
+      {
+        expiredListTail->next = timer;
+      }
+      else
+      {
+        expiredList = timer;
+      }
+      while (timer)
+      {
+        timer->prev = NULL;
+        expiredListTail = timer;
+        --(timerWheel->numTimers);
+        timer = timer->next;
+      }
+    }
+  }
+
+  return expiredList;
+}
+
+int64_t getTimerWheelTimeoutMillis(
+  const struct TimerWheel* timerWheel,
+  int64_t nowMillis)
+{
+  const int64_t nextEventTick = getNextEventTick(timerWheel);
+  int64_t timeoutMillis;
+
+  if (nextEventTick < 0)
+  {
+    return -1;
+  }
+  timeoutMillis = (nextEventTick * timerWheel->tickMillis) - nowMillis;
+  return ((timeoutMillis > 0) ? timeoutMillis : 0);
+}
@@ -0,0 +1,96 @@
+/* cproxy - Copyright (C) 2012 Aaron Riekenberg (aaron.riekenberg@gmail.com).
+
+   cproxy is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   cproxy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVEL_BITS (6)
+#define TIMER_WHEEL_SLOTS_PER_LEVEL (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_LEVELS (4)
+
+/* Embedded in the object the timer belongs to.  A timer is
+   scheduled while prev is not NULL. */
+struct TimerWheelTimer
+{
+  struct TimerWheelTimer* prev;
+  struct TimerWheelTimer* next;
+  int64_t expireMillis;
+  uint32_t wheelSlot;
+};
+
+/* Hierarchical timing wheel in the style of Varghese and Lauck, for
+   use by a single thread.  Level 0 has a slot for each of the next
+   TIMER_WHEEL_SLOTS_PER_LEVEL ticks, and each slot of a higher level
+   covers a whole turn of the level below it.  Timers in a higher
+   level slot move down when the wheel reaches the start of that
+   slot.  Adding and removing a timer is O(1), and the occupancy
+   bitmaps find the next tick with work to do without scanning
+   slots.  Timers expire at most one tick late.  Timers further away
+   than the top level covers wait in its furthest slot until they
+   come into range. */
+struct TimerWheel
+{
+  int64_t tickMillis;
+  /* All timers due at or before this tick have expired. */
+  int64_t currentTick;
+  size_t numTimers;
+  uint64_t occupiedSlotBitmap[TIMER_WHEEL_LEVELS];
+  /* Sentinels of circular slot lists. */
+  struct TimerWheelTimer slotArray[TIMER_WHEEL_LEVELS]
+                                  [TIMER_WHEEL_SLOTS_PER_LEVEL];
+};
+
+extern void initializeTimerWheel(
+  struct TimerWheel* timerWheel,
+  int64_t tickMillis,
+  int64_t nowMillis);
+
+extern void initializeTimerWheelTimer(
+  struct TimerWheelTimer* timer);
+
+extern bool timerWheelTimerIsScheduled(
+  const struct TimerWheelTimer* timer);
+
+/* timer must not be scheduled.  Timers that are already due expire
+   on the next tick. */
+extern void addTimerToTimerWheel(
+  struct TimerWheel* timerWheel,
+  struct TimerWheelTimer* timer,
+  int64_t expireMillis);
+
+/* Does nothing if timer is not scheduled. */
+extern void removeTimerFromTimerWheel(
+  struct TimerWheel* timerWheel,
+  struct TimerWheelTimer* timer);
+
+/* Advances the wheel to nowMillis and returns the timers that
+   expired, linked through next.  Returned timers are no longer
+   scheduled, so next must be read before a timer is added again. */
+extern struct TimerWheelTimer* expireTimerWheelTimers(
+  struct TimerWheel* timerWheel,
+  int64_t nowMillis);
+
+/* Returns the poll timeout in milliseconds until the wheel next
+   has work to do, or -1 if it has no timers. */
+extern int64_t getTimerWheelTimeoutMillis(
+  const struct TimerWheel* timerWheel,
+  int64_t nowMillis);
+
+#endif
@@ -14,43 +14,135 @@
    along with cproxy.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #include "timeutil.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-void printTimeString()
+struct CachedTime
 {
-  size_t charsWritten;
-  char buffer[80];
-  struct timeval tv;
-  struct tm tm;
+  /* True once the thread has called updateCachedTime. */
+  bool updatedByThread;
+  struct timeval wallTime;
+  int64_t monotonicTimeMillis;
+  /* wallTime.tv_sec rendered by localtime_r and strftime,
+     without the fractional part. */
+  time_t renderedSecond;
+  size_t renderedSecondLength;
+  char renderedSecondString[TIME_STRING_BUFFER_SIZE];
+};
+
+static __thread struct CachedTime cachedTime;
+
+static void readClocks()
+{
+  struct timespec ts;
 
-  if (gettimeofday(&tv, NULL) < 0)
+  if (gettimeofday(&(cachedTime.wallTime), NULL) < 0)
   {
     printf("gettimeofday error\n");
     abort();
   }
 
-  if (!localtime_r(&tv.tv_sec, &tm))
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+  {
+    printf("clock_gettime error\n");
+    abort();
+  }
+  cachedTime.monotonicTimeMillis =
+    (((int64_t)ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void updateCachedTime()
+{
+  readClocks();
+  cachedTime.updatedByThread = true;
+}
+
+int64_t getCachedMonotonicTimeMillis()
+{
+  if (!cachedTime.updatedByThread)
+  {
+    readClocks();
+  }
+  return cachedTime.monotonicTimeMillis;
+}
+
+void sleepMillis(int64_t millis)
+{
+  struct timespec ts;
+
+  ts.tv_sec = millis / 1000;
+  ts.tv_nsec = (millis % 1000) * 1000000;
+  while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR))
+  {
+    /* Interrupted by a signal, sleep for the time remaining. */
+  }
+}
+
+static void renderSecond(time_t second)
+{
+  struct tm tm;
+  size_t charsWritten;
+
+  if (!localtime_r(&second, &tm))
   {
     printf("localtime_r error\n");
     abort();
   }
 
-  charsWritten = strftime(buffer, 80, "%Y-%b-%d %H:%M:%S", &tm);
+  charsWritten = strftime(cachedTime.renderedSecondString,
+                          TIME_STRING_BUFFER_SIZE,
+                          "%Y-%b-%d %H:%M:%S", &tm);
   if (charsWritten == 0)
   {
     printf("strftime error\n");
     abort();
   }
-  else if (charsWritten > (80 - 7 - 1))
+  else if (charsWritten > (TIME_STRING_BUFFER_SIZE - 7 - 1))
   {
     printf("strftime overflow\n");
     abort();
   }
 
-  snprintf(&buffer[charsWritten], 8, ".%06lu", (unsigned long)tv.tv_usec);
-  printf("%s", buffer);
+  cachedTime.renderedSecond = second;
+  cachedTime.renderedSecondLength = charsWritten;
+}
+
+size_t formatTimeString(char* buffer)
+{
+  size_t length;
+  unsigned long usec;
+  int i;
+
+  if (!cachedTime.updatedByThread)
+  {
+    readClocks();
+  }
+
+  /* localtime_r and strftime only run when the second changes. */
+  if ((cachedTime.renderedSecondLength == 0) ||
+      (cachedTime.renderedSecond != cachedTime.wallTime.tv_sec))
+  {
+    renderSecond(cachedTime.wallTime.tv_sec);
+  }
+
+  length = cachedTime.renderedSecondLength;
+  memcpy(buffer, cachedTime.renderedSecondString, length);
+
+  usec = (unsigned long)cachedTime.wallTime.tv_usec;
+  buffer[length] = '.';
+  for (i = 6; i > 0; --i)
+  {
+    buffer[length + i] = (char)('0' + (usec % 10));
+    usec /= 10;
+  }
+  length += 7;
+  buffer[length] = '\0';
+  return length;
 }
@@ -17,6 +17,27 @@
 #ifndef TIMEUTIL_H
 #define TIMEUTIL_H
 
-extern void printTimeString();
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimum buffer size for formatTimeString. */
+#define TIME_STRING_BUFFER_SIZE (80)
+
+/* Each thread has a cached copy of the wall clock and the monotonic
+   clock.  Event loop threads call updateCachedTime once per iteration,
+   after that the functions below return the cached time of the
+   calling thread without a system call.  In threads that never call
+   updateCachedTime they read the clocks every time. */
+extern void updateCachedTime();
+
+/* Milliseconds from an arbitrary starting point, for timers. */
+extern int64_t getCachedMonotonicTimeMillis();
+
+/* Sleeps the calling thread for at least millis milliseconds. */
+extern void sleepMillis(int64_t millis);
+
+/* Write the cached local time to buffer, which must be at least
+   TIME_STRING_BUFFER_SIZE bytes.  Returns the string length. */
+extern size_t formatTimeString(char* buffer);
 
 #endif